@@ -0,0 +1,334 @@
+/*
+bench.c
+Micro-benchmarks of header parsing and encoding
+
+Copyright (c) 2015 Jason Lee
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE
+*/
+
+// the kernels are internal, so the library is built into the benchmark
+#include "tar.c"
+
+// number of synthetic headers
+#define SYNTHETIC   4096
+// each kernel is timed this many times and the fastest run is kept
+#define ROUNDS      3
+
+// headers the kernels run over
+struct corpus {
+    struct tar_t * headers;
+    size_t count;
+    struct stat * stats;            // sources of the synthetic headers
+    char (* names)[100];
+    size_t synthetic;
+};
+
+// a kernel runs over n headers, cycling through the corpus
+typedef unsigned long long (*bench_kernel)(struct corpus * corpus, const size_t n);
+
+struct bench {
+    const char * name;
+    bench_kernel run;
+    double ns;                      // per header
+};
+
+// keeps results alive so the kernels are not optimized away
+static volatile unsigned long long bench_sink;
+
+static double bench_clock(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// numeric fields parsed when reading a header
+static unsigned long long bench_oct2uint(struct corpus * corpus, const size_t n){
+    unsigned long long sum = 0;
+    for(size_t done = 0; done < n;){
+        for(size_t i = 0; (i < corpus -> count) && (done < n); i++, done++){
+            struct tar_t * entry = &corpus -> headers[i];
+            sum += oct2uint(entry -> size, 11) + oct2uint(entry -> mtime, 11) +
+                   oct2uint(entry -> mode, 7) + oct2uint(entry -> uid, 7) + oct2uint(entry -> gid, 7);
+        }
+    }
+    return sum;
+}
+
+static unsigned long long bench_checksum(struct corpus * corpus, const size_t n){
+    unsigned long long sum = 0;
+    for(size_t done = 0; done < n;){
+        for(size_t i = 0; (i < corpus -> count) && (done < n); i++, done++){
+            sum += calculate_checksum(&corpus -> headers[i]);
+        }
+    }
+    return sum;
+}
+
+// a header (first octet set) and a zeroed block (every octet read), as when finding the end of an archive
+static unsigned long long bench_iszeroed(struct corpus * corpus, const size_t n){
+    static char zero[512];
+    unsigned long long sum = 0;
+    for(size_t done = 0; done < n;){
+        for(size_t i = 0; (i < corpus -> count) && (done < n); i++, done++){
+            sum += iszeroed(corpus -> headers[i].block, 512) + iszeroed(zero, 512);
+        }
+    }
+    return sum;
+}
+
+// field encoding of format_tar_data, without the lstat
+static unsigned long long bench_format(struct corpus * corpus, const size_t n){
+    struct tar_t entry;
+    unsigned long long sum = 0;
+    for(size_t done = 0; done < n;){
+        for(size_t i = 0; (i < corpus -> synthetic) && (done < n); i++, done++){
+            format_tar_stat(&entry, corpus -> names[i], &corpus -> stats[i], 0);
+            sum += (unsigned char) entry.check[5];
+        }
+    }
+    return sum;
+}
+
+// long listing (tar tv) into a buffer that is flushed to /dev/null
+static unsigned long long bench_ls(struct corpus * corpus, const size_t n){
+    FILE * f = fopen("/dev/null", "w");
+    if (!f){
+        return 0;
+    }
+
+    static char buf[1 << 20];
+    struct lister list;
+    memset(&list, 0, sizeof(list));
+    list.f = f;
+    list.buf = buf;
+    list.size = sizeof(buf);
+    list.minute = -1;
+
+    for(size_t done = 0; done < n;){
+        for(size_t i = 0; (i < corpus -> count) && (done < n); i++, done++){
+            list_entry(&list, &corpus -> headers[i], TAR_LIST_TEXT, 2);
+        }
+    }
+    list_flush(&list);
+    fclose(f);
+    return list.len + list.error;
+}
+
+// headers made from lstat-like results with a spread of names, sizes, times and types
+static int synthesize(struct corpus * corpus){
+    corpus -> stats = calloc(SYNTHETIC, sizeof(struct stat));
+    corpus -> names = calloc(SYNTHETIC, sizeof(* corpus -> names));
+    corpus -> headers = calloc(SYNTHETIC, sizeof(struct tar_t));
+    if (!corpus -> stats || !corpus -> names || !corpus -> headers){
+        return -1;
+    }
+
+    static const mode_t types[] = {S_IFREG, S_IFREG, S_IFREG, S_IFREG, S_IFREG, S_IFDIR, S_IFIFO, S_IFCHR};
+    unsigned int seed = 12345;
+    for(size_t i = 0; i < SYNTHETIC; i++){
+        seed = seed * 1103515245 + 12345;
+        struct stat * st = &corpus -> stats[i];
+        st -> st_mode = types[i % (sizeof(types) / sizeof(types[0]))] | ((i & 1)?0755:0644);
+        st -> st_uid = getuid();
+        st -> st_gid = getgid();
+        st -> st_size = S_ISREG(st -> st_mode)?(seed >> (seed % 24)):0;
+        st -> st_mtime = 1400000000 + (seed % 300000000);
+        st -> st_rdev = makedev(i % 256, i % 7);
+        snprintf(corpus -> names[i], sizeof(corpus -> names[i]), "src/module%03zu/file%05zu.c", i / 64, i);
+
+        if (format_tar_stat(&corpus -> headers[i], corpus -> names[i], st, 0) < 0){
+            return -1;
+        }
+    }
+
+    corpus -> count = corpus -> synthetic = SYNTHETIC;
+    return 0;
+}
+
+// add the headers of an archive to the corpus
+static int add_archive(struct corpus * corpus, const char * name){
+    const int fd = open(name, O_RDONLY);
+    if (fd < 0){
+        fprintf(stderr, "Error: Unable to open %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    struct tar_t * archive = NULL;
+    if (tar_read(fd, &archive, 0) < 0){
+        close(fd);
+        fprintf(stderr, "Error: Unable to read %s\n", name);
+        return -1;
+    }
+    close(fd);
+
+    size_t count = 0;
+    for(struct tar_t * entry = archive; entry; entry = entry -> next){
+        count += entry -> type != EXTENDED;
+    }
+
+    struct tar_t * headers = realloc(corpus -> headers, (corpus -> count + count) * sizeof(struct tar_t));
+    if (!headers){
+        tar_free(archive);
+        return -1;
+    }
+    corpus -> headers = headers;
+
+    for(struct tar_t * entry = archive; entry; entry = entry -> next){
+        if (entry -> type != EXTENDED){
+            headers[corpus -> count] = *entry;
+            headers[corpus -> count++].next = NULL;
+        }
+    }
+
+    tar_free(archive);
+    return 0;
+}
+
+// compare against a saved run; returns the number of kernels slower than allowed
+static int compare(struct bench * benches, const size_t count, const char * name, const double tolerance){
+    FILE * f = fopen(name, "r");
+    if (!f){
+        fprintf(stderr, "Error: Unable to open baseline %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    int slower = 0;
+    char kernel[64];
+    double ns, rate;
+    printf("\n%-20s %12s %12s %9s\n", "kernel", "baseline", "ns/header", "change");
+    while (fscanf(f, "%63s %lf %lf", kernel, &ns, &rate) == 3){
+        for(size_t i = 0; i < count; i++){
+            if (strcmp(kernel, benches[i].name)){
+                continue;
+            }
+
+            const double change = (benches[i].ns - ns) * 100 / ns;
+            const int regressed = change > tolerance;
+            printf("%-20s %12.2f %12.2f %+8.1f%%%s\n", kernel, ns, benches[i].ns, change, regressed?" REGRESSION":"");
+            slower += regressed;
+        }
+    }
+
+    fclose(f);
+    return slower;
+}
+
+int main(int argc, char * argv[]){
+    size_t n = 1000000;
+    const char * save = NULL;
+    const char * baseline = NULL;
+    double tolerance = 10;
+
+    // a context of its own caches user and group names, as a long running program would
+    struct tar_ctx * ctx = tar_ctx_new();
+    if (!ctx){
+        fprintf(stderr, "Error: Unable to create context\n");
+        return 1;
+    }
+    tar_ctx_use(ctx);
+
+    struct corpus corpus;
+    memset(&corpus, 0, sizeof(corpus));
+    if (synthesize(&corpus) < 0){
+        fprintf(stderr, "Error: Unable to build synthetic headers\n");
+        return 1;
+    }
+
+    for(int i = 1; i < argc; i++){
+        if (!strcmp(argv[i], "-n") && (i + 1 < argc)){
+            n = strtoull(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-o") && (i + 1 < argc)){
+            save = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-c") && (i + 1 < argc)){
+            baseline = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-t") && (i + 1 < argc)){
+            tolerance = strtod(argv[++i], NULL);
+        }
+        else if (argv[i][0] == '-'){
+            fprintf(stdout, "Usage: %s [-n headers] [-o save] [-c baseline] [-t tolerance%%] [archive ...]\n"\
+                            "\n"\
+                            "    Times header kernels over %d synthetic headers and the headers of the given archives.\n"\
+                            "        -n - number of headers each kernel processes (default 1000000)\n"\
+                            "        -o - save the results as a baseline\n"\
+                            "        -c - compare with a baseline, failing if a kernel is slower by more than the tolerance\n"\
+                            "        -t - allowed slowdown in percent (default 10)\n"\
+                          , argv[0], SYNTHETIC);
+            return 0;
+        }
+        else if (add_archive(&corpus, argv[i]) < 0){
+            return 1;
+        }
+    }
+
+    struct bench benches[] = {
+        {"oct2uint",            bench_oct2uint, 0},
+        {"calculate_checksum",  bench_checksum, 0},
+        {"iszeroed",            bench_iszeroed, 0},
+        {"format_tar_stat",     bench_format,   0},
+        {"ls_entry",            bench_ls,       0},
+    };
+    const size_t count = sizeof(benches) / sizeof(benches[0]);
+
+    printf("%zu headers (%zu synthetic), %zu per kernel\n\n", corpus.count, corpus.synthetic, n);
+    printf("%-20s %12s %14s\n", "kernel", "ns/header", "headers/s");
+    for(size_t i = 0; i < count; i++){
+        for(int round = 0; round < ROUNDS; round++){
+            const double start = bench_clock();
+            bench_sink += benches[i].run(&corpus, n);
+            const double ns = (bench_clock() - start) / (n?n:1);
+            if (!round || (ns < benches[i].ns)){
+                benches[i].ns = ns;
+            }
+        }
+        printf("%-20s %12.2f %14.0f\n", benches[i].name, benches[i].ns, 1e9 / benches[i].ns);
+    }
+
+    int ret = 0;
+    if (save){
+        FILE * f = fopen(save, "w");
+        if (!f){
+            fprintf(stderr, "Error: Unable to open %s: %s\n", save, strerror(errno));
+            ret = 1;
+        }
+        else{
+            for(size_t i = 0; i < count; i++){
+                fprintf(f, "%s %.3f %.0f\n", benches[i].name, benches[i].ns, 1e9 / benches[i].ns);
+            }
+            fclose(f);
+        }
+    }
+
+    if (baseline){
+        const int slower = compare(benches, count, baseline, tolerance);
+        if (slower){
+            ret = 1;
+        }
+    }
+
+    free(corpus.headers);
+    free(corpus.stats);
+    free(corpus.names);
+    tar_ctx_use(NULL);
+    tar_ctx_free(ctx);
+    return ret;
+}
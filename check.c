@@ -0,0 +1,415 @@
+/*
+check.c
+Exercises library calls the commandline interface does not make (used by make test)
+
+Copyright (c) 2015 Jason Lee
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE
+*/
+
+#include <stdio.h>
+
+#include "tar.h"
+
+// print why a check failed and fail
+#define FAIL(fmt, ...) { fprintf(stderr, "Check failed: " fmt "\n", ##__VA_ARGS__); return 1; }
+
+// stop once this many members are done
+static int cancel_after(const struct tar_progress * progress, void * data){
+    return progress -> entries >= * (unsigned long long *) data;
+}
+
+// the call must have been cancelled, and say so
+static int cancelled(const int rc){
+    if (rc >= 0){
+        FAIL("call was not cancelled");
+    }
+    if (strncmp(tar_error(), "Cancelled", 9)){
+        FAIL("error is '%s' instead of a cancel", tar_error());
+    }
+    return 0;
+}
+
+// cancel-create count tarfile files...
+// cancel-remove count tarfile names...
+static int check_cancel(const int create, const unsigned long long count, const char * filename, const size_t filecount, const char * files[]){
+    struct tar_options options;
+    tar_get_options(&options);
+    options.progress = cancel_after;
+    options.progress_data = (void *) &count;
+    options.progress_interval = 0;
+    options.quiet = 1;
+    if (tar_set_options(&options) < 0){
+        FAIL("%s", tar_error());
+    }
+
+    const int fd = create?open(filename, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR):open(filename, O_RDWR);
+    if (fd < 0){
+        FAIL("unable to open %s", filename);
+    }
+
+    struct tar_t * archive = NULL;
+    int rc;
+    if (create){
+        rc = tar_write(fd, &archive, filecount, files, 0);
+    }
+    else if (tar_read(fd, &archive, 0) < 0){
+        close(fd);
+        FAIL("%s", tar_error());
+    }
+    else{
+        rc = tar_remove(fd, &archive, filecount, files, 0);
+    }
+
+    tar_free(archive);
+    close(fd);
+    return cancelled(rc);
+}
+
+// shards count prefix files...
+// writes each shard as a standalone archive named prefix.<shard>, with checksums
+static int check_shards(const size_t count, const char * prefix, const size_t filecount, const char * files[]){
+    struct tar_options options;
+    tar_get_options(&options);
+    options.checksums = 1;
+    if (tar_set_options(&options) < 0){
+        FAIL("%s", tar_error());
+    }
+
+    int fds[count];
+    for(size_t i = 0; i < count; i++){
+        char name[4096];
+        snprintf(name, sizeof(name), "%s.%zu", prefix, i);
+        if ((fds[i] = open(name, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR)) < 0){
+            FAIL("unable to open %s", name);
+        }
+    }
+
+    struct tar_t * archive = NULL;
+    const int rc = tar_write_sharded(fds, count, count, &archive, filecount, files, 0);
+    tar_free(archive);
+    for(size_t i = 0; i < count; i++){
+        close(fds[i]);
+    }
+
+    if (rc < 0){
+        FAIL("%s", tar_error());
+    }
+    return 0;
+}
+
+// reader tarfile names...
+// copies the data of each member to stdout through a reader
+static int check_reader(const char * filename, const size_t count, const char * names[]){
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0){
+        FAIL("unable to open %s", filename);
+    }
+
+    struct tar_reader * reader = tar_reader_open(fd, 1 << 20, 0);
+    if (!reader){
+        close(fd);
+        FAIL("%s", tar_error());
+    }
+
+    int ret = 0;
+    for(size_t i = 0; (i < count) && !ret; i++){
+        struct tar_member * member = tar_member_open(reader, names[i]);
+        if (!member){
+            fprintf(stderr, "Check failed: %s is not in %s\n", names[i], filename);
+            ret = 1;
+            break;
+        }
+
+        char buf[4096];
+        off_t offset = 0;
+        ssize_t got;
+        while ((got = tar_member_pread(member, buf, sizeof(buf), offset)) > 0){
+            fwrite(buf, 1, got, stdout);
+            offset += got;
+        }
+        if (got < 0){
+            fprintf(stderr, "Check failed: unable to read %s\n", names[i]);
+            ret = 1;
+        }
+        tar_member_close(member);
+    }
+
+    tar_reader_close(reader);
+    close(fd);
+    return ret;
+}
+
+// produces the alphabet over and over, failing after the octets given in data (if any)
+static ssize_t alphabet(void * data, char * buf, const size_t size){
+    size_t * left = data;
+    if (!*left){
+        return -1;
+    }
+
+    const size_t len = (size < *left)?size:*left;
+    for(size_t i = 0; i < len; i++){
+        buf[i] = 'a' + i % 26;
+    }
+    *left -= len;
+    return len;
+}
+
+// sources tarfile       - write buf, iov and produced members with checksums
+// sources-fail tarfile  - write buf, then a member whose producer stops early and one too large for a header
+static int check_sources(const int fail, const char * filename){
+    struct tar_options options;
+    tar_get_options(&options);
+    options.checksums = 1;
+    options.quiet = 1;
+    if (tar_set_options(&options) < 0){
+        FAIL("%s", tar_error());
+    }
+
+    const int fd = open(filename, O_RDWR | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0){
+        FAIL("unable to open %s", filename);
+    }
+
+    static const char text[] = "buffer data\n";
+    static char scatter[] = "scatter ";
+    static char gather[] = "gather\n";
+    const struct iovec iov[2] = {{scatter, 8}, {gather, 7}};
+    size_t left = fail?1000:52;
+
+    struct tar_source sources[3];
+    memset(sources, 0, sizeof(sources));
+    sources[0].name = "buf";
+    sources[0].mode = 0644;
+    sources[0].size = sizeof(text) - 1;
+    sources[0].buf = text;
+
+    sources[1].name = "iov";
+    sources[1].mode = 0644;
+    sources[1].size = 15;
+    sources[1].iov = iov;
+    sources[1].iovcnt = 2;
+
+    sources[2].name = "produced";
+    sources[2].mode = 0644;
+    sources[2].size = 52;
+    sources[2].producer = alphabet;
+    sources[2].data = &left;
+
+    struct tar_sink sink;
+    tar_sink_fd(&sink, fd);
+    struct tar_t * archive = NULL;
+    int ret = 0;
+    if (!fail){
+        if (tar_write_sources(&sink, &archive, 3, sources, 0) < 0){
+            ret = 1;
+            fprintf(stderr, "Check failed: %s\n", tar_error());
+        }
+    }
+    else{
+        // the producer runs dry 1000 octets into 4096
+        sources[1] = sources[2];
+        sources[1].size = 4096;
+        if (tar_write_sources(&sink, &archive, 2, sources, 0) >= 0){
+            ret = 1;
+            fprintf(stderr, "Check failed: a producer stopping early was not an error\n");
+        }
+        else{
+            size_t members = 0;
+            for(struct tar_t * entry = archive; entry; entry = entry -> next){
+                members += entry -> type != EXTENDED;
+            }
+            if (members != 1){
+                ret = 1;
+                fprintf(stderr, "Check failed: the failed member was kept\n");
+            }
+        }
+
+        // sizes have to fit 11 octal digits
+        sources[0].name = "huge";
+        sources[0].size = 1ULL << 33;
+        if (!ret && (tar_write_sources(&sink, &archive, 1, sources, 0) >= 0)){
+            ret = 1;
+            fprintf(stderr, "Check failed: a member of 8 GiB was accepted\n");
+        }
+    }
+
+    tar_free(archive);
+    close(fd);
+    return ret;
+}
+
+// encode chunk tarfile files...
+// archives files and a member from memory, reading the archive chunk octets at a time
+static int check_encode(const size_t chunk, const char * filename, const size_t filecount, const char * files[]){
+    struct tar_encoder * encoder = tar_encoder_new();
+    if (!encoder){
+        FAIL("%s", tar_error());
+    }
+
+    static const char text[] = "in memory\n";
+    struct tar_source source;
+    memset(&source, 0, sizeof(source));
+    source.name = "memory";
+    source.mode = 0644;
+    source.size = sizeof(text) - 1;
+    source.buf = text;
+
+    int ret = 0;
+    for(size_t i = 0; (i < filecount) && !ret; i++){
+        ret = tar_encoder_add_file(encoder, files[i], 0);
+    }
+    if (ret || (tar_encoder_add_source(encoder, &source, 0) < 0) || (tar_encoder_finish(encoder) < 0)){
+        tar_encoder_free(encoder);
+        FAIL("%s", tar_error());
+    }
+
+    FILE * f = fopen(filename, "w");
+    if (!f){
+        tar_encoder_free(encoder);
+        FAIL("unable to open %s", filename);
+    }
+
+    char buf[chunk];
+    ssize_t got;
+    while ((got = tar_encoder_read(encoder, buf, chunk)) > 0){
+        fwrite(buf, 1, got, f);
+    }
+
+    fclose(f);
+    tar_encoder_free(encoder);
+    if (got < 0){
+        FAIL("%s", (got == TAR_AGAIN)?"encoder ran out of members":tar_error());
+    }
+    return 0;
+}
+
+// decode chunk tarfile [name]
+// feeds an archive to a decoder chunk octets at a time, printing member names, or the data of the named member
+static int check_decode(const size_t chunk, const char * filename, const char * name){
+    FILE * f = fopen(filename, "r");
+    if (!f){
+        FAIL("unable to open %s", filename);
+    }
+
+    struct tar_decoder * decoder = tar_decoder_new();
+    if (!decoder){
+        fclose(f);
+        FAIL("%s", tar_error());
+    }
+
+    char buf[chunk];
+    size_t len;
+    int ended = 0;
+    int ret = 0;
+    unsigned long long received = 0;
+    while (!ended && !ret && (len = fread(buf, 1, chunk, f))){
+        // a piece can hold several events
+        size_t done = 0;
+        while (done < len){
+            struct tar_event event;
+            size_t used = 0;
+            const int rc = tar_decoder_feed(decoder, buf + done, len - done, &used, &event);
+            done += used;
+            if (rc == -1){
+                fprintf(stderr, "Check failed: %s\n", tar_error());
+                ret = 1;
+                break;
+            }
+            if (rc != 1){
+                continue;
+            }
+
+            if (event.type == TAR_EVENT_HEADER){
+                received = 0;
+                if (!name){
+                    printf("%.100s\n", event.entry -> name);
+                }
+            }
+            else if (event.type == TAR_EVENT_DATA){
+                received += event.size;
+                if (name && !strncmp(event.entry -> name, name, 100)){
+                    fwrite(event.data, 1, event.size, stdout);
+                }
+            }
+            else if (event.type == TAR_EVENT_END){
+                ended = 1;
+                break;
+            }
+        }
+    }
+
+    tar_decoder_free(decoder);
+    fclose(f);
+    if (!ret && !ended){
+        FAIL("no end of archive in %s", filename);
+    }
+    return ret;
+}
+
+int main(int argc, char * argv[]){
+    if (argc < 3){
+        fprintf(stdout, "Usage: %s check arguments\n"\
+                        "\n"\
+                        "    checks:\n"\
+                        "        cancel-create count tarfile files... - archive files, cancelling after count members\n"\
+                        "        cancel-remove count tarfile names... - remove members, cancelling after count members\n"\
+                        "        shards count prefix files...         - archive files with checksums as count standalone shards\n"\
+                        "        reader tarfile names...              - print the data of members read through a reader\n"\
+                        "        sources tarfile                      - write members from a buffer, an iovec and a producer\n"\
+                        "        sources-fail tarfile                 - write a member whose producer fails and one too large\n"\
+                        "        encode chunk tarfile files...        - archive files and a member from memory with an encoder\n"\
+                        "        decode chunk tarfile [name]          - list members, or print one, feeding a decoder in chunks\n"\
+                      , argv[0]);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "cancel-create") && (argc > 3)){
+        return check_cancel(1, strtoull(argv[2], NULL, 10), argv[3], argc - 4, (const char **) &argv[4]);
+    }
+    if (!strcmp(argv[1], "cancel-remove") && (argc > 3)){
+        return check_cancel(0, strtoull(argv[2], NULL, 10), argv[3], argc - 4, (const char **) &argv[4]);
+    }
+
+    if (!strcmp(argv[1], "shards") && (argc > 3)){
+        const size_t count = strtoull(argv[2], NULL, 10);
+        if (!count){
+            FAIL("need at least one shard");
+        }
+        return check_shards(count, argv[3], argc - 4, (const char **) &argv[4]);
+    }
+
+    if (!strcmp(argv[1], "reader")){
+        return check_reader(argv[2], argc - 3, (const char **) &argv[3]);
+    }
+
+    if (!strcmp(argv[1], "sources") || !strcmp(argv[1], "sources-fail")){
+        return check_sources(!strcmp(argv[1], "sources-fail"), argv[2]);
+    }
+
+    if (!strcmp(argv[1], "encode") && (argc > 3) && strtoull(argv[2], NULL, 10)){
+        return check_encode(strtoull(argv[2], NULL, 10), argv[3], argc - 4, (const char **) &argv[4]);
+    }
+    if (!strcmp(argv[1], "decode") && (argc > 3) && strtoull(argv[2], NULL, 10)){
+        return check_decode(strtoull(argv[2], NULL, 10), argv[3], (argc > 4)?argv[4]:NULL);
+    }
+
+    fprintf(stderr, "Error: Bad check: %s\n", argv[1]);
+    return 1;
+}
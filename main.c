@@ -28,6 +28,16 @@ THE SOFTWARE
 #include "tar.h"
 
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+// print a progress line to stderr
+static int print_progress(const struct tar_progress * progress, void * data){
+    fprintf(stderr, "%llu/%llu entries %llu/%llu bytes %.1fs %s\n",
+            progress -> entries, progress -> total_entries,
+            progress -> bytes, progress -> total_bytes,
+            progress -> elapsed, progress -> name);
+    return 0;
+}
 
 int main(int argc, char * argv[]){
     if (argc < 3){
@@ -39,19 +49,39 @@ int main(int argc, char * argv[]){
                         "    Only a subset of the functions the GNU tar utility has are supported.\n"
                         "\n"\
                         "    Special files that already exist will not be replaced when extracting (no error)\n"\
-                        "    Regular expression expansion/matching is not done.\n"\
+                        "    Names given to r, t and x select members exactly, by leading directory, or by wildcards (*, ?, [...]).\n"\
+                        "    A name given as --exclude=pattern deselects the members it matches.\n"\
+                        "    When creating an archive, a tarfile of '-' writes the archive to stdout.\n"\
+                        "    When listing an archive, a tarfile of '-' reads the archive from stdin.\n"\
                         "\n"\
                         "    options (only one allowed at a time):\n"\
                         "        a - append files to archive\n"\
+                        "        A - merge the archives given as sources into a new archive\n"\
                         "        c - create a new archive\n"\
                         "        d - diff the tar file with the workding directory\n"\
+                        "        m - compact archive by dropping older copies of members\n"\
                         "        r - remove files from the directory\n"\
                         "        t - list the files in the directory\n"\
                         "        u - update entries that have newer modification times\n"\
+                        "        W - verify data against stored checksums\n"\
                         "        x - extract from archive\n"\
                         "\n"\
                         "    other options:\n"\
+                        "        C - store checksums of file data when writing\n"\
+                        "        D - store files with the same data as earlier files as hard links to them\n"\
+                        "        I - do all I/O in the idle I/O scheduling class\n"\
+                        "        j - list as NDJSON (jj: as CSV, jjj: as binary records)\n"\
+                        "        k - do not rewrite files whose size and mod time match (kk: also compare data)\n"\
+                        "        n - stream data past the page cache (posix_fadvise, O_DIRECT)\n"\
+                        "        o - archive directory contents in inode order (oo: in on-disk order)\n"\
+                        "        R - record progress in tarfile.journal and resume from it (c, x) (RR: after every member)\n"\
+                        "        p - prefetch file data with reader threads while archiving\n"\
+                        "        P - print progress to stderr every second (PP: after every update)\n"\
+                        "        s - create archive in parallel shards\n"\
+                        "        S - create archive without keeping every header in memory\n"\
                         "        v - make operation verbose\n"\
+                        "        Z - reproducible archive: sorted names, numeric owners, modes 0644/0755,\n"\
+                        "            times clamped to $SOURCE_DATE_EPOCH (ZZ: also owner and group 0)\n"\
                         "\n"\
                         "Ex: %s vl archive.tar\n"\
                       , argv[0], argv[0], argv[0]);
@@ -62,25 +92,57 @@ int main(int argc, char * argv[]){
 
     int rc = 0;
     char a = 0,             // append
+         A = 0,             // merge
          c = 0,             // create
          d = 0,             // diff
+         m = 0,             // compact
          r = 0,             // remove
          t = 0,             // list
          u = 0,             // update
-         x = 0;             // extract
+         x = 0,             // extract
+         W = 0;             // verify
     char verbosity = 0;     // 0: no print; 1: print file names; 2: print file properties
+    char C = 0;             // checksums
+    char D = 0;             // deduplicate
+    char I = 0;             // idle I/O class
+    char j = 0;             // listing format
+    char k = 0;             // skip unchanged files
+    char n = 0;             // no caching
+    char o = 0;             // locality order
+    char p = 0;             // pipelined reads
+    char P = 0;             // progress
+    char R = 0;             // resumable
+    char s = 0;             // sharded create
+    char S = 0;             // streaming create
+    char Z = 0;             // reproducible
 
     // parse options
     for(int i = 0; argv[1][i]; i++){
         switch (argv[1][i]){
             case 'a': a = 1; break;
+            case 'A': A = 1; break;
             case 'c': c = 1; break;
             case 'd': d = 1; break;
+            case 'm': m = 1; break;
             case 'r': r = 1; break;
             case 't': t = 1; break;
             case 'u': u = 1; break;
             case 'x': x = 1; break;
+            case 'W': W = 1; break;
+            case 'C': C = 1; break;
+            case 'D': D = 1; break;
+            case 'I': I = 1; break;
+            case 'j': j++; break;
+            case 'k': k++; break;
+            case 'n': n = 1; break;
+            case 'o': o++; break;
+            case 'p': p = 1; break;
+            case 'P': P++; break;
+            case 'R': R++; break;
+            case 's': s = 1; break;
+            case 'S': S = 1; break;
             case 'v': verbosity++; break;
+            case 'Z': Z++; break;
             case '-': break;
             default:
                 fprintf(stderr, "Error: Bad option: %c\n", argv[1][i]);
@@ -91,32 +153,218 @@ int main(int argc, char * argv[]){
     }
 
     // make sure only one of these options was selected
-    const char used = a + c + d + r + t + u + x;
+    const char used = a + A + c + d + m + r + t + u + x + W;
     if (used > 1){
         fprintf(stderr, "Error: Cannot have so all of these flags at once\n");
         return -1;
     }
     else if (used < 1){
-        fprintf(stderr, "Error: Need one of 'acdlrux' options set\n");
+        fprintf(stderr, "Error: Need one of 'aAcdmrtuxW' options set\n");
         return -1;
     }
 
+    // journal of a resumable create or extract
+    char journal[strlen(argv[2]) + 9];
+    snprintf(journal, sizeof(journal), "%s.journal", argv[2]);
+    const int resume = R && !access(journal, F_OK);
+
+    if (C || D || I || k || n || o || p || P || R || Z){
+        struct tar_options options;
+        tar_get_options(&options);
+        if (C){
+            options.checksums = 1;
+        }
+        if (D){
+            options.dedup = 1;
+        }
+        if (I){
+            options.idle = 1;
+        }
+        if (k){
+            options.skip = TAR_SKIP_STAT | ((k > 1) ? TAR_SKIP_CONTENT : 0);
+        }
+        if (o){
+            options.order = (o > 1)?TAR_ORDER_EXTENT:TAR_ORDER_INODE;
+        }
+        if (n){
+            options.io = TAR_IO_FADVISE | TAR_IO_DIRECT;
+        }
+        if (p){
+            options.readers = 2;
+        }
+        if (P){
+            options.progress = print_progress;
+            if (P > 1){
+                options.progress_interval = 0;
+            }
+        }
+        if (Z){
+            options.reproducible = 1;
+            const char * epoch = getenv("SOURCE_DATE_EPOCH");
+            if (epoch && *epoch){
+                char * end = NULL;
+                options.clamp_mtime = strtoll(epoch, &end, 10);
+                if (*end || (options.clamp_mtime < 0)){
+                    fprintf(stderr, "Error: Bad SOURCE_DATE_EPOCH: %s\n", epoch);
+                    return -1;
+                }
+            }
+            if (Z > 1){
+                options.owner = 0;
+                options.group = 0;
+            }
+        }
+        if (R){
+            options.journal = journal;
+            options.resume = resume;
+            if (R > 1){
+                options.checkpoint = 0;
+            }
+        }
+        if (tar_set_options(&options) < 0){
+            return -1;
+        }
+    }
+
     const char * filename = argv[2];
     const char ** files = (const char **) &argv[3];
 
+    // move exclude patterns out of the file list
+    const char * excludes[argc + 1];
+    size_t excludecount = 0;
+    int filecount = 0;
+    for(int i = 0; i < argc; i++){
+        if (!strncmp(files[i], "--exclude=", 10)){
+            excludes[excludecount++] = files[i] + 10;
+        }
+        else{
+            files[filecount++] = files[i];
+        }
+    }
+    argc = filecount;
+
     // //////////////////////////////////////////
 
     struct tar_t * archive = NULL;
     int fd = -1;
-    if (c){             // create new file
+    if (c && !strncmp(filename, "-", 2)){
+        if (verbosity){
+            fprintf(stderr, "Error: Cannot print file names while writing archive to stdout\n");
+            return -1;
+        }
+
+        struct tar_sink sink;
+        tar_sink_pipe(&sink, STDOUT_FILENO);
+        if (S){
+            if (tar_write_stream(&sink, argc, files, 0, verbosity) < 0){
+                rc = -1;
+            }
+        }
+        else if (tar_write_sink(&sink, &archive, argc, files, verbosity) < 0){
+            rc = -1;
+        }
+    }
+    else if (c){        // create new file
+        if ((fd = open(filename, (resume?O_RDWR:(O_WRONLY | O_TRUNC)) | O_CREAT, S_IRUSR | S_IWUSR)) == -1){
+            fprintf(stderr, "Error: Unable to open file %s\n", filename);
+            return -1;
+        }
+
+        if (s){
+            if (tar_write_sharded(&fd, 1, 4, &archive, argc, files, verbosity) < 0){
+                rc = -1;
+            }
+        }
+        else if (S){
+            struct tar_sink sink;
+            tar_sink_fd(&sink, fd);
+            if (tar_write_stream(&sink, argc, files, 0, verbosity) < 0){
+                rc = -1;
+            }
+        }
+        else if (tar_write(fd, &archive, argc, files, verbosity) < 0){
+            rc = -1;
+        }
+    }
+    else if (A){        // merge archives without extracting them
         if ((fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR)) == -1){
             fprintf(stderr, "Error: Unable to open file %s\n", filename);
             return -1;
         }
 
-        if (tar_write(fd, &archive, argc, files, verbosity) < 0){
+        struct tar_input inputs[argc + 1];
+        int opened = 0;
+        for(; opened < argc; opened++){
+            inputs[opened].archive = NULL;
+            if (((inputs[opened].fd = open(files[opened], O_RDONLY)) < 0) ||
+                (tar_read(inputs[opened].fd, &inputs[opened].archive, verbosity) < 0)){
+                fprintf(stderr, "Error: Unable to read archive %s\n", files[opened]);
+                tar_free(inputs[opened].archive);
+                if (inputs[opened].fd >= 0){
+                    close(inputs[opened].fd);
+                }
+                rc = -1;
+                break;
+            }
+        }
+
+        // only exclusions apply, since the sources are archives
+        struct tar_filter * filter = NULL;
+        if (!rc && excludecount && !(filter = tar_filter_compile(0, NULL, excludecount, excludes))){
+            fprintf(stderr, "Error: Unable to compile file list\n");
+            rc = -1;
+        }
+
+        struct tar_sink sink;
+        tar_sink_fd(&sink, fd);
+        if (!rc && (tar_transform(&sink, &archive, argc, inputs, filter, NULL, NULL, verbosity) < 0)){
+            fprintf(stderr, "Exiting with error due to previous error\n");
+            rc = -1;
+        }
+
+        tar_filter_free(filter);
+        for(int i = 0; i < opened; i++){
+            tar_free(inputs[i].archive);
+            close(inputs[i].fd);
+        }
+    }
+    else if (a){        // append without reading entries
+        if ((fd = open(filename, O_RDWR)) < 0){
+            fprintf(stderr, "Error: Unable to open file %s\n", filename);
+            return -1;
+        }
+
+        if (tar_append(fd, argc, files, verbosity) < 0){
+            fprintf(stderr, "Exiting with error due to previous error\n");
+            rc = -1;
+        }
+    }
+    else if (t && !strncmp(filename, "-", 2)){
+        // list an archive read from stdin as it arrives
+        struct tar_filter * filter = NULL;
+        struct tar_decoder * decoder = tar_decoder_new();
+        if (!decoder || ((argc || excludecount) && !(filter = tar_filter_compile(argc, files, excludecount, excludes)))){
+            fprintf(stderr, "Error: Unable to set up listing\n");
+            tar_decoder_free(decoder);
+            return -1;
+        }
+
+        struct tar_event event;
+        int got;
+        while ((got = tar_decoder_recv(decoder, STDIN_FILENO, &event)) == 1){
+            if ((event.type == TAR_EVENT_HEADER) && (ls_entry(stdout, (struct tar_t *) event.entry, filter, verbosity + 1) < 0)){
+                got = -1;
+                break;
+            }
+        }
+
+        if (got < 0){
+            fprintf(stderr, "Exiting with error due to previous error\n");
             rc = -1;
         }
+
+        tar_filter_free(filter);
+        tar_decoder_free(decoder);
     }
     else{
         // open existing file
@@ -132,17 +380,29 @@ int main(int argc, char * argv[]){
             return -1;
         }
 
+        // compile member selection
+        struct tar_filter * filter = NULL;
+        if ((argc || excludecount) && !(filter = tar_filter_compile(argc, files, excludecount, excludes))){
+            fprintf(stderr, "Error: Unable to compile file list\n");
+            tar_free(archive);
+            close(fd);
+            return -1;
+        }
+
         // perform operation
-        if ((a && (tar_write(fd, &archive, argc, files, verbosity) < 0))          ||  // append
-            (d && (tar_diff(stdout, archive, verbosity) < 0))                     ||  // diff with current working directory
-            (r && (tar_remove(fd, &archive, argc, files, verbosity) < 0))         ||  // remove entries
-            (t && (tar_ls(stdout, archive, argc, files, verbosity + 1) < 0))      ||  // list entries
+        if ((d && (tar_diff(stdout, archive, verbosity) < 0))                     ||  // diff with current working directory
+            (m && (tar_compact(fd, &archive, verbosity) < 0))                     ||  // drop shadowed entries
+            (r && (tar_remove_filter(fd, &archive, filter, verbosity) < 0))       ||  // remove entries
+            (t && (tar_ls_format(stdout, archive, filter, MIN(j, TAR_LIST_BINARY), verbosity + 1) < 0)) ||  // list entries
             (u && (tar_update(fd, &archive, argc, files, verbosity) < 0))         ||  // update entries
-            (x && (tar_extract(fd, archive, argc, files, verbosity) < 0))             // extract entries
+            (x && (tar_extract_filter(fd, archive, filter, verbosity) < 0))       ||  // extract entries
+            (W && (tar_verify(fd, archive, verbosity) < 0))                           // verify checksums
             ){
             fprintf(stderr, "Exiting with error due to previous error\n");
             rc = -1;
         }
+
+        tar_filter_free(filter);
     }
 
     tar_free(archive);
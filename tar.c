@@ -1,22 +1,292 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // O_DIRECT, sync_file_range
+#endif
+
 #include "tar.h"
 
+#if defined(__linux__)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 // only print in verbose mode
 #define V_PRINT(f, fmt, ...) if (verbosity) { fprintf(f, fmt "\n", ##__VA_ARGS__); }
-// generic error
-#define ERROR(fmt, ...) fprintf(stderr, "Error: " fmt "\n", ##__VA_ARGS__); return -1;
+// generic error (recorded in the current context)
+#define ERROR(fmt, ...) report(fmt, ##__VA_ARGS__); return -1;
 // capture errno when erroring
 #define RC_ERROR(fmt, ...) const int rc = errno; ERROR(fmt, ##__VA_ARGS__); return -1;
 #define WRITE_ERROR(fmt, ...) { ERROR(fmt, ##__VA_ARGS__); tar_free(*archive); *archive = NULL; return -1; }
 #define EXIST_ERROR(fmt, ...) const int rc = errno; if (rc != EEXIST) { ERROR(fmt, ##__VA_ARGS__); return -1; }
 
+// extended header record holding the checksum of the following entry's data
+#define CRC_KEYWORD     "LIBTAR.crc32c"
+#define CRC_RECORD_LEN  26      // strlen("26 LIBTAR.crc32c=01234567\n")
+
+// name of extended headers filling space left behind by a member replaced with a shorter one
+#define FILLER_NAME     "PaxHeaders/@padding"
+
+// size and alignment of buffers used to copy file data
+#define COPYSIZE        65536
+#define DIRECT_ALIGN    4096
+// amount of data passed through before its pages are dropped
+#define DROP_WINDOW     (8 << 20)
+// largest read-ahead requested for a run of adjacent members being extracted
+#define MERGE_WINDOW    (16 << 20)
+
+// read-ahead used by tar_read; grows while headers are dense and shrinks after seeking past data
+#define SCAN_MIN        (64 << 10)
+#define SCAN_MAX        (4 << 20)
+#define SCAN_ALIGN      4096
+
+// buffered view of an archive being scanned by tar_read
+struct scanner {
+    int fd;
+    char * buf;                     // SCAN_MAX + BLOCKSIZE octets
+    size_t len;                     // number of valid octets
+    size_t pos;                     // next unused octet
+    size_t chunk;                   // current read-ahead
+    off_t at;                       // file offset of buf[len]
+    int pipe;                       // archive can only be read in order
+    int error;                      // errno of a failed read (0 = none)
+};
+
+#ifndef FNM_LEADING_DIR
+#define FNM_LEADING_DIR 0       // wildcard patterns then have to match whole names
+#endif
+
+// pattern ending at (literal) or starting from (wildcard) a node of a filter tree
+struct filter_pattern {
+    const char * glob;              // whole pattern if it has wildcards, else NULL
+    size_t index;                   // position in the list given to tar_filter_compile
+    struct filter_pattern * next;
+};
+
+// one character of a filter tree; the path from the root spells a literal prefix
+struct filter_node {
+    char c;
+    struct filter_pattern * patterns;
+    struct filter_node * child;     // first node one character further
+    struct filter_node * sibling;   // next node with the same parent
+};
+
+struct tar_filter {
+    struct filter_node * include;
+    struct filter_node * exclude;
+    size_t count;                   // number of include patterns
+    size_t excludecount;
+    char ** patterns;               // copies of the include patterns followed by the exclude patterns
+};
+
+// record an error in the current context and print it unless the context is quiet
+static void report(const char * fmt, ...);
+
 // force read() to complete
 static int read_size(int fd, char * buf, int size);
 
+// force pread() to complete
+static int pread_size(int fd, char * buf, int size, off_t offset);
+
+// force pwrite() to complete
+static int pwrite_size(int fd, const char * buf, int size, off_t offset);
+
 // force write() to complete
 static int write_size(int fd, char * buf, int size);
 
+// add a pattern to a filter tree
+static int filter_add(struct filter_node * root, const char * pattern, const size_t index);
+
+// walk a filter tree along name; returns index + 1 of the first pattern found, or 0
+// if seen is not NULL, every matching pattern is marked in it
+static size_t filter_match(const struct filter_node * root, const char * name, char * seen);
+
+// free a filter tree
+static void filter_free(struct filter_node * node);
+
+// directory entry waiting to be archived
+struct child {
+    char * path;
+    ino_t ino;
+    unsigned long long key;         // position on disk used by current() -> options.order
+};
+
+// file with more than one name, remembered until all of its names were seen
+struct link_entry {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t remaining;             // names still to come (0 = free slot; UINT64_MAX = named on the command line)
+    char name[100];                 // member name of the first name
+};
+
+// hard link state of a streaming create
+struct link_table {
+    struct link_entry * slots;      // open addressing with linear probing
+    size_t size;                    // power of 2
+    size_t count;
+    FILE * spill;                   // sorted runs of entries that did not fit in memory
+    off_t * runs;                   // offset of each run, followed by the end of the last one
+    size_t runcount;
+};
+
+// state of tar_write_stream
+struct stream {
+    struct tar_sink * sink;
+    struct link_table links;
+    off_t offset;
+    char verbosity;
+};
+
+// find the first name of a file (and forget it after its last name); returns 1 if found
+static int link_find(struct link_table * links, const struct stat * st, char * name);
+
+// remember the first name of a file
+static int link_add(struct link_table * links, const struct stat * st, const char * name, const uint64_t remaining);
+
+// write out the table as a sorted run and empty it
+static int link_spill(struct link_table * links);
+
+// write a file, and everything under it if it is a directory
+static int stream_file(struct stream * stream, const char * path, const int top);
+
+// file considered by dedup_entries
+struct dedup {
+    struct tar_t * entry;
+    unsigned int size;
+    size_t index;                   // position in the archive
+    uint32_t crc;
+    int state;                      // 1 = hashed, -1 = unreadable
+    struct tar_t * same;            // earlier file with the same data
+};
+
+// turn files whose data matches an earlier file's into hard links, then lay out the entries from offset again
+static int dedup_entries(struct tar_t ** archive, int * offset, const char verbosity);
+
+// check whether two files start with the same size octets
+static int same_data(const char * a, const char * b, const unsigned int size);
+
+// check whether two entries have the same mode, owner and modification time (a hard link shares them)
+static int same_metadata(struct tar_t * a, struct tar_t * b);
+
+// order directory contents are archived in (TAR_ORDER_*, 0 = readdir order)
+static int member_order(void);
+
+// find where a file lives on disk (options.order)
+static void locality_key(struct child * child);
+
+// sort by locality key
+static int compare_children(const void * a, const void * b);
+
+// read ahead an archive range holding several selected members
+static void advise_willneed(const int fd, const off_t from, const off_t to);
+
+// metadata of an extracted directory, applied after everything inside it was written
+struct restore_entry {
+    char name[101];
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    long long mtime;
+    int depth;                      // number of '/' in name
+};
+
+// directories waiting for their metadata
+struct restore {
+    struct restore_entry * entries;
+    size_t count;
+    size_t size;
+    int owner;                      // restore ownership and exact modes (running as root)
+};
+
+// listing output being formatted
+struct lister {
+    FILE * f;
+    char * buf;
+    size_t size;
+    size_t len;
+    long long minute;               // start of the minute formatted in stamp (-1 = none)
+    char stamp[64];                 // " YYYY-MM-DD HH:MM "
+    size_t stamplen;
+    int error;
+};
+
+// write out formatted listing data
+static void list_flush(struct lister * list);
+
+// add octets to the listing
+static void list_bytes(struct lister * list, const char * data, const size_t size);
+
+// add a decimal number to the listing
+static void list_uint(struct lister * list, unsigned long long value);
+
+// add a string quoted for JSON or CSV
+static void list_quoted(struct lister * list, const char * str, const size_t max, const int format);
+
+// add one entry to the listing
+static void list_entry(struct lister * list, struct tar_t * entry, const int format, const char verbosity);
+
+// name a file gets in an archive (without leading "/", "./" or "../")
+static const char * member_name(const char * filename);
+
+// last entry (other than extended headers) with the given member name, or the directory with that name
+static struct tar_t * latest(struct tar_t * archive, const char * name);
+
+// overwrite an entry with the current contents of filename if they fit into its space
+// returns 1 if the entry was replaced, 0 if it has to be appended instead
+static int replace_entry(const int fd, struct tar_t * entry, const char * filename, const char verbosity);
+
+// extended header that readers skip, covering the given number of blocks
+static int write_filler(struct tar_sink * sink, const unsigned int blocks);
+
+// move data towards the start of a file, with copy_file_range where possible
+static int move_data(const int fd, const off_t from, const off_t to, const size_t size);
+
+// progress of a checkpointed tar_write or tar_extract
+struct journal {
+    int fd;                         // journal file (-1 = no journal)
+    int sync;                       // file descriptor whose file system holds the completed work
+    char op;                        // 'c' (create) or 'x' (extract)
+    size_t count;                   // members completed
+    off_t offset;                   // end of the last completed member in the archive
+    off_t last;                     // offset of the last record
+    char name[100];                 // name of the last completed member
+};
+
+// open the journal set in the options; when resuming, load its record
+static int journal_open(struct journal * journal, const char op, const int sync);
+
+// check that the last member the journal says is complete is where it was
+static int journal_matches(struct journal * journal, struct tar_t * last);
+
+// record a completed member, making the work up to it durable first once enough has been done
+static int journal_checkpoint(struct journal * journal, struct tar_t * entry, const int force);
+
+// close the journal, removing it if the work is done
+static void journal_close(struct journal * journal, const int done);
+
+// write collected entries, recording progress in the journal and skipping what it says is already written
+static int write_checkpointed(struct tar_sink * sink, struct tar_t * entry, const char verbosity);
+
+// copy archive data from a file descriptor to offset to of a sink, in the kernel when possible
+static int copy_range(const int fd, const off_t from, struct tar_sink * sink, const off_t to, const size_t size);
+
+// FNV-1a hash of a member name
+static size_t hash_name(const char * name);
+
+// whether the file at the entry's path already holds the entry's data (options.skip)
+static int unchanged(const int fd, struct tar_t * entry);
+
+// get the next block of an archive being scanned (NULL at end of file)
+static const char * scan_block(struct scanner * scan);
+
+// copy the next size octets of an archive being scanned
+static int scan_read(struct scanner * scan, char * buf, const size_t size);
+
+// move past size octets of an archive being scanned
+static int scan_skip(struct scanner * scan, const size_t size);
+
 // convert octal string to unsigned integer
 static unsigned int oct2uint(char * oct, unsigned int size);
 
@@ -26,6 +296,226 @@ static int iszeroed(char * buf, size_t size);
 // make directory recursively
 static int recursive_mkdir(const char * dir, const unsigned int mode, const char verbosity);
 
+// whether or not an entry type carries file data
+static int has_data(struct tar_t * entry);
+
+// number of octets an entry takes up in the archive (metadata, data, padding)
+static unsigned int entry_span(struct tar_t * entry);
+
+// whether an entry is an extended or GNU long name header belonging to the member after it
+static int prefix_header(struct tar_t * entry);
+
+// full name a long name header or the path record of an extended header gives the member after it
+// name is set to NULL if the header does not give one, and is freed by the caller otherwise
+static int long_name(const int fd, struct tar_t * header, char ** name);
+
+// find the member a run of extended and long name headers starting at first belongs to, and its full name
+// name is set to NULL if the headers do not give one, and is freed by the caller otherwise
+static int group_name(const int fd, struct tar_t * first, struct tar_t ** member, char ** name);
+
+// check arguments and move sink past the last entry of archive
+// tail is set to the end of the list and offset to the location of new entries
+static int begin_append(struct tar_sink * sink, struct tar_t ** archive, struct tar_t *** tail, int * offset, const char verbosity);
+
+// write end data after new entries and clean up
+static int end_append(struct tar_sink * sink, struct tar_t ** archive, const int offset, const char verbosity);
+
+// free the entries of a member that could not be written and end the archive where it started
+// returns -1
+static int abandon_append(struct tar_sink * sink, struct tar_t ** first, const int offset, const char verbosity);
+
+// write a member whose data comes from memory or a callback
+static int write_source(struct tar_sink * sink, struct tar_t * entry, const struct tar_source * source, const char verbosity);
+
+// force sink write to complete
+static int sink_write(struct tar_sink * sink, const char * buf, const int size);
+
+// write metadata of an entry
+// extended headers are followed by their record, which is filled in later if the sink can seek
+static int write_header(struct tar_sink * sink, struct tar_t * entry, const char verbosity);
+
+// store checksum of data just written in the extended header in front of the entry
+static int finish_checksum(struct tar_sink * sink, struct tar_t * entry, const uint32_t crc, const char verbosity);
+
+// checksum of the first size octets of a file
+static int file_crc32c(const char * path, const unsigned int size, uint32_t * crc);
+
+// write the checksum record of an extended header into a block
+static int format_crc_record(char * record, const uint32_t crc);
+
+// write zeros until the end of the block containing size octets
+static int write_padding(struct tar_sink * sink, const unsigned int size);
+
+// stat files and build their headers without writing anything
+static int collect_entries(struct tar_t ** archive, struct tar_t ** head, const size_t filecount, const char * files[], int * offset, const char verbosity);
+
+// write one prepared entry (metadata, data, padding)
+static int write_entry(struct tar_sink * sink, struct tar_t * entry, const char verbosity);
+
+// write prepared entries while reader threads prefetch file data into a ring of buffers
+static int write_entries_pipelined(struct tar_sink * sink, struct tar_t * archive, const char verbosity);
+
+// open a file for its data using the current I/O mode
+// direct should be set if O_DIRECT is acceptable to the caller, and is cleared if it was not used
+static int open_data(const char * path, const int flags, const mode_t mode, int * direct);
+
+// allocate a buffer usable for O_DIRECT transfers
+static char * alloc_data(const size_t size);
+
+// tell the kernel that a file will be accessed sequentially
+static void advise_sequential(const int fd);
+
+// write back (if dirty) and drop cached pages in [from, to)
+static void drop_cache(const int fd, const off_t from, const off_t to, const int dirty);
+
+// drop cached pages behind pos once a window has been passed since mark
+static void drop_behind(const int fd, off_t * mark, const off_t pos, const int dirty);
+
+// settings every context starts with
+#define DEFAULT_OPTIONS {                                   \
+    0,                  /* readers */                       \
+    8,                  /* buffers */                       \
+    1 << 20,            /* buffer_size */                   \
+    0,                  /* io */                            \
+    0,                  /* checksums */                     \
+    0,                  /* skip */                          \
+    0,                  /* order */                         \
+    0,                  /* quiet */                         \
+    NULL,               /* journal */                       \
+    1 << 28,            /* checkpoint */                    \
+    0,                  /* resume */                        \
+    0,                  /* rate_bytes */                    \
+    0,                  /* rate_ops */                      \
+    0,                  /* idle */                          \
+    0,                  /* dedup */                         \
+    NULL,               /* progress */                      \
+    NULL,               /* progress_data */                 \
+    1000,               /* progress_interval */             \
+    0,                  /* reproducible */                  \
+    -1,                 /* clamp_mtime */                   \
+    -1,                 /* owner */                         \
+    -1,                 /* group */                         \
+}
+
+// largest piece of a kernel copy, so rate limits stay smooth
+#define THROTTLE_CHUNK  (8 << 20)
+
+// idle I/O scheduling class (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)
+#define IOPRIO_IDLE     (3 << 13)
+
+// number of user and group names remembered by a context
+#define NAME_CACHE      64
+
+// user or group name looked up by id
+struct name_entry {
+    unsigned int id;
+    int state;                      // 0 = empty, 1 = has name, -1 = id has no name
+    char name[32];
+};
+
+// token buckets shared by the threads using a context
+struct throttle {
+    pthread_mutex_t lock;           // also guards the rate_* options
+    double bytes;                   // tokens available; negative when owed
+    double ops;
+    struct timespec last;           // when tokens were last added
+};
+
+// progress of the call a context is running
+struct progress {
+    pthread_mutex_t lock;
+    struct tar_progress info;
+    char name[101];
+    struct timespec start;
+    struct timespec last;           // time of the last callback
+    int active;                     // a call reporting progress is running
+    int calling;                    // the callback is running
+    int cancelled;                  // the callback asked to stop
+};
+
+struct tar_ctx {
+    struct tar_options options;
+    char error[256];                // last error message
+    pthread_mutex_t error_lock;     // shard and reader threads report concurrently
+    int cache;                      // whether names are cached (not in the shared default context)
+    struct name_entry users[NAME_CACHE];
+    struct name_entry groups[NAME_CACHE];
+    struct throttle throttle;
+    struct progress progress;
+};
+
+// context of threads that have not bound one
+static struct tar_ctx default_ctx = { .options = DEFAULT_OPTIONS, .error_lock = PTHREAD_MUTEX_INITIALIZER, .throttle = { .lock = PTHREAD_MUTEX_INITIALIZER }, .progress = { .lock = PTHREAD_MUTEX_INITIALIZER } };
+
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+
+// context bound to the calling thread, or the default context
+static struct tar_ctx * current(void);
+
+// wait until the current context's rate limits allow an I/O request of size octets
+static void throttle(const size_t size);
+
+// start reporting progress of a call (totals of 0 are unknown)
+static void progress_begin(const unsigned long long total_bytes, const unsigned long long total_entries);
+
+// count work done, calling the progress callback if it is due; name is the member being worked on (NULL = same)
+static void progress_add(const unsigned long long bytes, const unsigned long long entries, const char * name);
+
+// whether the progress callback asked to stop
+static int progress_cancelled(void);
+
+// forget a cancel of an earlier call
+static void progress_reset(void);
+
+// report the final progress of a call
+static void progress_end(void);
+
+// extract one entry, queueing directory metadata in restore
+static int extract_queued(const int fd, struct tar_t * entry, struct restore * restore, const char verbosity);
+
+// set owner and mode of an extracted file through its open descriptor
+static int restore_fd(const int f, struct tar_t * entry, struct restore * restore);
+
+// set owner and modification time of an extracted link, device or pipe
+static int restore_path(struct tar_t * entry, struct restore * restore);
+
+// queue the metadata of an extracted directory
+static int restore_add(struct restore * restore, struct tar_t * entry);
+
+// apply queued directory metadata, deepest first, and empty the queue
+static int restore_apply(struct restore * restore);
+
+// octets of data extracting entry writes
+static unsigned long long extract_size(struct tar_t * entry);
+
+// stop extracting before entry if the progress callback asked to; returns 1 if it did
+static int extract_cancelled(struct tar_t * entry, struct tar_t * prev);
+
+// end the archive before entry if the progress callback asked to stop; returns 1 if it did
+static int write_cancelled(struct tar_sink * sink, struct tar_t * entry, struct tar_t * prev);
+
+// move the calling thread into the idle I/O class if the options ask for it
+// returns the priority to restore, or -1 if nothing changed
+static int io_idle(void);
+
+// undo io_idle
+static void io_restore(const int prio);
+
+// bodies of the public functions that run in the idle I/O class
+static int write_sink(struct tar_sink * sink, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity);
+// for each entry, the index of the last hard link to it (its own index if there is none)
+static int open_groups(struct tar_t * archive, size_t ** reach);
+
+static int write_sharded(const int fds[], const size_t fdcount, const size_t shards, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity);
+static int append_files(const int fd, const size_t filecount, const char * files[], const char verbosity);
+static int extract_filter(const int fd, struct tar_t * archive, const struct tar_filter * filter, const char verbosity);
+static int transform(struct tar_sink * sink, struct tar_t ** archive, const size_t count, const struct tar_input inputs[], const struct tar_filter * filter, tar_rewrite rewrite, void * data, const char verbosity);
+
+// look up the name of a user or group id through the current context's cache
+// returns 1 if a name was found, 0 if there is none, -1 on error
+static int id_name(const int group, const unsigned int id, char * name, const size_t size);
+
 int tar_read(const int fd, struct tar_t ** archive, const char verbosity){
     if (fd < 0){
         ERROR("Bad file descriptor");
@@ -35,46 +525,65 @@ int tar_read(const int fd, struct tar_t ** archive, const char verbosity){
         ERROR("Bad archive");
     }
 
+    struct scanner scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.fd = fd;
+    scan.chunk = SCAN_MIN;
+    scan.pipe = (lseek(fd, 0, SEEK_CUR) == (off_t) (-1)) && (errno == ESPIPE);
+    if (!(scan.buf = malloc(SCAN_MAX + BLOCKSIZE))){
+        ERROR("Unable to allocate read buffer");
+    }
+
     unsigned int offset = 0;
     int count = 0;
+    int ret = 0;
 
     struct tar_t ** tar = archive;
-    char update = 1;
+    struct tar_t ext;               // records of an extended header waiting for their entry
+    memset(&ext, 0, sizeof(ext));
+
+    advise_sequential(fd);
 
     for(count = 0; ; count++){
-        *tar = calloc(1, sizeof(struct tar_t));
-        if (update && (read_size(fd, (*tar) -> block, 512) != 512)){
-            V_PRINT(stderr, "Error: Bad read. Stopping");
-            tar_free(*tar);
-            *tar = NULL;
+        // the end of the file ends an archive without end data
+        const char * block = scan_block(&scan);
+        if (!block){
+            if (scan.error){
+                report("Unable to read archive: %s", strerror(scan.error));
+                ret = -1;
+            }
             break;
         }
 
-        update = 1;
         // if current block is all zeros
-        if (iszeroed((*tar) -> block, 512)){
-            if (read_size(fd, (*tar) -> block, 512) != 512){
-                V_PRINT(stderr, "Error: Bad read. Stopping");
-                tar_free(*tar);
-                *tar = NULL;
+        if (iszeroed((char *) block, 512)){
+            if (!(block = scan_block(&scan))){
+                if (scan.error){
+                    report("Unable to read archive: %s", strerror(scan.error));
+                    ret = -1;
+                }
                 break;
             }
 
             // check if next block is all zeros as well
-            if (iszeroed((*tar) -> block, 512)){
-                tar_free(*tar);
-                *tar = NULL;
-
+            if (iszeroed((char *) block, 512)){
                 // skip to end of record
-                if (lseek(fd, RECORDSIZE - (offset % RECORDSIZE), SEEK_CUR) == (off_t) (-1)){
-                    RC_ERROR("Unable to seek file: %s", strerror(rc));
-                }
-
+                const unsigned int end = offset + 1024;
+                scan_skip(&scan, (RECORDSIZE - end % RECORDSIZE) % RECORDSIZE);
                 break;
             }
 
-            update = 0;
+            // a lone zero block is skipped
+            offset += 512;
+        }
+
+        *tar = calloc(1, sizeof(struct tar_t));
+        if (!*tar){
+            ret = -1;
+            report("Unable to allocate entry");
+            break;
         }
+        memcpy((*tar) -> block, block, 512);
 
         // set current entry's file offset
         (*tar) -> begin = offset;
@@ -85,17 +594,44 @@ int tar_read(const int fd, struct tar_t ** archive, const char verbosity){
             jump += 512 - (jump % 512);
         }
 
-        // move file descriptor
+        // records of an extended header apply to the next entry
+        if ((*tar) -> type != EXTENDED){
+            (*tar) -> crc32c = ext.crc32c;
+            (*tar) -> has_crc32c = ext.has_crc32c;
+            ext.has_crc32c = 0;
+        }
+
         offset += 512 + jump;
-        if (lseek(fd, jump, SEEK_CUR) == (off_t) (-1)){
-            RC_ERROR("Unable to seek file: %s", strerror(rc));
+        if ((*tar) -> type == EXTENDED){
+            char * records = malloc(jump + 1);
+            if (!records || (scan_read(&scan, records, jump) < 0)){
+                free(records);
+                ret = -1;
+                report("Unable to read extended header");
+                break;
+            }
+
+            if (parse_extended(records, oct2uint((*tar) -> size, 11), &ext) < 0){
+                V_PRINT(stderr, "Warning: Bad extended header at %u", (*tar) -> begin);
+            }
+            free(records);
+        }
+        else if (scan_skip(&scan, jump) < 0){
+            const int rc = errno;
+            ret = -1;
+            report("Unable to seek file: %s", strerror(rc));
+            break;
         }
 
         // ready next value
         tar = &((*tar) -> next);
     }
 
-    return count;
+    free(scan.buf);
+
+    drop_cache(fd, 0, offset, 0);
+
+    return ret?ret:count;
 }
 
 int tar_write(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
@@ -103,991 +639,5862 @@ int tar_write(const int fd, struct tar_t ** archive, const size_t filecount, con
         ERROR("Bad file descriptor");
     }
 
-    if (!archive){
-        ERROR("Bad archive");
-    }
+    struct tar_sink sink;
+    tar_sink_fd(&sink, fd);
+    return tar_write_sink(&sink, archive, filecount, files, verbosity);
+}
 
-    // where file descriptor offset is
-    int offset = 0;
+int tar_write_sink(struct tar_sink * sink, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
+    const int prio = io_idle();
+    const int ret = write_sink(sink, archive, filecount, files, verbosity);
+    io_restore(prio);
+    return ret;
+}
 
-    // if there is old data
-    struct tar_t ** tar = archive;
-    if (*tar){
-        // skip to last entry
-        while (*tar && (*tar) -> next){
-            tar = &((*tar) -> next);
-        }
+int write_sink(struct tar_sink * sink, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
+    progress_reset();
 
-        // get offset past final entry
-        unsigned int jump = 512 + oct2uint((*tar) -> size, 11);
-        if (jump % 512){
-            jump += 512 - (jump % 512);
+    int offset = 0;
+    struct tar_t ** tar = NULL;
+    if (begin_append(sink, archive, &tar, &offset, verbosity) < 0){
+        return -1;
+    }
+
+    // write entries first
+    if (current() -> options.journal){
+        if (filecount && !files){
+            ERROR("Non-zero file count provided, but file list is NULL");
         }
 
-        // move file descriptor
-        offset = (*tar) -> begin + jump;
-        if (lseek(fd, offset, SEEK_SET) == (off_t) (-1)){
-            RC_ERROR("Unable to seek file: %s", strerror(rc));
+        if ((collect_entries(tar, archive, filecount, files, &offset, verbosity) < 0) ||
+            (write_checkpointed(sink, *tar, verbosity) < 0)){
+            // a cancel keeps its own message
+            if (progress_cancelled()){
+                return -1;
+            }
+            WRITE_ERROR("Failed to write entries");
         }
-        tar = &((*tar) -> next);
     }
-
-    // write entries first
-    if (write_entries(fd, tar, archive, filecount, files, &offset, verbosity) < 0){
+    else if (write_entries(sink, tar, archive, filecount, files, &offset, verbosity) < 0){
+        if (progress_cancelled()){
+            return -1;
+        }
         WRITE_ERROR("Failed to write entries");
     }
 
-    // write ending data
-    if (write_end_data(fd, offset, verbosity) < 0){
-        ERROR("Failed to write end data");
+    if (end_append(sink, archive, offset, verbosity) < 0){
+        return -1;
     }
 
-    // clear original names from data
-    tar = archive;
-    while (*tar){
-        memset((*tar) -> name, 0, 100);
-        tar = &((*tar) -> next);
+    // nothing is left to resume
+    if (current() -> options.journal && (unlink(current() -> options.journal) < 0) && (errno != ENOENT)){
+        RC_ERROR("Unable to remove journal %s: %s", current() -> options.journal, strerror(rc));
     }
-    return offset;
-}
 
-void tar_free(struct tar_t * archive){
-    while (archive){
-        struct tar_t * next = archive -> next;
-        free(archive);
-        archive = next;
-    }
+    return 0;
 }
 
-int tar_ls(FILE * f, struct tar_t * archive, const size_t filecount, const char * files[], const char verbosity){
-    if (!verbosity){
-        return 0;
-    }
-
-    if (filecount && !files){
-        ERROR("Non-zero file count provided, but file list is NULL");
+int tar_write_sources(struct tar_sink * sink, struct tar_t ** archive, const size_t count, const struct tar_source sources[], const char verbosity){
+    if (count && !sources){
+        ERROR("Non-zero source count provided, but source list is NULL");
     }
 
-    while (archive){
-        if (ls_entry(f, archive, filecount, files, verbosity) < 0){
-            return -1;
-        }
-        archive = archive -> next;
+    int offset = 0;
+    struct tar_t ** tar = NULL;
+    if (begin_append(sink, archive, &tar, &offset, verbosity) < 0){
+        return -1;
     }
 
-    return 0;
-}
+    for(size_t i = 0; i < count; i++){
+        // where the member starts, in the list and in the archive
+        struct tar_t ** first = tar;
+        const int start = offset;
 
-int tar_extract(const int fd, struct tar_t * archive, const size_t filecount, const char * files[], const char verbosity){
-    int ret = 0;
+        *tar = calloc(1, sizeof(struct tar_t));
+        if (!*tar){
+            report("Unable to allocate entry");
+            return abandon_append(sink, first, start, verbosity);
+        }
 
-    // extract entries with given names
-    if (filecount){
-        if (!files){
-            ERROR("Received non-zero file count but got NULL file list");
+        if (format_tar_source(*tar, &sources[i], verbosity) < 0){
+            report("Bad source %s", sources[i].name?sources[i].name:"(null)");
+            return abandon_append(sink, first, start, verbosity);
         }
 
-        while (archive){
-            for(size_t i = 0; i < filecount; i++){
-                if (!strncmp(archive -> name, files[i], MAX(strlen(archive -> name), strlen(files[i])))){
-                    if (lseek(fd, archive -> begin, SEEK_SET) == (off_t) (-1)){
-                        RC_ERROR("Unable to seek file: %s", strerror(rc));
-                    }
+        // checksums of data from a producer are only known afterwards, so they need a sink that can seek
+        if (current() -> options.checksums && has_data(*tar) && sources[i].size && (!sources[i].producer || sink -> seek)){
+            struct tar_t * ext = calloc(1, sizeof(struct tar_t));
+            if (!ext){
+                report("Unable to allocate extended header");
+                return abandon_append(sink, first, start, verbosity);
+            }
 
-                    if (extract_entry(fd, archive, verbosity) < 0){
-                        ret = -1;
+            format_extended(ext, *tar);
+            ext -> begin = offset;
+            ext -> next = *tar;
+            *tar = ext;
+
+            if (!sources[i].producer){
+                // data is already in memory
+                if (sources[i].iov){
+                    size_t got = 0;
+                    for(int j = 0; (j < sources[i].iovcnt) && (got < sources[i].size); j++){
+                        const size_t len = MIN(sources[i].iov[j].iov_len, sources[i].size - got);
+                        ext -> next -> crc32c = crc32c(ext -> next -> crc32c, sources[i].iov[j].iov_base, len);
+                        got += len;
                     }
-                    break;
+                }
+                else if (sources[i].buf){
+                    ext -> next -> crc32c = crc32c(0, sources[i].buf, sources[i].size);
                 }
             }
-            archive = archive -> next;
-        }
-    }
-    // extract all
-    else{
-        // move offset to beginning
-        if (lseek(fd, 0, SEEK_SET) == (off_t) (-1)){
-            RC_ERROR("Unable to seek file: %s", strerror(rc));
-        }
 
-        // extract each entry
-        while (archive){
-            if (extract_entry(fd, archive, verbosity) < 0){
-                ret = -1;
+            if (write_header(sink, ext, verbosity) < 0){
+                report("Failed to write extended header");
+                return abandon_append(sink, first, start, verbosity);
             }
-            archive = archive -> next;
+
+            offset += entry_span(ext);
+            tar = &ext -> next;
+        }
+
+        (*tar) -> begin = offset;
+        if (write_source(sink, *tar, &sources[i], verbosity) < 0){
+            report("Failed to write source %zu", i);
+            return abandon_append(sink, first, start, verbosity);
         }
+
+        offset += entry_span(*tar);
+        tar = &((*tar) -> next);
     }
 
-    return ret;
+    return end_append(sink, archive, offset, verbosity);
 }
 
-int tar_update(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
-    if (!filecount){
-        return 0;
+int abandon_append(struct tar_sink * sink, struct tar_t ** first, const int offset, const char verbosity){
+    tar_free(*first);
+    *first = NULL;
+
+    // what was written of the failed member is overwritten, if the sink allows it
+    if (sink -> seek && (sink -> seek(sink -> data, offset) != (off_t) (-1))){
+        write_end_data(sink, offset, verbosity);
     }
+    return -1;
+}
 
-    if (filecount && !files){
-        ERROR("Non-zero file count provided, but file list is NULL");
+// sink writing to a fixed position of a file descriptor, so several can share one file
+struct position {
+    int fd;
+    off_t offset;
+};
+
+static ssize_t position_write(void * data, const char * buf, const size_t size){
+    struct position * pos = data;
+    ssize_t rc;
+    do {
+        rc = pwrite(pos -> fd, buf, size, pos -> offset);
+    } while ((rc < 0) && (errno == EINTR));
+
+    if (rc > 0){
+        pos -> offset += rc;
     }
+    return rc;
+}
 
-    // buffer for subset of files that need to be updated
-    char ** newer = calloc(filecount, sizeof(char *));
+static off_t position_seek(void * data, const off_t offset){
+    return ((struct position *) data) -> offset = offset;
+}
 
-    struct stat st;
-    int count = 0;
-    int all = 1;
+static void position_sink(struct tar_sink * sink, struct position * pos, const int fd, const off_t offset){
+    pos -> fd = fd;
+    pos -> offset = offset;
+    sink -> write = position_write;
+    sink -> seek = position_seek;
+    sink -> data = pos;
+    sink -> fd = fd;
+}
 
-    // check each source to see if it was updated
-    struct tar_t * tar = *archive;
-    for(int i = 0; i < filecount; i++){
-        // make sure original file exists
-        if (lstat(files[i], &st)){
-            all = 0;
-            RC_ERROR("Could not stat %s: %s", files[i], strerror(rc));
+// entries written by one writer thread
+struct shard {
+    struct tar_t * first;
+    size_t count;
+    int fd;
+    int standalone;                 // shard is its own archive and needs end data
+    char verbosity;
+    struct tar_ctx * ctx;           // context of the calling thread
+    int ret;
+};
+
+static void * shard_writer(void * arg){
+    struct shard * shard = arg;
+    const char verbosity = shard -> verbosity;
+    tar_ctx_use(shard -> ctx);
+
+    struct position pos;
+    struct tar_sink sink;
+    position_sink(&sink, &pos, shard -> fd, shard -> count?shard -> first -> begin:0);
+
+    off_t mark = pos.offset;
+    struct tar_t * entry = shard -> first;
+    for(size_t i = 0; i < shard -> count; i++, entry = entry -> next){
+        if (write_entry(&sink, entry, verbosity) < 0){
+            report("Failed to write %s", entry -> original_name);
+            shard -> ret = -1;
+            return NULL;
         }
+        drop_behind(shard -> fd, &mark, pos.offset, 1);
+    }
 
-        // find the file in the archive
-        struct tar_t * old = exists(tar, files[i], 1);
-        newer[count] = calloc(strlen(files[i]) + 1, sizeof(char));
-
-        // if there is an older version, check its timestamp
-        if (old){
-            if (st.st_mtime > oct2uint(old -> mtime, 11)){
-                strncpy(newer[count++], files[i], strlen(files[i]));
-                V_PRINT(stdout, "%s", files[i]);
-            }
-        }
-        // if there is no older version, just add it
-        else{
-            strncpy(newer[count++], files[i], strlen(files[i]));
-            V_PRINT(stdout, "%s", files[i]);
+    if (shard -> standalone){
+        const int end = write_end_data(&sink, pos.offset, verbosity);
+        if (end < 0){
+            shard -> ret = -1;
+            return NULL;
         }
+        drop_cache(shard -> fd, 0, pos.offset, 1);
     }
 
-    // update listed files only
-    if (tar_write(fd, archive, count, (const char **) newer, verbosity) < 0){
-        ERROR("Unable to update archive");
+    return NULL;
+}
+
+// slot of a name in a table of entry indices + 1, found by linear probing
+static size_t find_name(struct tar_t ** entries, const size_t * names, const size_t size, const char * name){
+    size_t j = hash_name(name) & (size - 1);
+    while (names[j] && strncmp(entries[names[j] - 1] -> name, name, sizeof(entries[0] -> name))){
+        j = (j + 1) & (size - 1);
     }
+    return j;
+}
 
-    // cleanup
-    for(int i = 0; i < count; i++){
-        free(newer[i]);
+int open_groups(struct tar_t * archive, size_t ** reach){
+    size_t count = 0;
+    for(struct tar_t * entry = archive; entry; entry = entry -> next){
+        count++;
     }
-    free(newer);
 
-    return all?0:-1;
+    size_t size = 16;
+    while (size < 2 * count){
+        size *= 2;
+    }
+
+    // names seen so far, as indices + 1
+    size_t * names = calloc(size, sizeof(size_t));
+    struct tar_t ** entries = calloc(count + 1, sizeof(struct tar_t *));
+    *reach = calloc(count + 1, sizeof(size_t));
+    if (!names || !entries || !*reach){
+        free(names);
+        free(entries);
+        free(*reach);
+        *reach = NULL;
+        ERROR("Unable to allocate memory");
+    }
+
+    size_t i = 0;
+    for(struct tar_t * entry = archive; entry; entry = entry -> next, i++){
+        entries[i] = entry;
+        (*reach)[i] = i;
+
+        // a name filling its field has no terminator
+        char key[sizeof(entry -> name) + 1];
+        size_t j;
+        if (entry -> type == HARDLINK){
+            snprintf(key, sizeof(key), "%.*s", (int) sizeof(entry -> link_name), entry -> link_name);
+            j = find_name(entries, names, size, key);
+            if (names[j]){
+                (*reach)[names[j] - 1] = i;
+            }
+        }
+
+        // hard links to a hard link reach its target through it
+        if (!prefix_header(entry)){
+            snprintf(key, sizeof(key), "%.*s", (int) sizeof(entry -> name), entry -> name);
+            j = find_name(entries, names, size, key);
+            names[j] = i + 1;
+        }
+    }
+
+    free(names);
+    free(entries);
+    return 0;
 }
 
-int tar_remove(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
-    if (fd < 0){
-        return -1;
+int tar_write_sharded(const int fds[], const size_t fdcount, const size_t shards, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
+    const int prio = io_idle();
+    const int ret = write_sharded(fds, fdcount, shards, archive, filecount, files, verbosity);
+    io_restore(prio);
+    return ret;
+}
+
+int write_sharded(const int fds[], const size_t fdcount, const size_t shards, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
+    if (!fds || !shards || ((fdcount != 1) && (fdcount != shards))){
+        ERROR("Need either one file descriptor or one per shard");
     }
 
-    // archive has to exist
-    if (!archive || !*archive){
-        ERROR("Got bad archive");
+    for(size_t i = 0; i < fdcount; i++){
+        if (fds[i] < 0){
+            ERROR("Bad file descriptor");
+        }
+        advise_sequential(fds[i]);
+    }
+
+    if (!archive || *archive){
+        ERROR("Bad archive");
     }
 
     if (filecount && !files){
         ERROR("Non-zero file count provided, but file list is NULL");
     }
 
-    if (!filecount){
-        V_PRINT(stderr, "No entries specified");
-        return 0;
+    // lay out the whole archive first
+    int offset = 0;
+    if (collect_entries(archive, archive, filecount, files, &offset, verbosity) < 0){
+        return -1;
     }
 
-    // get file permissions
-    struct stat st;
-    if (fstat(fd, &st)){
-        RC_ERROR("Unable to stat archive: %s", strerror(rc));
+    struct shard * shard = calloc(shards, sizeof(struct shard));
+    pthread_t * threads = calloc(shards, sizeof(pthread_t));
+    if (!shard || !threads){
+        free(shard);
+        free(threads);
+        ERROR("Unable to allocate shards");
     }
 
-    // reset offset of original file
-    if (lseek(fd, 0, SEEK_SET) == (off_t) (-1)){
-        RC_ERROR("Unable to seek file: %s", strerror(rc));
+    // the list may not be cut between a header and the member it belongs to, or inside a hard link group,
+    // since a standalone shard has to hold both
+    size_t * reach = NULL;
+    if (open_groups(*archive, &reach) < 0){
+        free(shard);
+        free(threads);
+        return -1;
     }
 
-    // find first file to be removed that does not exist
-    int ret = 0;
-    for(int i = 0; i < filecount; i++){
-        if (!exists(*archive, files[i], 0)){
-            ERROR("'%s' not found in archive", files[i]);
+    // cut the list wherever the running total passes the next multiple of total / shards
+    size_t k = 0;
+    size_t i = 0;
+    size_t open = 0;                // last entry of a hard link group that has started
+    unsigned long long done = 0;
+    for(struct tar_t * entry = *archive; entry; entry = entry -> next, i++){
+        if (!shard[k].count){
+            shard[k].first = entry;
         }
-    }
-
-    unsigned int read_offset = 0;
-    unsigned int write_offset = 0;
-    struct tar_t * prev = NULL;
-    struct tar_t * curr = *archive;
-    while(curr){
-        // get original size
-        int total = 512;
+        shard[k].count++;
+        open = MAX(open, reach[i]);
 
-        if ((curr -> type == REGULAR) || (curr -> type == NORMAL) || (curr -> type == CONTIGUOUS)){
-            total += oct2uint(curr -> size, 11);
-            if (total % 512){
-                total += 512 - (total % 512);
+        done += entry_span(entry);
+        if ((k + 1 < shards) && !prefix_header(entry) && (open <= i) && (done * shards >= (k + 1) * (unsigned long long) offset)){
+            k++;
+        }
+    }
+    free(reach);
+
+    for(i = 0; i < shards; i++){
+        shard[i].fd = fds[(fdcount == 1)?0:i];
+        shard[i].standalone = (fdcount != 1);
+        shard[i].verbosity = verbosity;
+        shard[i].ctx = current();
+
+        // standalone shards start at the beginning of their own archive
+        if (shard[i].standalone && shard[i].count){
+            const unsigned int base = shard[i].first -> begin;
+            struct tar_t * entry = shard[i].first;
+            for(size_t j = 0; j < shard[i].count; j++, entry = entry -> next){
+                entry -> begin -= base;
             }
         }
+    }
 
-        const int match = check_match(curr, filecount, files);
+    int ret = 0;
+    size_t started = 0;
+    for(started = 0; started < shards; started++){
+        if (pthread_create(&threads[started], NULL, shard_writer, &shard[started])){
+            report("Unable to start writer thread");
+            ret = -1;
+            break;
+        }
+    }
 
-        if (match < 0){
-            ERROR("Match failed");
+    for(size_t i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+        if (shard[i].ret < 0){
+            ret = -1;
         }
-        else if (!match){
-            // if the old data is not in the right place, move it
-            if (write_offset < read_offset){
-                int got = 0;
-                while (got < total){
-                    // go to old data
-                    if (lseek(fd, read_offset, SEEK_SET) == (off_t) (-1)){
-                        RC_ERROR("Cannot seek: %s", strerror(rc));
-                    }
-
-                    char buf[512];
+    }
 
-                    // copy chunk out
-                    if (read_size(fd, buf, 512) != 512){// guarenteed 512 octets
-                        ERROR("Read error");
-                    }
+    free(threads);
+    free(shard);
 
-                    // go to new position
-                    if (lseek(fd, write_offset, SEEK_SET) == (off_t) (-1)){
-                        RC_ERROR("Cannot seek: %s", strerror(rc));
-                    }
+    if (ret < 0){
+        ERROR("Failed to write shards");
+    }
 
-                    // write data in
-                    if (write_size(fd, buf, 512) != 512){
-                        RC_ERROR("Write error: %s", strerror(rc));
-                    }
+    // the single archive is finished after the last shard
+    if (fdcount == 1){
+        struct position pos;
+        struct tar_sink sink;
+        position_sink(&sink, &pos, fds[0], offset);
+        const int end = write_end_data(&sink, offset, verbosity);
+        if (end < 0){
+            ERROR("Failed to write end data");
+        }
+        drop_cache(fds[0], 0, offset + end, 1);
+    }
 
-                    // increment offsets
-                    got += 512;
-                    read_offset += 512;
-                    write_offset += 512;
-                }
-            }
-            else{
-                read_offset += total;
-                write_offset += total;
+    // clear original names from data
+    for(struct tar_t * tar = *archive; tar; tar = tar -> next){
+        memset(tar -> original_name, 0, 100);
+    }
 
-                // skip past data
-                if (lseek(fd, read_offset, SEEK_SET) == (off_t) (-1)){
-                    RC_ERROR("Cannot seek: %s", strerror(rc));
-                }
-            }
-            prev = curr;
-            curr = curr -> next;
-        }
-        else{// if name matches, skip the data
-            struct tar_t * tmp = curr;
-            if (!prev){
-                *archive = curr -> next;
-                if (*archive){
-                    (*archive) -> begin = 0;
-                }
-            }
-            else{
-                prev -> next = curr -> next;
+    return (fdcount == 1)?offset:0;
+}
 
-                if (prev -> next){
-                    prev -> next -> begin = curr -> begin;
-                }
-            }
-            curr = curr -> next;
-            free(tmp);
+int tar_write_stream(struct tar_sink * sink, const size_t filecount, const char * files[], const size_t memory, const char verbosity){
+    if (!sink || !sink -> write){
+        ERROR("Bad sink");
+    }
 
-            // next read starts after current entry
-            read_offset += total;
-        }
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
     }
 
-    // resize file
-    if (ftruncate(fd, write_offset) < 0){
-        RC_ERROR("Could not truncate file: %s", strerror(rc));
+    struct stream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.sink = sink;
+    stream.verbosity = verbosity;
+
+    // largest table that fits in the budget
+    const size_t budget = memory?memory:(8 << 20);
+    stream.links.size = 64;
+    while ((stream.links.size * 2 * sizeof(struct link_entry)) <= budget){
+        stream.links.size *= 2;
+    }
+    if (!(stream.links.slots = calloc(stream.links.size, sizeof(struct link_entry)))){
+        ERROR("Unable to allocate hard link table");
     }
 
-    // add end data
-    if (write_end_data(fd, write_offset, verbosity) < 0){
-        V_PRINT(stderr, "Error: Could not close file");
+    const int prio = io_idle();
+    if (sink -> fd >= 0){
+        advise_sequential(sink -> fd);
     }
 
-    return ret;
-}
+    // nothing is known about what is left
+    progress_begin(0, 0);
 
-int tar_diff(FILE * f, struct tar_t * archive, const char verbosity){
-    struct stat st;
-    while (archive){
-        V_PRINT(f, "%s", archive -> name);
+    int ret = 0;
+    for(size_t i = 0; (i < filecount) && !ret; i++){
+        ret = stream_file(&stream, files[i], 1);
+    }
 
-        // if not found, print error
-        if (lstat(archive -> name, &st)){
-            int rc = errno;
-            fprintf(f, "Could not ");
-            if (archive -> type == SYMLINK){
-                fprintf(f, "readlink");
-            }
-            else{
-                fprintf(f, "stat");
-            }
-            fprintf(f, " %s: %s", archive -> name, strerror(rc));
+    // a cancelled archive still gets its end
+    if (!ret || progress_cancelled()){
+        const int end = write_end_data(sink, stream.offset, verbosity);
+        if (end < 0){
+            ret = -1;
+            report("Failed to write end data");
         }
-        else{
-            if (st.st_mtime != oct2uint(archive -> mtime, 11)){
-                fprintf(f, "%s: Mod time differs", archive -> name);
-            }
-            if (st.st_size != oct2uint(archive -> size, 11)){
-                fprintf(f, "%s: Mod time differs", archive -> name);
-            }
+        else if (sink -> fd >= 0){
+            drop_cache(sink -> fd, 0, stream.offset + end, 1);
         }
+    }
 
-        archive = archive -> next;
+    progress_end();
+    io_restore(prio);
+    free(stream.links.slots);
+    free(stream.links.runs);
+    if (stream.links.spill){
+        fclose(stream.links.spill);
     }
-    return 0;
+    return ret;
 }
 
-int print_entry_metadata(FILE * f, struct tar_t * entry){
-    if (!entry){
-        return -1;
+int stream_file(struct stream * stream, const char * path, const int top){
+    if (progress_cancelled()){
+        ERROR("Cancelled before %s", path);
     }
+    progress_add(0, 1, path);
 
-    time_t mtime = oct2uint(entry -> mtime, 12);
-    char mtime_str[32];
-    strftime(mtime_str, sizeof(mtime_str), "%c", localtime(&mtime));
-    fprintf(f, "File Name: %s\n", entry -> name);
-    fprintf(f, "File Mode: %s (%03o)\n", entry -> mode, oct2uint(entry -> mode, 8));
-    fprintf(f, "Owner UID: %s (%d)\n", entry -> uid, oct2uint(entry -> uid, 12));
-    fprintf(f, "Owner GID: %s (%d)\n", entry -> gid, oct2uint(entry -> gid, 12));
-    fprintf(f, "File Size: %s (%d)\n", entry -> size, oct2uint(entry -> size, 12));
-    fprintf(f, "Time     : %s (%s)\n", entry -> mtime, mtime_str);
-    fprintf(f, "Checksum : %s\n", entry -> check);
-    fprintf(f, "File Type: ");
-    switch (entry -> type){
-        case REGULAR: case NORMAL:
-            fprintf(f, "Normal File");
-            break;
-        case HARDLINK:
-            fprintf(f, "Hard Link");
-            break;
-        case SYMLINK:
-            fprintf(f, "Symbolic Link");
-            break;
-        case CHAR:
-            fprintf(f, "Character Special");
-            break;
-        case BLOCK:
-            fprintf(f, "Block Special");
-            break;
-        case DIRECTORY:
-            fprintf(f, "Directory");
-            break;
-        case FIFO:
-            fprintf(f, "FIFO");
-            break;
-        case CONTIGUOUS:
-            fprintf(f, "Contiguous File");
-            break;
+    struct stat st;
+    if (lstat(path, &st)){
+        RC_ERROR("Cannot stat %s: %s", path, strerror(rc));
     }
-    fprintf(f, " (%c)\n", entry -> type?entry -> type:'0');
-    fprintf(f, "Link Name: %s\n", entry -> link_name);
-    fprintf(f, "Ustar\\000: %c%c%c%c%c\\%2x\\%2x\\%02x\n",   entry -> ustar[0], entry -> ustar[1], entry -> ustar[2], entry -> ustar[3], entry -> ustar[4], entry -> ustar[5], entry -> ustar[6], entry -> ustar[7]);
-    fprintf(f, "Username : %s\n", entry -> owner);
-    fprintf(f, "Group    : %s\n", entry -> group);
-    fprintf(f, "Major    : %s\n", entry -> major);
-    fprintf(f, "Minor    : %s\n", entry -> minor);
-    fprintf(f, "Prefix   : %s\n", entry -> prefix);
-    fprintf(f, "\n");
 
-    return 0;
-}
+    struct tar_t entry;
+    if (format_tar_stat(&entry, path, &st, stream -> verbosity) < 0){
+        ERROR("Failed to stat %s", path);
+    }
 
-int print_tar_metadata(FILE * f, struct tar_t * archive){
-    while (archive){
-        print_entry_metadata(f, archive);
-        archive = archive -> next;
+    const int dir = (entry.type == DIRECTORY);
+    if (dir){
+        const size_t namelen = strlen(entry.name);
+        if (namelen && (namelen < 99) && (entry.name[namelen - 1] != '/')){
+            entry.name[namelen] = '/';
+            entry.name[namelen + 1] = '\0';
+            calculate_checksum(&entry);
+        }
     }
-    return 0;
-}
+    else if (has_data(&entry) || (entry.type == SYMLINK)){
+        // files named on the command line are remembered like files with several names
+        const int linked = top || (st.st_nlink > 1);
+        char first[100];
+        const int found = linked?link_find(&stream -> links, &st, first):0;
+        if (found < 0){
+            return -1;
+        }
 
-struct tar_t * exists(struct tar_t * archive, const char * filename, const char ori){
-    while (archive){
-        if (ori){
-            if (!strncmp(archive -> original_name, filename, MAX(strlen(archive -> original_name), strlen(filename)) + 1)){
-                return archive;
-            }
+        if (found){
+            entry.type = HARDLINK;
+            memcpy(entry.link_name, first, sizeof(entry.link_name));
+            memset(entry.size, '0', sizeof(entry.size) - 1);
+            calculate_checksum(&entry);
         }
-        else{
-            if (!strncmp(archive -> name, filename, MAX(strlen(archive -> name), strlen(filename)) + 1)){
-                return archive;
-            }
+        else if (linked && (link_add(&stream -> links, &st, entry.name, top?UINT64_MAX:(st.st_nlink - 1)) < 0)){
+            ERROR("Unable to remember %s", path);
         }
-        archive = archive -> next;
     }
-    return NULL;
-}
 
-int format_tar_data(struct tar_t * entry, const char * filename, const char verbosity){
-    if (!entry){
-        ERROR("Bad destination entry");
+    // put an extended header for the checksum of the data in front of the entry
+    struct tar_t ext;
+    const int checksum = current() -> options.checksums && has_data(&entry) && oct2uint(entry.size, 11);
+    if (checksum){
+        format_extended(&ext, &entry);
+        ext.begin = stream -> offset;
+        ext.next = &entry;
+        if (write_header(stream -> sink, &ext, stream -> verbosity) < 0){
+            ERROR("Failed to write extended header");
+        }
+        stream -> offset += entry_span(&ext);
     }
 
-    struct stat st;
-    if (lstat(filename, &st)){
-        RC_ERROR("Cannot stat %s: %s", filename, strerror(rc));
+    entry.begin = stream -> offset;
+    entry.next = NULL;
+    if (write_entry(stream -> sink, &entry, stream -> verbosity) < 0){
+        ERROR("Failed to write %s", path);
     }
+    stream -> offset += entry_span(&entry);
 
-    // remove relative path
-    int move = 0;
-    if (!strncmp(filename, "/", 1)){
-        move = 1;
-    }
-    else if (!strncmp(filename, "./", 2)){
-        move = 2;
-    }
-    else if (!strncmp(filename, "../", 3)){
-        move = 3;
+    if (!dir){
+        return 0;
     }
 
-    // start putting in new data (all fields are NULL terminated ASCII strings)
-    memset(entry, 0, sizeof(struct tar_t));
-    strncpy(entry -> original_name, filename, 100);
-    strncpy(entry -> name, filename + move, 100);
-    snprintf(entry -> mode,  sizeof(entry -> mode),  "%07o", st.st_mode & 0777);
-    snprintf(entry -> uid,   sizeof(entry -> uid),   "%07o", st.st_uid);
-    snprintf(entry -> gid,   sizeof(entry -> gid),   "%07o", st.st_gid);
-    snprintf(entry -> size,  sizeof(entry -> size),  "%011o", (int) st.st_size);
-    snprintf(entry -> mtime, sizeof(entry -> mtime), "%011o", (int) st.st_mtime);
-    strncpy(entry -> group, "None", 5);                     // default value
-    memcpy(entry -> ustar, "ustar  \x00", 8);
+    // only the listing of the directories being walked is held
+    size_t len = strlen(path);
+    while ((len > 1) && (path[len - 1] == '/')){
+        len--;
+    }
 
-    // figure out filename type and fill in type-specific fields
-    switch (st.st_mode & S_IFMT) {
-        case S_IFREG:
-            entry -> type = NORMAL;
-            break;
-        case S_IFLNK:
-            entry -> type = SYMLINK;
+    DIR * d = opendir(path);
+    if (!d){
+        RC_ERROR("Cannot open directory %s: %s", path, strerror(rc));
+    }
 
-            // file size is 0, but will print link size
-            memset(entry -> size, '0', sizeof(entry -> size) - 1);
+    struct child * children = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int ret = 0;
+    struct dirent * de;
+    while ((de = readdir(d))){
+        if (!strcmp(de -> d_name, ".") || !strcmp(de -> d_name, "..")){
+            continue;
+        }
 
-            // get link name
-            if (readlink(filename, entry -> link_name, 100) < 0){
-                RC_ERROR("Could not read link %s: %s", filename, strerror(rc));
+        if (count == capacity){
+            capacity = capacity?(capacity * 2):16;
+            struct child * grown = realloc(children, capacity * sizeof(struct child));
+            if (!grown){
+                ret = -1;
+                break;
             }
+            children = grown;
+        }
 
+        struct child * child = &children[count];
+        if (!(child -> path = malloc(len + strlen(de -> d_name) + 2))){
+            ret = -1;
             break;
-        case S_IFCHR:
-            entry -> type = CHAR;
-            // get character device major and minor values
-            snprintf(entry -> major, sizeof(entry -> major), "%07o", major(st.st_rdev));
-            snprintf(entry -> minor, sizeof(entry -> minor), "%07o", minor(st.st_rdev));
-            break;
-        case S_IFBLK:
-            entry -> type = BLOCK;
-            // get block device major and minor values
-            snprintf(entry -> major, sizeof(entry -> major), "%07o", major(st.st_rdev));
-            snprintf(entry -> minor, sizeof(entry -> minor), "%07o", minor(st.st_rdev));
-            break;
-        case S_IFDIR:
-            memset(entry -> size, '0', 11);
-            entry -> type = DIRECTORY;
-            break;
-        case S_IFIFO:
-            entry -> type = FIFO;
-            break;
-        case S_IFSOCK:
-            entry -> type = -1;
-            ERROR("Error: Cannot tar socket");
-        default:
-            entry -> type = -1;
-            ERROR("Error: Unknown filetype");
+        }
+        sprintf(child -> path, "%.*s/%s", (int) len, path, de -> d_name);
+        child -> ino = de -> d_ino;
+        child -> key = 0;
+        count++;
     }
+    closedir(d);
 
-    // get username
-    struct passwd pwd;
-    char buffer[4096];
-    struct passwd * result = NULL;
-    if (getpwuid_r(st.st_uid, &pwd, buffer, sizeof(buffer), &result)) {
-        const int err = errno;
-        V_PRINT(stderr, "Warning: Unable to get username of uid %u for entry '%s': %s", st.st_uid, filename, strerror(err));
+    if (ret < 0){
+        report("Unable to list directory %s", path);
     }
-
-    strncpy(entry -> owner, buffer, sizeof(entry -> owner) - 1);
-
-    // get group name
-    struct group * grp = getgrgid(st.st_gid);
-    if (grp){
-        strncpy(entry -> group, grp -> gr_name, sizeof(entry -> group) - 1);
+    else if (member_order()){
+        for(size_t i = 0; i < count; i++){
+            locality_key(&children[i]);
+        }
+        qsort(children, count, sizeof(struct child), compare_children);
     }
 
-    // get the checksum
-    calculate_checksum(entry);
-
-    return 0;
-}
-
-unsigned int calculate_checksum(struct tar_t * entry){
-    // use spaces for the checksum bytes while calculating the checksum
-    memset(entry -> check, ' ', 8);
-
-    // sum of entire metadata
-    unsigned int check = 0;
-    for(int i = 0; i < 512; i++){
-        check += (unsigned char) entry -> block[i];
+    for(size_t i = 0; i < count; i++){
+        if (!ret){
+            ret = stream_file(stream, children[i].path, 0);
+        }
+        free(children[i].path);
     }
+    free(children);
 
-    snprintf(entry -> check, sizeof(entry -> check), "%06o0", check);
-
-    entry -> check[6] = '\0';
-    entry -> check[7] = ' ';
-    return check;
+    return ret;
 }
 
-int ls_entry(FILE * f, struct tar_t * entry, const size_t filecount, const char * files[], const char verbosity){
-    if (!verbosity){
-        return 0;
-    }
-
-    if (filecount && !files){
-        V_PRINT(stderr, "Error: Non-zero file count given but no files given");
-        return -1;
-    }
-
-    // figure out whether or not to print
-    // if no files were specified, print everything
-    char print = !filecount;
-    // otherwise, search for matching names
-    for(size_t i = 0; i < filecount; i++){
-        if (strncmp(entry -> name, files[i], MAX(strlen(entry -> name), strlen(files[i])))){
-            print = 1;
-            break;
+int link_find(struct link_table * links, const struct stat * st, char * name){
+    const uint64_t dev = st -> st_dev;
+    const uint64_t ino = st -> st_ino;
+
+    size_t i = (size_t) ((ino * 0x9e3779b97f4a7c15ULL) ^ dev) & (links -> size - 1);
+    while (links -> slots[i].remaining){
+        struct link_entry * e = &links -> slots[i];
+        if ((e -> ino == ino) && (e -> dev == dev)){
+            memcpy(name, e -> name, sizeof(e -> name));
+            if ((e -> remaining != UINT64_MAX) && !--e -> remaining){
+                // all names seen; shift the rest of the cluster back over the hole
+                size_t hole = i;
+                for(size_t j = (i + 1) & (links -> size - 1); links -> slots[j].remaining; j = (j + 1) & (links -> size - 1)){
+                    const size_t home = (size_t) ((links -> slots[j].ino * 0x9e3779b97f4a7c15ULL) ^ links -> slots[j].dev) & (links -> size - 1);
+                    if (((j - home) & (links -> size - 1)) >= ((j - hole) & (links -> size - 1))){
+                        links -> slots[hole] = links -> slots[j];
+                        hole = j;
+                    }
+                }
+                links -> slots[hole].remaining = 0;
+                links -> count--;
+            }
+            return 1;
         }
+        i = (i + 1) & (links -> size - 1);
     }
 
-    if (print){
-        if (verbosity > 1){
-            const mode_t mode = oct2uint(entry -> mode, 7);
-            const char mode_str[26] = { "-hlcbdp-"[entry -> type?entry -> type - '0':0],
-                                        mode & S_IRUSR?'r':'-',
-                                        mode & S_IWUSR?'w':'-',
-                                        mode & S_IXUSR?'x':'-',
-                                        mode & S_IRGRP?'r':'-',
-                                        mode & S_IWGRP?'w':'-',
-                                        mode & S_IXGRP?'x':'-',
-                                        mode & S_IROTH?'r':'-',
-                                        mode & S_IWOTH?'w':'-',
-                                        mode & S_IXOTH?'x':'-',
-                                        0};
-            fprintf(f, "%s %s/%s ", mode_str, entry -> owner, entry -> group);
-            char size_buf[22] = {0};
-            int rc = -1;
-            switch (entry -> type){
-                case REGULAR: case NORMAL: case CONTIGUOUS:
-                    rc = sprintf(size_buf, "%u", oct2uint(entry -> size, 11));
-                    break;
-                case HARDLINK: case SYMLINK: case DIRECTORY: case FIFO:
-                    rc = sprintf(size_buf, "%u", oct2uint(entry -> size, 11));
-                    break;
-                case CHAR: case BLOCK:
-                    rc = sprintf(size_buf, "%d,%d", oct2uint(entry -> major, 7), oct2uint(entry -> minor, 7));
-                    break;
+    // binary search each run in the spill file
+    for(size_t r = 0; r < links -> runcount; r++){
+        size_t lo = 0;
+        size_t hi = (links -> runs[r + 1] - links -> runs[r]) / sizeof(struct link_entry);
+        while (lo < hi){
+            const size_t mid = lo + (hi - lo) / 2;
+            struct link_entry e;
+            if (pread_size(fileno(links -> spill), (char *) &e, sizeof(e), links -> runs[r] + mid * sizeof(e)) != sizeof(e)){
+                RC_ERROR("Unable to read hard link table: %s", strerror(rc));
             }
 
-            if (rc < 0){
-                ERROR("Failed to write length");
+            if ((e.dev == dev) && (e.ino == ino)){
+                memcpy(name, e.name, sizeof(e.name));
+                return 1;
             }
 
-            fprintf(f, "%s", size_buf);
-
-            time_t mtime = oct2uint(entry -> mtime, 11);
-            struct tm * time = localtime(&mtime);
-            fprintf(f, " %d-%02d-%02d %02d:%02d ", time -> tm_year + 1900, time -> tm_mon + 1, time -> tm_mday, time -> tm_hour, time -> tm_min);
+            if ((e.dev < dev) || ((e.dev == dev) && (e.ino < ino))){
+                lo = mid + 1;
+            }
+            else{
+                hi = mid;
+            }
         }
+    }
 
-        fprintf(f, "%s", entry -> name);
+    return 0;
+}
 
-        if (verbosity > 1){
-            switch (entry -> type){
-                case HARDLINK:
-                    fprintf(f, " link to %s", entry -> link_name);
-                    break;
-                case SYMLINK:
-                    fprintf(f, " -> %s", entry -> link_name);
-                    break;
-                break;
-            }
+int link_add(struct link_table * links, const struct stat * st, const char * name, const uint64_t remaining){
+    // keep probes short
+    if ((links -> count + 1) * 4 > links -> size * 3){
+        if (link_spill(links) < 0){
+            return -1;
         }
+    }
 
-        fprintf(f, "\n");
+    size_t i = (size_t) ((st -> st_ino * 0x9e3779b97f4a7c15ULL) ^ st -> st_dev) & (links -> size - 1);
+    while (links -> slots[i].remaining){
+        i = (i + 1) & (links -> size - 1);
     }
 
+    struct link_entry * e = &links -> slots[i];
+    e -> dev = st -> st_dev;
+    e -> ino = st -> st_ino;
+    e -> remaining = remaining;
+    memcpy(e -> name, name, sizeof(e -> name));
+    links -> count++;
     return 0;
 }
 
-int extract_entry(const int fd, struct tar_t * entry, const char verbosity){
-    V_PRINT(stdout, "%s", entry -> name);
-
+static int compare_links(const void * a, const void * b){
+    const struct link_entry * x = a;
+    const struct link_entry * y = b;
+    if (x -> dev != y -> dev){
+        return (x -> dev < y -> dev)?-1:1;
+    }
+    return (x -> ino < y -> ino)?-1:(x -> ino > y -> ino);
+}
+
+int link_spill(struct link_table * links){
+    if (!links -> spill){
+        if (!(links -> spill = tmpfile()) || !(links -> runs = calloc(1, sizeof(off_t)))){
+            ERROR("Unable to create hard link spill file");
+        }
+    }
+
+    off_t * runs = realloc(links -> runs, (links -> runcount + 2) * sizeof(off_t));
+    if (!runs){
+        ERROR("Unable to allocate memory");
+    }
+    links -> runs = runs;
+
+    // move used slots to the front and sort them
+    size_t count = 0;
+    for(size_t i = 0; i < links -> size; i++){
+        if (links -> slots[i].remaining){
+            links -> slots[count++] = links -> slots[i];
+        }
+    }
+    qsort(links -> slots, count, sizeof(struct link_entry), compare_links);
+
+    const off_t start = links -> runs[links -> runcount];
+    const int size = count * sizeof(struct link_entry);
+    if (pwrite_size(fileno(links -> spill), (const char *) links -> slots, size, start) != size){
+        RC_ERROR("Unable to write hard link table: %s", strerror(rc));
+    }
+
+    links -> runs[++links -> runcount] = start + size;
+    memset(links -> slots, 0, links -> size * sizeof(struct link_entry));
+    links -> count = 0;
+    return 0;
+}
+
+int tar_append(const int fd, const size_t filecount, const char * files[], const char verbosity){
+    const int prio = io_idle();
+    const int ret = append_files(fd, filecount, files, verbosity);
+    io_restore(prio);
+    return ret;
+}
+
+int append_files(const int fd, const size_t filecount, const char * files[], const char verbosity){
+    if (fd < 0){
+        ERROR("Bad file descriptor");
+    }
+
+    progress_reset();
+
+    off_t end = 0;
+    if (find_end(fd, &end, verbosity) < 0){
+        ERROR("Unable to find end of archive");
+    }
+
+    struct position pos;
+    struct tar_sink sink;
+    position_sink(&sink, &pos, fd, end);
+    advise_sequential(fd);
+
+    // new entries are only checked against each other for duplicates
+    struct tar_t * archive = NULL;
+    int offset = end;
+    if (write_entries(&sink, &archive, &archive, filecount, files, &offset, verbosity) < 0){
+        tar_free(archive);
+        if (progress_cancelled()){
+            return -1;
+        }
+        ERROR("Failed to write entries");
+    }
+
+    const int ret = end_append(&sink, &archive, offset, verbosity);
+    tar_free(archive);
+    return ret;
+}
+
+void tar_free(struct tar_t * archive){
+    while (archive){
+        struct tar_t * next = archive -> next;
+        free(archive);
+        archive = next;
+    }
+}
+
+static ssize_t fd_write(void * data, const char * buf, const size_t size){
+    ssize_t rc;
+    do {
+        rc = write((int) (intptr_t) data, buf, size);
+    } while ((rc < 0) && (errno == EINTR));
+    return rc;
+}
+
+static off_t fd_seek(void * data, const off_t offset){
+    return lseek((int) (intptr_t) data, offset, SEEK_SET);
+}
+
+void tar_sink_fd(struct tar_sink * sink, const int fd){
+    sink -> write = fd_write;
+    sink -> seek = fd_seek;
+    sink -> fd = fd;
+    sink -> data = (void *) (intptr_t) fd;    // by value, so copies of the sink stay valid
+}
+
+void tar_sink_pipe(struct tar_sink * sink, const int fd){
+    tar_sink_fd(sink, fd);
+    sink -> seek = NULL;
+}
+
+static ssize_t memory_write(void * data, const char * buf, const size_t size){
+    struct tar_memory * memory = data;
+
+    // grow geometrically
+    if (memory -> pos + size > memory -> capacity){
+        size_t capacity = memory -> capacity?memory -> capacity:RECORDSIZE;
+        while (capacity < memory -> pos + size){
+            capacity *= 2;
+        }
+
+        char * grown = realloc(memory -> buf, capacity);
+        if (!grown){
+            return -1;
+        }
+        memory -> buf = grown;
+        memory -> capacity = capacity;
+    }
+
+    // fill any hole left by seeking past the end
+    if (memory -> pos > memory -> size){
+        memset(memory -> buf + memory -> size, 0, memory -> pos - memory -> size);
+    }
+
+    memcpy(memory -> buf + memory -> pos, buf, size);
+    memory -> pos += size;
+    memory -> size = MAX(memory -> size, memory -> pos);
+    return size;
+}
+
+static off_t memory_seek(void * data, const off_t offset){
+    struct tar_memory * memory = data;
+    if (offset < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    memory -> pos = offset;
+    return offset;
+}
+
+void tar_sink_memory(struct tar_sink * sink, struct tar_memory * memory){
+    sink -> write = memory_write;
+    sink -> seek = memory_seek;
+    sink -> data = memory;
+    sink -> fd = -1;
+}
+
+void tar_get_options(struct tar_options * opts){
+    if (opts){
+        *opts = current() -> options;
+    }
+}
+
+int tar_set_options(const struct tar_options * opts){
+    if (!opts){
+        ERROR("Bad options");
+    }
+
+    if (opts -> readers && (!opts -> buffers || !opts -> buffer_size || (opts -> buffer_size % BLOCKSIZE))){
+        ERROR("Prefetch ring needs at least one buffer whose size is a multiple of %d", BLOCKSIZE);
+    }
+
+    if ((opts -> owner > 07777777) || (opts -> group > 07777777)){
+        ERROR("Owner and group ids must fit in 7 octal digits");
+    }
+
+    struct tar_ctx * ctx = current();
+    pthread_mutex_lock(&ctx -> throttle.lock);
+    ctx -> options = *opts;
+    pthread_mutex_unlock(&ctx -> throttle.lock);
+    return 0;
+}
+
+static void ctx_init(void){
+    pthread_key_create(&ctx_key, NULL);
+}
+
+struct tar_ctx * current(void){
+    pthread_once(&ctx_once, ctx_init);
+    struct tar_ctx * ctx = pthread_getspecific(ctx_key);
+    return ctx?ctx:&default_ctx;
+}
+
+struct tar_ctx * tar_ctx_new(void){
+    struct tar_ctx * ctx = calloc(1, sizeof(struct tar_ctx));
+    if (ctx){
+        const struct tar_options defaults = DEFAULT_OPTIONS;
+        ctx -> options = defaults;
+        ctx -> cache = 1;
+        pthread_mutex_init(&ctx -> error_lock, NULL);
+        pthread_mutex_init(&ctx -> throttle.lock, NULL);
+        pthread_mutex_init(&ctx -> progress.lock, NULL);
+    }
+    return ctx;
+}
+
+void tar_ctx_free(struct tar_ctx * ctx){
+    if (ctx && (ctx != &default_ctx)){
+        pthread_mutex_destroy(&ctx -> error_lock);
+        pthread_mutex_destroy(&ctx -> throttle.lock);
+        pthread_mutex_destroy(&ctx -> progress.lock);
+        free(ctx);
+    }
+}
+
+struct tar_ctx * tar_ctx_use(struct tar_ctx * ctx){
+    struct tar_ctx * prev = current();
+    pthread_setspecific(ctx_key, (ctx == &default_ctx)?NULL:ctx);
+    return (prev == &default_ctx)?NULL:prev;
+}
+
+const char * tar_error(void){
+    return current() -> error;
+}
+
+int tar_throttle(struct tar_ctx * ctx, const size_t rate_bytes, const size_t rate_ops){
+    if (!ctx){
+        ctx = current();
+    }
+
+    pthread_mutex_lock(&ctx -> throttle.lock);
+    ctx -> options.rate_bytes = rate_bytes;
+    ctx -> options.rate_ops = rate_ops;
+    pthread_mutex_unlock(&ctx -> throttle.lock);
+    return 0;
+}
+
+void throttle(const size_t size){
+    if (!size){
+        return;
+    }
+
+    struct tar_ctx * ctx = current();
+    struct throttle * t = &ctx -> throttle;
+
+    pthread_mutex_lock(&t -> lock);
+    const double rate_bytes = ctx -> options.rate_bytes;
+    const double rate_ops = ctx -> options.rate_ops;
+    if (!rate_bytes && !rate_ops){
+        pthread_mutex_unlock(&t -> lock);
+        return;
+    }
+
+    // refill, keeping at most one second worth of tokens
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (t -> last.tv_sec || t -> last.tv_nsec){
+        const double elapsed = (now.tv_sec - t -> last.tv_sec) + (now.tv_nsec - t -> last.tv_nsec) / 1e9;
+        t -> bytes = MIN(t -> bytes + elapsed * rate_bytes, rate_bytes);
+        t -> ops = MIN(t -> ops + elapsed * rate_ops, rate_ops);
+    }
+    t -> last = now;
+
+    // take the tokens now and sleep off any debt, so concurrent callers queue up behind each other
+    double wait = 0;
+    if (rate_bytes){
+        t -> bytes -= size;
+        wait = MAX(wait, -t -> bytes / rate_bytes);
+    }
+    if (rate_ops){
+        t -> ops -= 1;
+        wait = MAX(wait, -t -> ops / rate_ops);
+    }
+    pthread_mutex_unlock(&t -> lock);
+
+    if (wait > 0){
+        struct timespec delay = { (time_t) wait, (long) ((wait - (time_t) wait) * 1e9) };
+        while ((nanosleep(&delay, &delay) < 0) && (errno == EINTR));
+    }
+}
+
+static double seconds_since(const struct timespec * then, const struct timespec * now){
+    return (now -> tv_sec - then -> tv_sec) + (now -> tv_nsec - then -> tv_nsec) / 1e9;
+}
+
+void progress_begin(const unsigned long long total_bytes, const unsigned long long total_entries){
+    struct tar_ctx * ctx = current();
+    if (!ctx -> options.progress){
+        return;
+    }
+
+    struct progress * p = &ctx -> progress;
+    pthread_mutex_lock(&p -> lock);
+    memset(&p -> info, 0, sizeof(p -> info));
+    p -> info.total_bytes = total_bytes;
+    p -> info.total_entries = total_entries;
+    p -> name[0] = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &p -> start);
+    p -> last = p -> start;
+    p -> active = 1;
+    p -> cancelled = 0;
+    pthread_mutex_unlock(&p -> lock);
+}
+
+// call the callback with the lock held on entry and exit, but not during the call
+static int progress_call(struct tar_ctx * ctx, const struct timespec * now){
+    struct progress * p = &ctx -> progress;
+    struct tar_progress info = p -> info;
+    char name[sizeof(p -> name)];
+    memcpy(name, p -> name, sizeof(name));
+    info.name = name;
+    info.elapsed = seconds_since(&p -> start, now);
+    p -> last = *now;
+    p -> calling = 1;
+    pthread_mutex_unlock(&p -> lock);
+
+    const int stop = ctx -> options.progress(&info, ctx -> options.progress_data);
+
+    pthread_mutex_lock(&p -> lock);
+    p -> calling = 0;
+    return stop;
+}
+
+void progress_add(const unsigned long long bytes, const unsigned long long entries, const char * name){
+    struct tar_ctx * ctx = current();
+    if (!ctx -> options.progress){
+        return;
+    }
+
+    struct progress * p = &ctx -> progress;
+    pthread_mutex_lock(&p -> lock);
+    if (p -> active){
+        p -> info.bytes += bytes;
+        p -> info.entries += entries;
+        if (name){
+            strncpy(p -> name, name, sizeof(p -> name) - 1);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!p -> calling && (seconds_since(&p -> last, &now) * 1000 >= ctx -> options.progress_interval) && progress_call(ctx, &now)){
+            p -> cancelled = 1;
+        }
+    }
+    pthread_mutex_unlock(&p -> lock);
+}
+
+int progress_cancelled(void){
+    struct tar_ctx * ctx = current();
+    if (!ctx -> options.progress){
+        return 0;
+    }
+
+    pthread_mutex_lock(&ctx -> progress.lock);
+    const int cancelled = ctx -> progress.cancelled;
+    pthread_mutex_unlock(&ctx -> progress.lock);
+    return cancelled;
+}
+
+void progress_reset(void){
+    struct tar_ctx * ctx = current();
+    pthread_mutex_lock(&ctx -> progress.lock);
+    ctx -> progress.cancelled = 0;
+    pthread_mutex_unlock(&ctx -> progress.lock);
+}
+
+void progress_end(void){
+    struct tar_ctx * ctx = current();
+    if (!ctx -> options.progress){
+        return;
+    }
+
+    struct progress * p = &ctx -> progress;
+    pthread_mutex_lock(&p -> lock);
+    if (p -> active){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        progress_call(ctx, &now);
+        p -> active = 0;
+    }
+    pthread_mutex_unlock(&p -> lock);
+}
+
+int write_cancelled(struct tar_sink * sink, struct tar_t * entry, struct tar_t * prev){
+    // an extended header stays with its member
+    if ((prev && (prev -> type == EXTENDED)) || !progress_cancelled()){
+        return 0;
+    }
+
+    if (write_end_data(sink, entry -> begin, 0) < 0){
+        report("Cancelled, but unable to end archive at %u", entry -> begin);
+    }
+    else{
+        report("Cancelled before %s", entry -> name);
+    }
+    return 1;
+}
+
+unsigned long long extract_size(struct tar_t * entry){
     if ((entry -> type == REGULAR) || (entry -> type == NORMAL) || (entry -> type == CONTIGUOUS)){
-        // create intermediate directories
-        size_t len = strlen(entry -> name);
-        if (!len)
-        {
-            ERROR("Attempted to extract entry with empty name");
+        return oct2uint(entry -> size, 11);
+    }
+    return 0;
+}
+
+int extract_cancelled(struct tar_t * entry, struct tar_t * prev){
+    if ((prev && (prev -> type == EXTENDED)) || !progress_cancelled()){
+        return 0;
+    }
+
+    report("Cancelled before %s", entry -> name);
+    return 1;
+}
+
+int io_idle(void){
+    #ifdef __linux__
+    if (current() -> options.idle){
+        // who = IOPRIO_WHO_PROCESS; id 0 is the calling thread, and threads it starts inherit the class
+        const int prio = syscall(SYS_ioprio_get, 1, 0);
+        if ((prio >= 0) && (syscall(SYS_ioprio_set, 1, 0, IOPRIO_IDLE) == 0)){
+            return prio;
         }
+    }
+    #endif
+    return -1;
+}
 
-        char * path = calloc(len + 1, sizeof(char));
-        strncpy(path, entry -> name, len);
+void io_restore(const int prio){
+    #ifdef __linux__
+    if (prio >= 0){
+        syscall(SYS_ioprio_set, 1, 0, prio);
+    }
+    #endif
+}
 
-        // remove file from path
-        while (--len && (path[len] != '/'));
-        path[len] = '\0';   // if nothing was found, path is terminated
+void report(const char * fmt, ...){
+    struct tar_ctx * ctx = current();
 
-        if (recursive_mkdir(path, DEFAULT_DIR_MODE, verbosity) < 0){
-            V_PRINT(stderr, "Could not make directory %s", path);
-            free(path);
+    char error[sizeof(ctx -> error)];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(error, sizeof(error), fmt, args);
+    va_end(args);
+
+    pthread_mutex_lock(&ctx -> error_lock);
+    memcpy(ctx -> error, error, sizeof(error));
+    pthread_mutex_unlock(&ctx -> error_lock);
+
+    if (!ctx -> options.quiet){
+        fprintf(stderr, "Error: %s\n", error);
+    }
+}
+
+int id_name(const int group, const unsigned int id, char * name, const size_t size){
+    struct tar_ctx * ctx = current();
+    struct name_entry * cached = NULL;
+    if (ctx -> cache){
+        cached = &(group?ctx -> groups:ctx -> users)[id % NAME_CACHE];
+        if (cached -> state && (cached -> id == id)){
+            if (cached -> state > 0){
+                snprintf(name, size, "%s", cached -> name);
+            }
+            return cached -> state > 0;
+        }
+    }
+
+    char buffer[4096];
+    const char * found = NULL;
+    int rc;
+    if (group){
+        struct group grp;
+        struct group * result = NULL;
+        rc = getgrgid_r(id, &grp, buffer, sizeof(buffer), &result);
+        found = result?result -> gr_name:NULL;
+    }
+    else{
+        struct passwd pwd;
+        struct passwd * result = NULL;
+        rc = getpwuid_r(id, &pwd, buffer, sizeof(buffer), &result);
+        found = result?result -> pw_name:NULL;
+    }
+
+    if (rc){
+        errno = rc;
+        return -1;
+    }
+
+    if (found){
+        strncpy(name, found, size - 1);
+    }
+
+    if (cached){
+        cached -> id = id;
+        cached -> state = found?1:-1;
+        memset(cached -> name, 0, sizeof(cached -> name));
+        if (found){
+            strncpy(cached -> name, found, sizeof(cached -> name) - 1);
+        }
+    }
+
+    return !!found;
+}
+
+int tar_ls(FILE * f, struct tar_t * archive, const size_t filecount, const char * files[], const char verbosity){
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    struct tar_filter * filter = NULL;
+    if (filecount && !(filter = tar_filter_compile(filecount, files, 0, NULL))){
+        ERROR("Unable to compile file list");
+    }
+
+    const int ret = tar_ls_filter(f, archive, filter, verbosity);
+    tar_filter_free(filter);
+    return ret;
+}
+
+int tar_ls_filter(FILE * f, struct tar_t * archive, const struct tar_filter * filter, const char verbosity){
+    if (!verbosity){
+        return 0;
+    }
+
+    return tar_ls_format(f, archive, filter, TAR_LIST_TEXT, verbosity);
+}
+
+int tar_ls_format(FILE * f, struct tar_t * archive, const struct tar_filter * filter, const int format, const char verbosity){
+    if (!f){
+        ERROR("Bad output file");
+    }
+
+    if ((format < TAR_LIST_TEXT) || (format > TAR_LIST_BINARY)){
+        ERROR("Unknown listing format %d", format);
+    }
+
+    struct lister list;
+    memset(&list, 0, sizeof(list));
+    list.f = f;
+    list.size = 1 << 16;
+    list.minute = -1;
+    if (!(list.buf = malloc(list.size))){
+        ERROR("Unable to allocate listing buffer");
+    }
+
+    if (format == TAR_LIST_CSV){
+        static const char header[] = "name,type,mode,uid,gid,owner,group,size,mtime,offset,link,crc32c\n";
+        list_bytes(&list, header, sizeof(header) - 1);
+    }
+
+    for(; archive; archive = archive -> next){
+        if ((archive -> type != EXTENDED) && (!filter || tar_filter_match(filter, archive -> name))){
+            list_entry(&list, archive, format, verbosity);
+        }
+    }
+
+    list_flush(&list);
+    free(list.buf);
+
+    if (list.error){
+        ERROR("Unable to write listing");
+    }
+
+    return 0;
+}
+
+int tar_extract(const int fd, struct tar_t * archive, const size_t filecount, const char * files[], const char verbosity){
+    if (filecount && !files){
+        ERROR("Received non-zero file count but got NULL file list");
+    }
+
+    struct tar_filter * filter = NULL;
+    if (filecount && !(filter = tar_filter_compile(filecount, files, 0, NULL))){
+        ERROR("Unable to compile file list");
+    }
+
+    const int ret = tar_extract_filter(fd, archive, filter, verbosity);
+    tar_filter_free(filter);
+    return ret;
+}
+
+int tar_extract_filter(const int fd, struct tar_t * archive, const struct tar_filter * filter, const char verbosity){
+    const int prio = io_idle();
+    const int ret = extract_filter(fd, archive, filter, verbosity);
+    io_restore(prio);
+    return ret;
+}
+
+int extract_filter(const int fd, struct tar_t * archive, const struct tar_filter * filter, const char verbosity){
+    int ret = 0;
+    off_t mark = 0;
+    off_t end = 0;
+
+    // directory metadata is applied once their contents are written
+    struct restore restore;
+    memset(&restore, 0, sizeof(restore));
+    restore.owner = !geteuid();
+
+    // extracted files are made durable through the file system of the working directory
+    struct journal journal;
+    journal.fd = -1;
+    if (current() -> options.journal){
+        const int dir = open(".", O_RDONLY);
+        if (dir < 0){
+            RC_ERROR("Unable to open working directory: %s", strerror(rc));
+        }
+
+        if (journal_open(&journal, 'x', dir) < 0){
+            close(dir);
             return -1;
         }
-        free(path);
+    }
 
-        // create file
-        const unsigned int size = oct2uint(entry -> size, 11);
-        int f = open(entry -> name, O_WRONLY | O_CREAT | O_TRUNC, oct2uint(entry -> mode, 7) & 0777);
-        if (f < 0){
-            RC_ERROR("Unable to open file %s: %s", entry -> name, strerror(rc));
+    advise_sequential(fd);
+
+    // extract entries selected by the filter
+    if (filter){
+        size_t count = 0;
+        for(struct tar_t * entry = archive; entry; entry = entry -> next){
+            count += !!tar_filter_match(filter, entry -> name);
+        }
+
+        struct tar_t ** selected = calloc(count + 1, sizeof(struct tar_t *));
+        if (!selected){
+            journal_close(&journal, 0);
+            ERROR("Unable to allocate memory");
+        }
+
+        count = 0;
+        for(struct tar_t * entry = archive; entry; entry = entry -> next){
+            if (tar_filter_match(filter, entry -> name)){
+                selected[count++] = entry;
+            }
+        }
+
+        // skip members extracted before
+        size_t i = 0;
+        if ((journal.fd >= 0) && journal.count){
+            if ((journal.count > count) || (journal_matches(&journal, selected[journal.count - 1]) < 0)){
+                free(selected);
+                journal_close(&journal, 0);
+                return -1;
+            }
+
+            // directories extracted before still need their metadata
+            for(i = 0; i < journal.count; i++){
+                if ((selected[i] -> type == DIRECTORY) && (restore_add(&restore, selected[i]) < 0)){
+                    ret = -1;
+                }
+            }
+
+            V_PRINT(stdout, "Resuming after %s", journal.name);
+        }
+
+        unsigned long long bytes = 0;
+        for(size_t j = i; j < count; j++){
+            bytes += extract_size(selected[j]);
+        }
+        progress_begin(bytes, count - i);
+
+        size_t run = i;
+        for(; i < count; i++){
+            if (extract_cancelled(selected[i], i?selected[i - 1]:NULL)){
+                ret = -1;
+                break;
+            }
+
+            // read members that are next to each other in the archive with one request
+            if (i == run){
+                off_t end = selected[i] -> begin + entry_span(selected[i]);
+                while (((run + 1) < count) && (selected[run + 1] -> begin == end) && ((end - selected[i] -> begin) < MERGE_WINDOW)){
+                    end += entry_span(selected[++run]);
+                }
+                run++;
+                advise_willneed(fd, selected[i] -> begin, end);
+            }
+
+            progress_add(0, 0, selected[i] -> name);
+            if (extract_queued(fd, selected[i], &restore, verbosity) < 0){
+                ret = -1;
+            }
+            progress_add(0, 1, NULL);
+            end = selected[i] -> begin + entry_span(selected[i]);
+            drop_behind(fd, &mark, end, 0);
+
+            if ((journal.fd >= 0) && (journal_checkpoint(&journal, selected[i], 0) < 0)){
+                ret = -1;
+                break;
+            }
+        }
+
+        free(selected);
+    }
+    // extract all
+    else{
+        // skip members extracted before
+        if ((journal.fd >= 0) && journal.count){
+            struct tar_t * last = NULL;
+            struct tar_t * first = archive;
+            for(size_t i = 0; archive && (i < journal.count); i++){
+                last = archive;
+                archive = archive -> next;
+            }
+
+            if (journal_matches(&journal, last) < 0){
+                journal_close(&journal, 0);
+                return -1;
+            }
+
+            // directories extracted before still need their metadata
+            for(; first != archive; first = first -> next){
+                if ((first -> type == DIRECTORY) && (restore_add(&restore, first) < 0)){
+                    ret = -1;
+                }
+            }
+
+            V_PRINT(stdout, "Resuming after %s", journal.name);
+        }
+
+        unsigned long long bytes = 0, entries = 0;
+        for(struct tar_t * entry = archive; entry; entry = entry -> next){
+            bytes += extract_size(entry);
+            entries += entry -> type != EXTENDED;
+        }
+        progress_begin(bytes, entries);
+
+        // extract each entry
+        struct tar_t * prev = NULL;
+        while (archive){
+            if (extract_cancelled(archive, prev)){
+                ret = -1;
+                break;
+            }
+
+            progress_add(0, 0, archive -> name);
+            if (extract_queued(fd, archive, &restore, verbosity) < 0){
+                ret = -1;
+            }
+            progress_add(0, archive -> type != EXTENDED, NULL);
+            end = archive -> begin + entry_span(archive);
+            drop_behind(fd, &mark, end, 0);
+
+            if ((journal.fd >= 0) && (journal_checkpoint(&journal, archive, 0) < 0)){
+                ret = -1;
+                break;
+            }
+            prev = archive;
+            archive = archive -> next;
+        }
+    }
+
+    progress_end();
+    drop_cache(fd, mark, end, 0);
+
+    if (restore_apply(&restore) < 0){
+        ret = -1;
+    }
+
+    // a failed run keeps its journal, so it can be resumed
+    journal_close(&journal, !ret);
+
+    return ret;
+}
+
+int tar_update(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
+    if (!filecount){
+        return 0;
+    }
+
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    // buffer for subset of files that need to be appended
+    char ** newer = calloc(filecount, sizeof(char *));
+
+    struct stat st;
+    int count = 0;
+    int all = 1;
+
+    // check each source to see if it was updated
+    for(int i = 0; i < filecount; i++){
+        // make sure original file exists
+        if (lstat(files[i], &st)){
+            all = 0;
+            RC_ERROR("Could not stat %s: %s", files[i], strerror(rc));
+        }
+
+        // find the current version in the archive
+        struct tar_t * old = latest(*archive, member_name(files[i]));
+
+        // if there is an older version, check its timestamp
+        if (old){
+            if (st.st_mtime <= oct2uint(old -> mtime, 11)){
+                continue;
+            }
+
+            // overwrite it where it is if the new data fits
+            const int replaced = replace_entry(fd, old, files[i], verbosity);
+            if (replaced < 0){
+                all = 0;
+                continue;
+            }
+            else if (replaced){
+                continue;
+            }
+        }
+
+        // otherwise, append it
+        newer[count] = calloc(strlen(files[i]) + 1, sizeof(char));
+        memcpy(newer[count++], files[i], strlen(files[i]));
+        V_PRINT(stdout, "%s", files[i]);
+    }
+
+    // append listed files only
+    if (count && (tar_write(fd, archive, count, (const char **) newer, verbosity) < 0)){
+        ERROR("Unable to update archive");
+    }
+
+    // cleanup
+    for(int i = 0; i < count; i++){
+        free(newer[i]);
+    }
+    free(newer);
+
+    return all?0:-1;
+}
+
+int prefix_header(struct tar_t * entry){
+    return (entry -> type == EXTENDED) || (entry -> type == GNU_LONGNAME) || (entry -> type == GNU_LONGLINK);
+}
+
+int long_name(const int fd, struct tar_t * header, char ** name){
+    *name = NULL;
+    if ((header -> type != EXTENDED) && (header -> type != GNU_LONGNAME)){
+        return 0;
+    }
+
+    const size_t size = oct2uint(header -> size, 11);
+    char * records = malloc(size + 1);
+    if (!records){
+        return -1;
+    }
+
+    if (pread(fd, records, size, header -> begin + 512) != (ssize_t) size){
+        free(records);
+        return -1;
+    }
+    records[size] = '\0';
+
+    // the data of a long name header is the name
+    if (header -> type == GNU_LONGNAME){
+        *name = records;
+        return 0;
+    }
+
+    // "length path=value\n"
+    for(size_t i = 0; i < size;){
+        size_t len = 0;
+        size_t j = i;
+        while ((j < size) && (records[j] >= '0') && (records[j] <= '9')){
+            len = len * 10 + (records[j++] - '0');
+        }
+
+        if (!len || (i + len > size) || (j >= size) || (records[j] != ' ') || (records[i + len - 1] != '\n')){
+            break;
+        }
+        j++;
+
+        if ((i + len - j > 5) && !strncmp(records + j, "path=", 5)){
+            *name = strndup(records + j + 5, i + len - 1 - (j + 5));
+            free(records);
+            return *name?0:-1;
+        }
+
+        i += len;
+    }
+
+    free(records);
+    return 0;
+}
+
+int group_name(const int fd, struct tar_t * first, struct tar_t ** member, char ** name){
+    *name = NULL;
+    struct tar_t * entry = first;
+    for(; prefix_header(entry) && entry -> next; entry = entry -> next){
+        // the closest header giving a name wins
+        char * given = NULL;
+        if (long_name(fd, entry, &given) < 0){
+            free(*name);
+            *name = NULL;
+            return -1;
+        }
+
+        if (given){
+            free(*name);
+            *name = given;
+        }
+    }
+
+    *member = entry;
+    return 0;
+}
+
+int tar_compact(const int fd, struct tar_t ** archive, const char verbosity){
+    if (fd < 0){
+        ERROR("Bad file descriptor");
+    }
+
+    if (!archive){
+        ERROR("Bad archive");
+    }
+
+    size_t count = 0;
+    for(struct tar_t * entry = *archive; entry; entry = entry -> next){
+        count++;
+    }
+
+    if (!count){
+        return 0;
+    }
+
+    // names seen so far while walking back from the end
+    size_t size = 16;
+    while (size < 2 * count){
+        size *= 2;
+    }
+
+    struct tar_t ** entries = calloc(count, sizeof(struct tar_t *));
+    const char ** names = calloc(size, sizeof(char *));
+    char ** longs = calloc(count, sizeof(char *));
+    char * drop = calloc(count, sizeof(char));
+    if (!entries || !names || !longs || !drop){
+        free(entries);
+        free(names);
+        free(longs);
+        free(drop);
+        ERROR("Unable to allocate memory");
+    }
+
+    count = 0;
+    for(struct tar_t * entry = *archive; entry; entry = entry -> next){
+        entries[count++] = entry;
+    }
+
+    // a member is shadowed by a later one with the same name; extended and long name headers follow their member
+    int ret = 0;
+    for(size_t i = count; i-- > 0;){
+        struct tar_t * entry = entries[i];
+        if (prefix_header(entry)){
+            drop[i] = (i + 1 >= count) || drop[i + 1] || ((entry -> type == EXTENDED) && (entries[i + 1] -> type == EXTENDED)) || !strncmp(entry -> name, FILLER_NAME, sizeof(entry -> name));
+            continue;
+        }
+
+        // the closest header in front of the member giving a name replaces the one in its own header
+        for(size_t h = i; (h-- > 0) && prefix_header(entries[h]) && !longs[i];){
+            if (long_name(fd, entries[h], &longs[i]) < 0){
+                const int rc = errno;
+                ret = -1;
+                report("Unable to read the name of the member at %u: %s", entry -> begin, strerror(rc));
+                break;
+            }
+        }
+
+        if (ret < 0){
+            break;
+        }
+
+        // a name filling its field has no terminator
+        if (!longs[i] && (strnlen(entry -> name, sizeof(entry -> name)) == sizeof(entry -> name)) && !(longs[i] = strndup(entry -> name, sizeof(entry -> name)))){
+            ret = -1;
+            report("Unable to allocate memory");
+            break;
+        }
+
+        const char * name = longs[i]?longs[i]:entry -> name;
+        size_t j = hash_name(name) & (size - 1);
+        while (names[j] && strcmp(names[j], name)){
+            j = (j + 1) & (size - 1);
+        }
+
+        drop[i] = !!names[j];
+        names[j] = name;
+    }
+
+    free(names);
+    for(size_t i = 0; i < count; i++){
+        free(longs[i]);
+    }
+    free(longs);
+
+    if (ret < 0){
+        free(entries);
+        free(drop);
+        return -1;
+    }
+
+    // move kept members down in one pass
+    int dropped = 0;
+    off_t write_offset = 0;
+    struct tar_t ** tail = archive;
+    for(size_t i = 0; i < count; i++){
+        struct tar_t * entry = entries[i];
+        if (drop[i]){
+            V_PRINT(stdout, "Dropping %s at %u", entry -> name, entry -> begin);
+            dropped += !prefix_header(entry);
+            free(entry);
+            continue;
+        }
+
+        const unsigned int span = entry_span(entry);
+        if ((write_offset < entry -> begin) && (move_data(fd, entry -> begin, write_offset, span) < 0)){
+            const int rc = errno;
+            ret = -1;
+            report("Unable to move %s: %s", entry -> name, strerror(rc));
+
+            // keep the rest where it is
+            for(; i < count; i++){
+                *tail = entries[i];
+                tail = &entries[i] -> next;
+            }
+            break;
+        }
+
+        entry -> begin = write_offset;
+        write_offset += span;
+        *tail = entry;
+        tail = &entry -> next;
+    }
+    *tail = NULL;
+
+    free(entries);
+    free(drop);
+
+    if (ret < 0){
+        return -1;
+    }
+
+    // resize file
+    if (ftruncate(fd, write_offset) < 0){
+        RC_ERROR("Could not truncate file: %s", strerror(rc));
+    }
+
+    // add end data
+    struct position pos;
+    struct tar_sink sink;
+    position_sink(&sink, &pos, fd, write_offset);
+    if (write_end_data(&sink, write_offset, verbosity) < 0){
+        ERROR("Could not close file");
+    }
+
+    return dropped;
+}
+
+int tar_transform(struct tar_sink * sink, struct tar_t ** archive, const size_t count, const struct tar_input inputs[], const struct tar_filter * filter, tar_rewrite rewrite, void * data, const char verbosity){
+    const int prio = io_idle();
+    const int ret = transform(sink, archive, count, inputs, filter, rewrite, data, verbosity);
+    io_restore(prio);
+    return ret;
+}
+
+int transform(struct tar_sink * sink, struct tar_t ** archive, const size_t count, const struct tar_input inputs[], const struct tar_filter * filter, tar_rewrite rewrite, void * data, const char verbosity){
+    if (count && !inputs){
+        ERROR("Non-zero input count provided, but input list is NULL");
+    }
+
+    int offset = 0;
+    struct tar_t ** tar = NULL;
+    if (begin_append(sink, archive, &tar, &offset, verbosity) < 0){
+        return -1;
+    }
+
+    for(size_t i = 0; i < count; i++){
+        if (inputs[i].fd < 0){
+            ERROR("Bad file descriptor of input %zu", i);
+        }
+
+        struct tar_t * prefix = NULL;   // first extended or long name header in front of the current member
+        for(struct tar_t * entry = inputs[i].archive; entry; entry = entry -> next){
+            if (prefix_header(entry)){
+                if (!prefix){
+                    prefix = entry;
+                }
+                continue;
+            }
+
+            struct tar_t * header = prefix;
+            prefix = NULL;
+
+            // the closest header in front of the member giving a name replaces the one in its own header
+            char * full = NULL;
+            struct tar_t * named = NULL;
+            for(struct tar_t * h = header; h && (h != entry); h = h -> next){
+                char * name = NULL;
+                if (long_name(inputs[i].fd, h, &name) < 0){
+                    const int rc = errno;
+                    free(full);
+                    ERROR("Unable to read the name of the member at %u: %s", entry -> begin, strerror(rc));
+                }
+
+                if (name){
+                    free(full);
+                    full = name;
+                    named = h;
+                }
+            }
+
+            // a name filling its field has no terminator
+            char field[sizeof(entry -> name) + 1];
+            memcpy(field, entry -> name, sizeof(entry -> name));
+            field[sizeof(entry -> name)] = '\0';
+
+            const int selected = !filter || tar_filter_match(filter, full?full:field);
+            free(full);
+            if (!selected){
+                continue;
+            }
+
+            struct tar_t * copy = malloc(sizeof(struct tar_t));
+            if (!copy){
+                ERROR("Unable to allocate entry");
+            }
+            memcpy(copy, entry, sizeof(struct tar_t));
+            memset(copy -> original_name, 0, sizeof(copy -> original_name));
+            copy -> next = NULL;
+
+            if (rewrite){
+                const int rc = rewrite(copy, data);
+                if (rc){
+                    free(copy);
+                    if (rc < 0){
+                        ERROR("Rewriting %s failed", entry -> name);
+                    }
+                    continue;
+                }
+
+                if (oct2uint(copy -> size, 11) != oct2uint(entry -> size, 11)){
+                    free(copy);
+                    ERROR("Rewriting %s changed its size", entry -> name);
+                }
+
+                calculate_checksum(copy);
+            }
+
+            // a rewritten name or link name takes the place of the one a header in front of the member gave
+            const int renamed = memcmp(copy -> name, entry -> name, sizeof(entry -> name)) || memcmp(copy -> prefix, entry -> prefix, sizeof(entry -> prefix));
+            const int relinked = memcmp(copy -> link_name, entry -> link_name, sizeof(entry -> link_name));
+
+            // the other headers go out as they are
+            for(struct tar_t * h = header; h && (h != entry); h = h -> next){
+                if (((h -> type == EXTENDED) && (!strncmp(h -> name, FILLER_NAME, sizeof(h -> name)) || (h -> next -> type == EXTENDED))) ||
+                    (renamed && (h == named)) || (relinked && (h -> type == GNU_LONGLINK))){
+                    continue;
+                }
+
+                struct tar_t * ext_copy = malloc(sizeof(struct tar_t));
+                if (!ext_copy){
+                    free(copy);
+                    ERROR("Unable to allocate extended header");
+                }
+                memcpy(ext_copy, h, sizeof(struct tar_t));
+                ext_copy -> begin = offset;
+                ext_copy -> next = NULL;
+
+                if (copy_range(inputs[i].fd, h -> begin, sink, offset, entry_span(h)) < 0){
+                    const int rc = errno;
+                    free(ext_copy);
+                    free(copy);
+                    ERROR("Unable to copy extended header of %s: %s", entry -> name, strerror(rc));
+                }
+
+                offset += entry_span(ext_copy);
+                *tar = ext_copy;
+                tar = &ext_copy -> next;
+            }
+
+            V_PRINT(stdout, "Copying %s", copy -> name);
+
+            copy -> begin = offset;
+            if (sink_write(sink, copy -> block, 512) != 512){
+                free(copy);
+                ERROR("Failed to write metadata to archive");
+            }
+
+            // data after the header block, padding included
+            const unsigned int span = entry_span(entry);
+            if ((span > 512) && (copy_range(inputs[i].fd, entry -> begin + 512, sink, offset + 512, span - 512) < 0)){
+                const int rc = errno;
+                free(copy);
+                ERROR("Unable to copy %s: %s", entry -> name, strerror(rc));
+            }
+
+            offset += span;
+            *tar = copy;
+            tar = &copy -> next;
+        }
+    }
+
+    return end_append(sink, archive, offset, verbosity);
+}
+
+int tar_remove(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity){
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    struct tar_filter * filter = NULL;
+    if (filecount && !(filter = tar_filter_compile(filecount, files, 0, NULL))){
+        ERROR("Unable to compile file list");
+    }
+
+    const int ret = tar_remove_filter(fd, archive, filter, verbosity);
+    tar_filter_free(filter);
+    return ret;
+}
+
+int tar_remove_filter(const int fd, struct tar_t ** archive, const struct tar_filter * filter, const char verbosity){
+    if (fd < 0){
+        return -1;
+    }
+
+    // archive has to exist
+    if (!archive || !*archive){
+        ERROR("Got bad archive");
+    }
+
+    if (!filter || !filter -> count){
+        V_PRINT(stderr, "No entries specified");
+        return 0;
+    }
+
+    // get file permissions
+    struct stat st;
+    if (fstat(fd, &st)){
+        RC_ERROR("Unable to stat archive: %s", strerror(rc));
+    }
+
+    // find first pattern that does not match anything
+    int ret = 0;
+    char * seen = calloc(filter -> count, sizeof(char));
+    if (!seen){
+        ERROR("Unable to allocate memory");
+    }
+
+    for(struct tar_t * entry = *archive; entry; entry = entry -> next){
+        struct tar_t * member = NULL;
+        char * full = NULL;
+        if (group_name(fd, entry, &member, &full) < 0){
+            const int rc = errno;
+            free(seen);
+            ERROR("Unable to read the name of the member at %u: %s", entry -> begin, strerror(rc));
+        }
+
+        // a name filling its field has no terminator
+        char key[sizeof(member -> name) + 1];
+        snprintf(key, sizeof(key), "%.*s", (int) sizeof(member -> name), member -> name);
+
+        const char * name = full?full:key;
+        if (!filter_match(filter -> exclude, name, NULL)){
+            filter_match(filter -> include, name, seen);
+        }
+        free(full);
+        entry = member;
+    }
+
+    for(size_t i = 0; i < filter -> count; i++){
+        if (!seen[i]){
+            free(seen);
+            ERROR("'%s' not found in archive", filter -> patterns[i]);
+        }
+    }
+    free(seen);
+
+    unsigned long long bytes = 0, entries = 0;
+    for(struct tar_t * entry = *archive; entry; entry = entry -> next){
+        bytes += entry_span(entry);
+        entries += !prefix_header(entry);
+    }
+    progress_begin(bytes, entries);
+
+    struct position pos;
+    struct tar_sink sink;
+    unsigned int read_offset = 0;
+    unsigned int write_offset = 0;
+    int match = -1;                 // whether the member the current entry belongs to is removed (-1 = between members)
+    struct tar_t * prev = NULL;
+    struct tar_t * curr = *archive;
+    while(curr){
+        // stop between members, covering the space of removed members so the rest can still be read
+        if ((match < 0) && progress_cancelled()){
+            if (write_offset < read_offset){
+                struct tar_t * filler = calloc(1, sizeof(struct tar_t));
+                position_sink(&sink, &pos, fd, write_offset);
+                if (!filler ||
+                    (write_filler(&sink, (read_offset - write_offset) / 512) < 0) ||
+                    (pread_size(fd, filler -> block, 512, write_offset) != 512)){
+                    free(filler);
+                    progress_end();
+                    ERROR("Cancelled, but unable to fill removed space at %u", write_offset);
+                }
+
+                filler -> begin = write_offset;
+                filler -> next = curr;
+                if (!prev){
+                    *archive = filler;
+                }
+                else{
+                    prev -> next = filler;
+                }
+            }
+
+            progress_end();
+            ERROR("Cancelled before %s", curr -> name);
+        }
+
+        // get original size
+        const int total = entry_span(curr);
+
+        // extended and long name headers go wherever their member goes
+        if (match < 0){
+            struct tar_t * member = NULL;
+            char * full = NULL;
+            if (group_name(fd, curr, &member, &full) < 0){
+                const int rc = errno;
+                progress_end();
+                ERROR("Unable to read the name of the member at %u: %s", curr -> begin, strerror(rc));
+            }
+
+            char key[sizeof(member -> name) + 1];
+            snprintf(key, sizeof(key), "%.*s", (int) sizeof(member -> name), member -> name);
+            match = !!tar_filter_match(filter, full?full:key);
+            free(full);
+        }
+
+        const int removed = match;
+        progress_add(total, !prefix_header(curr), curr -> name);
+        if (!prefix_header(curr) || !curr -> next){
+            match = -1;
+        }
+
+        if (!removed){
+            // if the old data is not in the right place, move it
+            if ((write_offset < read_offset) && (move_data(fd, read_offset, write_offset, total) < 0)){
+                const int rc = errno;
+                progress_end();
+                ERROR("Unable to move %s: %s", curr -> name, strerror(rc));
+            }
+
+            curr -> begin = write_offset;
+            read_offset += total;
+            write_offset += total;
+            prev = curr;
+            curr = curr -> next;
+        }
+        else{// if name matches, skip the data
+            struct tar_t * tmp = curr;
+            if (!prev){
+                *archive = curr -> next;
+            }
+            else{
+                prev -> next = curr -> next;
+            }
+            curr = curr -> next;
+            free(tmp);
+
+            // next read starts after current entry
+            read_offset += total;
+        }
+    }
+    progress_end();
+
+    // resize file
+    if (ftruncate(fd, write_offset) < 0){
+        RC_ERROR("Could not truncate file: %s", strerror(rc));
+    }
+
+    // add end data
+    position_sink(&sink, &pos, fd, write_offset);
+    if (write_end_data(&sink, write_offset, verbosity) < 0){
+        ERROR("Could not close file");
+    }
+
+    return ret;
+}
+
+int tar_diff(FILE * f, struct tar_t * archive, const char verbosity){
+    struct stat st;
+    while (archive){
+        if (archive -> type == EXTENDED){
+            archive = archive -> next;
+            continue;
+        }
+
+        V_PRINT(f, "%s", archive -> name);
+
+        // if not found, print error
+        if (lstat(archive -> name, &st)){
+            int rc = errno;
+            fprintf(f, "Could not ");
+            if (archive -> type == SYMLINK){
+                fprintf(f, "readlink");
+            }
+            else{
+                fprintf(f, "stat");
+            }
+            fprintf(f, " %s: %s", archive -> name, strerror(rc));
+        }
+        else{
+            if (st.st_mtime != oct2uint(archive -> mtime, 11)){
+                fprintf(f, "%s: Mod time differs", archive -> name);
+            }
+            if (st.st_size != oct2uint(archive -> size, 11)){
+                fprintf(f, "%s: Mod time differs", archive -> name);
+            }
+        }
+
+        archive = archive -> next;
+    }
+    return 0;
+}
+
+// size of one block cache entry
+#define CACHE_BLOCK     65536
+
+// cached range of archive data
+struct cache_block {
+    off_t offset;                   // offset of the range in the archive (-1 = unused)
+    size_t len;                     // number of valid octets
+    char * data;
+    struct cache_block * prev;      // LRU list, most recently used first
+    struct cache_block * next;
+};
+
+struct tar_reader {
+    int fd;
+    struct tar_t * archive;         // catalog of headers
+
+    struct tar_t ** index;          // open addressed name -> entry table
+    size_t index_size;
+
+    struct cache_block * blocks;
+    size_t block_count;
+    struct cache_block ** lookup;   // open addressed offset -> block table
+    size_t lookup_size;
+    struct cache_block * head;      // most recently used
+    struct cache_block * tail;      // least recently used
+
+    struct tar_reader_stats stats;
+    pthread_mutex_t lock;
+};
+
+struct tar_member {
+    struct tar_reader * reader;
+    struct tar_t * entry;
+    off_t data;                     // offset of data in archive
+    size_t size;
+};
+
+// FNV-1a
+size_t hash_name(const char * name){
+    size_t hash = 2166136261u;
+    while (*name){
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t hash_offset(const off_t offset){
+    return (size_t) ((offset / CACHE_BLOCK) * 2654435761u);
+}
+
+// move block to the front of the LRU list
+static void cache_touch(struct tar_reader * reader, struct cache_block * block){
+    if (reader -> head == block){
+        return;
+    }
+
+    // unlink
+    if (block -> prev){
+        block -> prev -> next = block -> next;
+    }
+    if (block -> next){
+        block -> next -> prev = block -> prev;
+    }
+    if (reader -> tail == block){
+        reader -> tail = block -> prev;
+    }
+
+    // push front
+    block -> prev = NULL;
+    block -> next = reader -> head;
+    if (reader -> head){
+        reader -> head -> prev = block;
+    }
+    reader -> head = block;
+    if (!reader -> tail){
+        reader -> tail = block;
+    }
+}
+
+// find slot of block holding offset, or the empty slot where it would go
+static struct cache_block ** cache_slot(struct tar_reader * reader, const off_t offset){
+    size_t i = hash_offset(offset) % reader -> lookup_size;
+    while (reader -> lookup[i] && (reader -> lookup[i] -> offset != offset)){
+        i = (i + 1) % reader -> lookup_size;
+    }
+    return &reader -> lookup[i];
+}
+
+// remove block from lookup table (backward shift deletion)
+static void cache_unmap(struct tar_reader * reader, struct cache_block * block){
+    struct cache_block ** slot = cache_slot(reader, block -> offset);
+    if (!*slot){
+        return;
+    }
+
+    size_t i = slot - reader -> lookup;
+    reader -> lookup[i] = NULL;
+    for(size_t j = (i + 1) % reader -> lookup_size; reader -> lookup[j]; j = (j + 1) % reader -> lookup_size){
+        struct cache_block * moved = reader -> lookup[j];
+        reader -> lookup[j] = NULL;
+        *cache_slot(reader, moved -> offset) = moved;
+    }
+}
+
+// copy up to size octets at offset out of the cache, loading the containing block on a miss
+static ssize_t cache_read(struct tar_reader * reader, char * buf, size_t size, const off_t offset){
+    const off_t base = offset - offset % CACHE_BLOCK;
+    const size_t skip = offset - base;
+    size = MIN(size, CACHE_BLOCK - skip);
+
+    pthread_mutex_lock(&reader -> lock);
+    struct cache_block * block = *cache_slot(reader, base);
+    if (block){
+        reader -> stats.hits++;
+        cache_touch(reader, block);
+        const size_t len = (block -> len > skip)?MIN(size, block -> len - skip):0;
+        memcpy(buf, block -> data + skip, len);
+        pthread_mutex_unlock(&reader -> lock);
+        return len;
+    }
+    reader -> stats.misses++;
+    pthread_mutex_unlock(&reader -> lock);
+
+    // load outside of the lock so other threads are not held up by the disk
+    char * data = malloc(CACHE_BLOCK);
+    if (!data){
+        return -1;
+    }
+
+    ssize_t got = 0;
+    while (got < CACHE_BLOCK){
+        const ssize_t r = pread(reader -> fd, data + got, CACHE_BLOCK - got, base + got);
+        if (r < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            free(data);
+            return -1;
+        }
+        if (!r){
+            break;
+        }
+        got += r;
+    }
+
+    const size_t len = (got > skip)?MIN(size, got - skip):0;
+    memcpy(buf, data + skip, len);
+
+    pthread_mutex_lock(&reader -> lock);
+    if (!*cache_slot(reader, base)){
+        // reuse the least recently used block
+        struct cache_block * victim = reader -> tail;
+        if (victim -> offset >= 0){
+            cache_unmap(reader, victim);
+        }
+        char * old = victim -> data;
+        victim -> data = data;
+        victim -> offset = base;
+        victim -> len = got;
+        data = old;
+        *cache_slot(reader, base) = victim;
+        cache_touch(reader, victim);
+    }
+    pthread_mutex_unlock(&reader -> lock);
+
+    free(data);
+    return len;
+}
+
+struct tar_reader * tar_reader_open(const int fd, const size_t cache_size, const char verbosity){
+    if (fd < 0){
+        report("Bad file descriptor");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)){
+        const int rc = errno;
+        report("Unable to stat archive: %s", strerror(rc));
+        return NULL;
+    }
+
+    struct tar_reader * reader = calloc(1, sizeof(struct tar_reader));
+    if (!reader){
+        report("Unable to allocate reader");
+        return NULL;
+    }
+    reader -> fd = fd;
+    pthread_mutex_init(&reader -> lock, NULL);
+
+    // read all headers without touching the file offset
+    // the end of the file ends an archive without end data
+    size_t count = 0;
+    off_t offset = 0;
+    struct tar_t ** tar = &reader -> archive;
+    while (offset < st.st_size){
+        struct tar_t * entry = calloc(1, sizeof(struct tar_t));
+        if (!entry){
+            report("Unable to allocate entry");
+            tar_reader_close(reader);
+            return NULL;
+        }
+
+        const ssize_t got = pread(fd, entry -> block, 512, offset);
+        if (got != 512){
+            const int rc = errno;
+            free(entry);
+            if (got < 0){
+                report("Unable to read header at offset %lld: %s", (long long) offset, strerror(rc));
+            }
+            else{
+                report("Archive is truncated at offset %lld", (long long) offset);
+            }
+            tar_reader_close(reader);
+            return NULL;
+        }
+
+        if (iszeroed(entry -> block, 512)){
+            free(entry);
+            break;
+        }
+
+        if (!valid_header(entry -> block)){
+            free(entry);
+            report("Bad header at offset %lld", (long long) offset);
+            tar_reader_close(reader);
+            return NULL;
+        }
+
+        entry -> begin = offset;
+        offset += entry_span(entry);
+
+        *tar = entry;
+        tar = &entry -> next;
+        count++;
+
+        if (offset > st.st_size){
+            report("Archive is truncated in %.100s", entry -> name);
+            tar_reader_close(reader);
+            return NULL;
+        }
+    }
+
+    // index names; later entries replace earlier ones
+    reader -> index_size = 2 * count + 1;
+    reader -> index = calloc(reader -> index_size, sizeof(struct tar_t *));
+
+    reader -> block_count = cache_size / CACHE_BLOCK;
+    reader -> blocks = calloc(reader -> block_count + 1, sizeof(struct cache_block));
+    reader -> lookup_size = 2 * reader -> block_count + 1;
+    reader -> lookup = calloc(reader -> lookup_size, sizeof(struct cache_block *));
+
+    if (!reader -> index || !reader -> blocks || !reader -> lookup){
+        report("Unable to allocate reader");
+        tar_reader_close(reader);
+        return NULL;
+    }
+
+    for(struct tar_t * entry = reader -> archive; entry; entry = entry -> next){
+        // a name filling its field has no terminator
+        char key[sizeof(entry -> name) + 1];
+        snprintf(key, sizeof(key), "%.*s", (int) sizeof(entry -> name), entry -> name);
+
+        size_t i = hash_name(key) % reader -> index_size;
+        while (reader -> index[i] && strncmp(reader -> index[i] -> name, entry -> name, 100)){
+            i = (i + 1) % reader -> index_size;
+        }
+        reader -> index[i] = entry;
+    }
+
+    // all blocks start out unused at the back of the LRU list
+    for(size_t i = 0; i < reader -> block_count; i++){
+        reader -> blocks[i].offset = -1;
+        cache_touch(reader, &reader -> blocks[i]);
+    }
+
+    V_PRINT(stdout, "Indexed %zu entries", count);
+    return reader;
+}
+
+void tar_reader_close(struct tar_reader * reader){
+    if (!reader){
+        return;
+    }
+
+    if (reader -> blocks){
+        for(size_t i = 0; i < reader -> block_count; i++){
+            free(reader -> blocks[i].data);
+        }
+    }
+
+    pthread_mutex_destroy(&reader -> lock);
+    free(reader -> blocks);
+    free(reader -> lookup);
+    free(reader -> index);
+    tar_free(reader -> archive);
+    free(reader);
+}
+
+void tar_reader_stats(struct tar_reader * reader, struct tar_reader_stats * stats){
+    if (!reader || !stats){
+        return;
+    }
+
+    pthread_mutex_lock(&reader -> lock);
+    *stats = reader -> stats;
+    pthread_mutex_unlock(&reader -> lock);
+}
+
+struct tar_member * tar_member_open(struct tar_reader * reader, const char * name){
+    if (!reader || !name){
+        return NULL;
+    }
+
+    // the index is never modified after tar_reader_open, so no lock is needed
+    // only as much of the name as fits the name field is stored
+    char key[sizeof(reader -> archive -> name) + 1];
+    snprintf(key, sizeof(key), "%.*s", (int) sizeof(reader -> archive -> name), name);
+
+    size_t i = hash_name(key) % reader -> index_size;
+    while (reader -> index[i] && strncmp(reader -> index[i] -> name, name, 100)){
+        i = (i + 1) % reader -> index_size;
+    }
+
+    if (!reader -> index[i]){
+        return NULL;
+    }
+
+    struct tar_member * member = calloc(1, sizeof(struct tar_member));
+    if (!member){
+        return NULL;
+    }
+
+    member -> reader = reader;
+    member -> entry = reader -> index[i];
+    member -> data = member -> entry -> begin + 512;
+    member -> size = has_data(member -> entry)?oct2uint(member -> entry -> size, 11):0;
+    return member;
+}
+
+const struct tar_t * tar_member_entry(struct tar_member * member){
+    return member?member -> entry:NULL;
+}
+
+ssize_t tar_member_pread(struct tar_member * member, void * buf, const size_t size, const off_t offset){
+    if (!member || !buf || (offset < 0)){
+        return -1;
+    }
+
+    if (offset >= member -> size){
+        return 0;
+    }
+
+    const size_t want = MIN(size, member -> size - offset);
+    struct tar_reader * reader = member -> reader;
+
+    // uncached
+    if (!reader -> block_count){
+        size_t got = 0;
+        while (got < want){
+            const ssize_t r = pread(reader -> fd, (char *) buf + got, want - got, member -> data + offset + got);
+            if (r < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                return -1;
+            }
+            if (!r){
+                break;
+            }
+            got += r;
+        }
+        return got;
+    }
+
+    size_t got = 0;
+    while (got < want){
+        const ssize_t r = cache_read(reader, (char *) buf + got, want - got, member -> data + offset + got);
+        if (r < 0){
+            return -1;
+        }
+        if (!r){
+            break;
+        }
+        got += r;
+    }
+    return got;
+}
+
+void tar_member_close(struct tar_member * member){
+    free(member);
+}
+
+int tar_verify(const int fd, struct tar_t * archive, const char verbosity){
+    if (fd < 0){
+        ERROR("Bad file descriptor");
+    }
+
+    char * buf = malloc(COPYSIZE);
+    if (!buf){
+        ERROR("Unable to allocate buffer");
+    }
+
+    advise_sequential(fd);
+
+    int checked = 0;
+    int bad = 0;
+    off_t mark = 0;
+    for(; archive; archive = archive -> next){
+        if (!archive -> has_crc32c){
+            continue;
+        }
+
+        const unsigned int size = oct2uint(archive -> size, 11);
+        uint32_t crc = 0;
+        unsigned int got = 0;
+        while (got < size){
+            const int want = MIN(size - got, COPYSIZE);
+            if (pread(fd, buf, want, (off_t) archive -> begin + 512 + got) != want){
+                break;
+            }
+            crc = crc32c(crc, buf, want);
+            got += want;
+        }
+
+        if ((got != size) || (crc != archive -> crc32c)){
+            report("%s: Checksum does not match", archive -> name);
+            bad++;
+        }
+        else{
+            V_PRINT(stdout, "%s: OK", archive -> name);
+        }
+
+        checked++;
+        drop_behind(fd, &mark, archive -> begin + entry_span(archive), 0);
+    }
+
+    free(buf);
+    return bad?-1:checked;
+}
+
+struct tar_filter * tar_filter_compile(const size_t count, const char * patterns[], const size_t excludecount, const char * excludes[]){
+    if ((count && !patterns) || (excludecount && !excludes)){
+        return NULL;
+    }
+
+    struct tar_filter * filter = calloc(1, sizeof(struct tar_filter));
+    if (!filter){
+        return NULL;
+    }
+
+    filter -> include = calloc(1, sizeof(struct filter_node));
+    filter -> exclude = calloc(1, sizeof(struct filter_node));
+    filter -> patterns = calloc(count + excludecount, sizeof(char *));
+    filter -> count = count;
+    filter -> excludecount = excludecount;
+    if (!filter -> include || !filter -> exclude || (!filter -> patterns && (count + excludecount))){
+        tar_filter_free(filter);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < count + excludecount; i++){
+        const char * pattern = (i < count)?patterns[i]:excludes[i - count];
+        if (!(filter -> patterns[i] = strdup(pattern))){
+            tar_filter_free(filter);
+            return NULL;
+        }
+
+        // "dir/" selects the same members as "dir"
+        size_t len = strlen(pattern);
+        while ((len > 1) && (pattern[len - 1] == '/')){
+            filter -> patterns[i][--len] = '\0';
+        }
+
+        if (filter_add((i < count)?filter -> include:filter -> exclude, filter -> patterns[i], (i < count)?i:(i - count)) < 0){
+            tar_filter_free(filter);
+            return NULL;
+        }
+    }
+
+    return filter;
+}
+
+int tar_filter_match(const struct tar_filter * filter, const char * name){
+    if (!filter){
+        return 1;
+    }
+
+    if (filter_match(filter -> exclude, name, NULL)){
+        return 0;
+    }
+
+    if (!filter -> count){
+        return 1;
+    }
+
+    return filter_match(filter -> include, name, NULL);
+}
+
+void tar_filter_free(struct tar_filter * filter){
+    if (!filter){
+        return;
+    }
+
+    filter_free(filter -> include);
+    filter_free(filter -> exclude);
+    if (filter -> patterns){
+        for(size_t i = 0; i < filter -> count + filter -> excludecount; i++){
+            free(filter -> patterns[i]);
+        }
+    }
+    free(filter -> patterns);
+    free(filter);
+}
+
+// member waiting in an encoder
+struct encoder_item {
+    struct tar_t entry;
+    const char * buf;                       // data from memory,
+    const struct iovec * iov;               // or from a scatter-gather list,
+    int iovcnt;                             // or, if neither is set, from the file entry.original_name
+    struct encoder_item * next;
+};
+
+struct tar_encoder {
+    struct encoder_item * head;
+    struct encoder_item ** tail;
+    int finished;                           // tar_encoder_finish was called
+    int state;                              // 0 = header, 1 = data, 2 = padding, 3 = end data, 4 = done
+    size_t pos;                             // octets of the current part produced
+    size_t part;                            // size of the current part
+    int fd;                                 // data file of the current member
+    off_t offset;                           // octets of archive produced
+    char * buf;                             // produced, but not yet taken by tar_encoder_send
+    size_t len;
+    size_t sent;
+};
+
+struct tar_decoder {
+    int state;                              // 0 = header, 1 = extended records, 2 = data, 3 = padding, 4 = ended
+    char block[512];
+    size_t fill;                            // octets of block received
+    struct tar_t entry;                     // current member
+    struct tar_t next;                      // values from an extended header for the next member
+    char * records;                         // extended header records being received
+    size_t recfill;
+    uint64_t left;                          // data or records left in the current member
+    unsigned int pad;                       // padding left
+    uint32_t crc;                           // checksum of the data so far
+    off_t offset;                           // octets of archive parsed
+    int zeros;                              // zero blocks in a row
+    char * buf;                             // input read by tar_decoder_recv
+    size_t len;
+    size_t pos;
+};
+
+// largest extended header a decoder accepts
+#define DECODER_RECORDS (1 << 20)
+
+struct tar_encoder * tar_encoder_new(void){
+    struct tar_encoder * encoder = calloc(1, sizeof(struct tar_encoder));
+    if (!encoder || !(encoder -> buf = malloc(COPYSIZE))){
+        free(encoder);
+        return NULL;
+    }
+
+    encoder -> tail = &encoder -> head;
+    encoder -> fd = -1;
+    return encoder;
+}
+
+void tar_encoder_free(struct tar_encoder * encoder){
+    if (!encoder){
+        return;
+    }
+
+    while (encoder -> head){
+        struct encoder_item * next = encoder -> head -> next;
+        free(encoder -> head);
+        encoder -> head = next;
+    }
+
+    if (encoder -> fd >= 0){
+        close(encoder -> fd);
+    }
+    free(encoder -> buf);
+    free(encoder);
+}
+
+static int encoder_queue(struct tar_encoder * encoder, struct encoder_item * item){
+    if (encoder -> finished){
+        free(item);
+        ERROR("Encoder was already finished");
+    }
+
+    *encoder -> tail = item;
+    encoder -> tail = &item -> next;
+    return 0;
+}
+
+int tar_encoder_add_file(struct tar_encoder * encoder, const char * path, const char verbosity){
+    if (!encoder || !path){
+        ERROR("Bad encoder or path");
+    }
+
+    struct encoder_item * item = calloc(1, sizeof(struct encoder_item));
+    if (!item){
+        ERROR("Unable to allocate memory");
+    }
+
+    if (format_tar_data(&item -> entry, path, verbosity) < 0){
+        free(item);
+        ERROR("Failed to stat %s", path);
+    }
+
+    // directory names end with '/'
+    const size_t namelen = strlen(item -> entry.name);
+    if ((item -> entry.type == DIRECTORY) && namelen && (namelen < 99) && (item -> entry.name[namelen - 1] != '/')){
+        item -> entry.name[namelen] = '/';
+        calculate_checksum(&item -> entry);
+    }
+
+    return encoder_queue(encoder, item);
+}
+
+int tar_encoder_add_source(struct tar_encoder * encoder, const struct tar_source * source, const char verbosity){
+    if (!encoder || !source){
+        ERROR("Bad encoder or source");
+    }
+
+    if (source -> producer || (source -> size && !source -> buf && !source -> iov)){
+        ERROR("Encoder sources need their data in memory");
+    }
+
+    struct encoder_item * item = calloc(1, sizeof(struct encoder_item));
+    if (!item){
+        ERROR("Unable to allocate memory");
+    }
+
+    if (format_tar_source(&item -> entry, source, verbosity) < 0){
+        free(item);
+        ERROR("Bad source %s", source -> name?source -> name:"(null)");
+    }
+
+    item -> buf = source -> buf;
+    item -> iov = source -> iov;
+    item -> iovcnt = source -> iovcnt;
+    if (!item -> buf && !item -> iov){
+        item -> buf = "";
+    }
+
+    return encoder_queue(encoder, item);
+}
+
+int tar_encoder_finish(struct tar_encoder * encoder){
+    if (!encoder){
+        ERROR("Bad encoder");
+    }
+
+    encoder -> finished = 1;
+    return 0;
+}
+
+ssize_t tar_encoder_read(struct tar_encoder * encoder, char * buf, const size_t size){
+    if (!encoder || !buf){
+        ERROR("Bad encoder or buffer");
+    }
+
+    size_t got = 0;
+    while (got < size){
+        struct encoder_item * item = encoder -> head;
+        const size_t room = size - got;
+
+        if (!item && (encoder -> state < 3)){
+            if (!encoder -> finished){
+                break;
+            }
+
+            // same end data as write_end_data
+            const size_t pad = RECORDSIZE - (encoder -> offset % RECORDSIZE);
+            encoder -> part = pad + ((pad < (2 * BLOCKSIZE))?RECORDSIZE:0);
+            encoder -> pos = 0;
+            encoder -> state = 3;
+        }
+
+        if (encoder -> state == 4){
+            break;
+        }
+
+        size_t n = 0;
+        if (encoder -> state == 0){
+            n = MIN(room, 512 - encoder -> pos);
+            memcpy(buf + got, item -> entry.block + encoder -> pos, n);
+            if (encoder -> pos + n == 512){
+                encoder -> part = has_data(&item -> entry)?oct2uint(item -> entry.size, 11):0;
+                encoder -> state = 1;
+                encoder -> pos = 0;
+            }
+            else{
+                encoder -> pos += n;
+            }
+        }
+        else if (encoder -> state == 1){
+            n = MIN(room, encoder -> part - encoder -> pos);
+            if (n && item -> buf){
+                memcpy(buf + got, item -> buf + encoder -> pos, n);
+            }
+            else if (n && item -> iov){
+                // find the piece of the list at pos
+                size_t skip = encoder -> pos, copied = 0;
+                for(int i = 0; (i < item -> iovcnt) && (copied < n); i++){
+                    const size_t len = item -> iov[i].iov_len;
+                    if (skip >= len){
+                        skip -= len;
+                        continue;
+                    }
+                    const size_t take = MIN(len - skip, n - copied);
+                    memcpy(buf + got + copied, (const char *) item -> iov[i].iov_base + skip, take);
+                    copied += take;
+                    skip = 0;
+                }
+                memset(buf + got + copied, 0, n - copied);
+            }
+            else if (n){
+                if ((encoder -> fd < 0) && ((encoder -> fd = open(item -> entry.original_name, O_RDONLY)) < 0)){
+                    RC_ERROR("Could not open %s: %s", item -> entry.original_name, strerror(rc));
+                }
+
+                throttle(n);
+                const int r = read_size(encoder -> fd, buf + got, n);
+                if (r < 0){
+                    RC_ERROR("Could not read %s: %s", item -> entry.original_name, strerror(rc));
+                }
+                if ((size_t) r < n){
+                    ERROR("%s changed size while being archived", item -> entry.original_name);
+                }
+            }
+
+            encoder -> pos += n;
+            if (encoder -> pos == encoder -> part){
+                if (encoder -> fd >= 0){
+                    close(encoder -> fd);
+                    encoder -> fd = -1;
+                }
+                encoder -> pos = 0;
+                encoder -> part = (BLOCKSIZE - encoder -> part % BLOCKSIZE) % BLOCKSIZE;
+                encoder -> state = 2;
+            }
+        }
+        else{
+            // padding after data, or end data
+            n = MIN(room, encoder -> part - encoder -> pos);
+            memset(buf + got, 0, n);
+            encoder -> pos += n;
+            if (encoder -> pos == encoder -> part){
+                encoder -> pos = 0;
+                if (encoder -> state == 3){
+                    encoder -> state = 4;
+                }
+                else{
+                    encoder -> head = item -> next;
+                    if (!encoder -> head){
+                        encoder -> tail = &encoder -> head;
+                    }
+                    free(item);
+                    encoder -> state = 0;
+                }
+            }
+        }
+
+        got += n;
+        encoder -> offset += n;
+    }
+
+    if (got){
+        return got;
+    }
+
+    return (encoder -> state == 4)?0:TAR_AGAIN;
+}
+
+int tar_encoder_send(struct tar_encoder * encoder, const int fd){
+    if (!encoder || (fd < 0)){
+        ERROR("Bad encoder or file descriptor");
+    }
+
+    while (1){
+        // refill once everything produced was taken
+        if (encoder -> sent == encoder -> len){
+            const ssize_t got = tar_encoder_read(encoder, encoder -> buf, COPYSIZE);
+            if (got <= 0){
+                return got;
+            }
+            encoder -> len = got;
+            encoder -> sent = 0;
+        }
+
+        const ssize_t rc = write(fd, encoder -> buf + encoder -> sent, encoder -> len - encoder -> sent);
+        if (rc < 0){
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+                return TAR_AGAIN;
+            }
+            if (errno == EINTR){
+                continue;
+            }
+            RC_ERROR("Could not write archive: %s", strerror(rc));
+        }
+        encoder -> sent += rc;
+    }
+}
+
+struct tar_decoder * tar_decoder_new(void){
+    return calloc(1, sizeof(struct tar_decoder));
+}
+
+void tar_decoder_free(struct tar_decoder * decoder){
+    if (decoder){
+        free(decoder -> records);
+        free(decoder -> buf);
+        free(decoder);
+    }
+}
+
+int tar_decoder_feed(struct tar_decoder * decoder, const char * buf, const size_t size, size_t * used, struct tar_event * event){
+    if (!decoder || (size && !buf) || !used || !event){
+        ERROR("Bad decoder arguments");
+    }
+
+    memset(event, 0, sizeof(*event));
+    *used = 0;
+    while (*used < size){
+        const size_t avail = size - *used;
+        const char * in = buf + *used;
+
+        if (decoder -> state == 4){
+            // anything after the end is padding
+            *used = size;
+            return 0;
+        }
+
+        if (decoder -> state == 0){
+            const size_t n = MIN(avail, 512 - decoder -> fill);
+            memcpy(decoder -> block + decoder -> fill, in, n);
+            decoder -> fill += n;
+            *used += n;
+            decoder -> offset += n;
+            if (decoder -> fill < 512){
+                continue;
+            }
+            decoder -> fill = 0;
+
+            if (iszeroed(decoder -> block, 512)){
+                if (++decoder -> zeros == 2){
+                    decoder -> state = 4;
+                    event -> type = TAR_EVENT_END;
+                    return 1;
+                }
+                continue;
+            }
+            decoder -> zeros = 0;
+
+            if (!valid_header(decoder -> block)){
+                ERROR("Bad header at %lld", (long long) (decoder -> offset - 512));
+            }
+
+            memcpy(decoder -> entry.block, decoder -> block, 512);
+            decoder -> entry.begin = decoder -> offset - 512;
+            decoder -> entry.has_crc32c = decoder -> next.has_crc32c;
+            decoder -> entry.crc32c = decoder -> next.crc32c;
+            memset(&decoder -> next, 0, sizeof(decoder -> next));
+
+            decoder -> left = oct2uint(decoder -> entry.size, 11);
+            decoder -> pad = (BLOCKSIZE - decoder -> left % BLOCKSIZE) % BLOCKSIZE;
+            decoder -> crc = 0;
+
+            if (decoder -> entry.type == EXTENDED){
+                if (decoder -> left > DECODER_RECORDS){
+                    ERROR("Extended header at %lld is too large", (long long) decoder -> entry.begin);
+                }
+
+                char * records = realloc(decoder -> records, decoder -> left + 1);
+                if (!records){
+                    ERROR("Unable to allocate memory");
+                }
+                decoder -> records = records;
+                decoder -> recfill = 0;
+                decoder -> state = 1;
+                continue;
+            }
+
+            decoder -> state = decoder -> left?2:(decoder -> pad?3:0);
+            event -> type = TAR_EVENT_HEADER;
+            event -> entry = &decoder -> entry;
+            return 1;
+        }
+
+        if (decoder -> state == 1){
+            const size_t n = MIN(avail, decoder -> left);
+            memcpy(decoder -> records + decoder -> recfill, in, n);
+            decoder -> recfill += n;
+            decoder -> left -= n;
+            *used += n;
+            decoder -> offset += n;
+            if (!decoder -> left){
+                parse_extended(decoder -> records, decoder -> recfill, &decoder -> next);
+                decoder -> state = decoder -> pad?3:0;
+            }
+            continue;
+        }
+
+        if (decoder -> state == 2){
+            const size_t n = MIN(avail, decoder -> left);
+            if (decoder -> entry.has_crc32c){
+                decoder -> crc = crc32c(decoder -> crc, in, n);
+            }
+            decoder -> left -= n;
+            *used += n;
+            decoder -> offset += n;
+
+            if (!decoder -> left){
+                if (decoder -> entry.has_crc32c && (decoder -> crc != decoder -> entry.crc32c)){
+                    ERROR("Checksum mismatch in %s", decoder -> entry.name);
+                }
+                decoder -> state = decoder -> pad?3:0;
+            }
+
+            event -> type = TAR_EVENT_DATA;
+            event -> entry = &decoder -> entry;
+            event -> data = in;
+            event -> size = n;
+            return 1;
+        }
+
+        // padding
+        const size_t n = MIN(avail, decoder -> pad);
+        decoder -> pad -= n;
+        *used += n;
+        decoder -> offset += n;
+        if (!decoder -> pad){
+            decoder -> state = 0;
+        }
+    }
+
+    return (decoder -> state == 4)?0:TAR_AGAIN;
+}
+
+int tar_decoder_recv(struct tar_decoder * decoder, const int fd, struct tar_event * event){
+    if (!decoder || (fd < 0)){
+        ERROR("Bad decoder or file descriptor");
+    }
+
+    if (!decoder -> buf && !(decoder -> buf = malloc(COPYSIZE))){
+        ERROR("Unable to allocate memory");
+    }
+
+    while (1){
+        if (decoder -> pos == decoder -> len){
+            if (decoder -> state == 4){
+                return 0;
+            }
+
+            const ssize_t got = read(fd, decoder -> buf, COPYSIZE);
+            if (got < 0){
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+                    return TAR_AGAIN;
+                }
+                if (errno == EINTR){
+                    continue;
+                }
+                RC_ERROR("Could not read archive: %s", strerror(rc));
+            }
+            if (!got){
+                ERROR("Archive ended without end data");
+            }
+            decoder -> len = got;
+            decoder -> pos = 0;
+        }
+
+        size_t used = 0;
+        const int rc = tar_decoder_feed(decoder, decoder -> buf + decoder -> pos, decoder -> len - decoder -> pos, &used, event);
+        decoder -> pos += used;
+        if (rc != TAR_AGAIN){
+            return rc;
+        }
+    }
+}
+
+int print_entry_metadata(FILE * f, struct tar_t * entry){
+    if (!entry){
+        return -1;
+    }
+
+    time_t mtime = oct2uint(entry -> mtime, 12);
+    char mtime_str[32];
+    struct tm tm;
+    strftime(mtime_str, sizeof(mtime_str), "%c", localtime_r(&mtime, &tm));
+    fprintf(f, "File Name: %s\n", entry -> name);
+    fprintf(f, "File Mode: %s (%03o)\n", entry -> mode, oct2uint(entry -> mode, 8));
+    fprintf(f, "Owner UID: %s (%d)\n", entry -> uid, oct2uint(entry -> uid, 12));
+    fprintf(f, "Owner GID: %s (%d)\n", entry -> gid, oct2uint(entry -> gid, 12));
+    fprintf(f, "File Size: %s (%d)\n", entry -> size, oct2uint(entry -> size, 12));
+    fprintf(f, "Time     : %s (%s)\n", entry -> mtime, mtime_str);
+    fprintf(f, "Checksum : %s\n", entry -> check);
+    fprintf(f, "File Type: ");
+    switch (entry -> type){
+        case REGULAR: case NORMAL:
+            fprintf(f, "Normal File");
+            break;
+        case HARDLINK:
+            fprintf(f, "Hard Link");
+            break;
+        case SYMLINK:
+            fprintf(f, "Symbolic Link");
+            break;
+        case CHAR:
+            fprintf(f, "Character Special");
+            break;
+        case BLOCK:
+            fprintf(f, "Block Special");
+            break;
+        case DIRECTORY:
+            fprintf(f, "Directory");
+            break;
+        case FIFO:
+            fprintf(f, "FIFO");
+            break;
+        case CONTIGUOUS:
+            fprintf(f, "Contiguous File");
+            break;
+    }
+    fprintf(f, " (%c)\n", entry -> type?entry -> type:'0');
+    fprintf(f, "Link Name: %s\n", entry -> link_name);
+    fprintf(f, "Ustar\\000: %c%c%c%c%c\\%2x\\%2x\\%02x\n",   entry -> ustar[0], entry -> ustar[1], entry -> ustar[2], entry -> ustar[3], entry -> ustar[4], entry -> ustar[5], entry -> ustar[6], entry -> ustar[7]);
+    fprintf(f, "Username : %s\n", entry -> owner);
+    fprintf(f, "Group    : %s\n", entry -> group);
+    fprintf(f, "Major    : %s\n", entry -> major);
+    fprintf(f, "Minor    : %s\n", entry -> minor);
+    fprintf(f, "Prefix   : %s\n", entry -> prefix);
+    fprintf(f, "\n");
+
+    return 0;
+}
+
+int print_tar_metadata(FILE * f, struct tar_t * archive){
+    while (archive){
+        print_entry_metadata(f, archive);
+        archive = archive -> next;
+    }
+    return 0;
+}
+
+struct tar_t * exists(struct tar_t * archive, const char * filename, const char ori){
+    while (archive){
+        if (ori){
+            if (!strncmp(archive -> original_name, filename, MAX(strlen(archive -> original_name), strlen(filename)) + 1)){
+                return archive;
+            }
+        }
+        else{
+            if (!strncmp(archive -> name, filename, MAX(strlen(archive -> name), strlen(filename)) + 1)){
+                return archive;
+            }
+        }
+        archive = archive -> next;
+    }
+    return NULL;
+}
+
+int format_tar_data(struct tar_t * entry, const char * filename, const char verbosity){
+    if (!entry){
+        ERROR("Bad destination entry");
+    }
+
+    struct stat st;
+    if (lstat(filename, &st)){
+        RC_ERROR("Cannot stat %s: %s", filename, strerror(rc));
+    }
+
+    return format_tar_stat(entry, filename, &st, verbosity);
+}
+
+int format_tar_stat(struct tar_t * entry, const char * filename, const struct stat * st, const char verbosity){
+    if (!entry || !st){
+        ERROR("Bad destination entry");
+    }
+
+    // start putting in new data (all fields are NULL terminated ASCII strings)
+    memset(entry, 0, sizeof(struct tar_t));
+    // names may fill their fields without a terminating NULL
+    const char * name = member_name(filename);
+    memcpy(entry -> original_name, filename, strnlen(filename, sizeof(entry -> original_name)));
+    memcpy(entry -> name, name, strnlen(name, sizeof(entry -> name)));
+    snprintf(entry -> mode,  sizeof(entry -> mode),  "%07o", st -> st_mode & 0777);
+    snprintf(entry -> uid,   sizeof(entry -> uid),   "%07o", st -> st_uid);
+    snprintf(entry -> gid,   sizeof(entry -> gid),   "%07o", st -> st_gid);
+    snprintf(entry -> size,  sizeof(entry -> size),  "%011o", (int) st -> st_size);
+    snprintf(entry -> mtime, sizeof(entry -> mtime), "%011o", (int) st -> st_mtime);
+    strncpy(entry -> group, "None", 5);                     // default value
+    memcpy(entry -> ustar, "ustar  \x00", 8);
+
+    // figure out filename type and fill in type-specific fields
+    switch (st -> st_mode & S_IFMT) {
+        case S_IFREG:
+            entry -> type = NORMAL;
+            break;
+        case S_IFLNK:
+            entry -> type = SYMLINK;
+
+            // file size is 0, but will print link size
+            memset(entry -> size, '0', sizeof(entry -> size) - 1);
+
+            // get link name
+            if (readlink(filename, entry -> link_name, 100) < 0){
+                RC_ERROR("Could not read link %s: %s", filename, strerror(rc));
+            }
+
+            break;
+        case S_IFCHR:
+            entry -> type = CHAR;
+            // get character device major and minor values
+            snprintf(entry -> major, sizeof(entry -> major), "%07o", major(st -> st_rdev));
+            snprintf(entry -> minor, sizeof(entry -> minor), "%07o", minor(st -> st_rdev));
+            break;
+        case S_IFBLK:
+            entry -> type = BLOCK;
+            // get block device major and minor values
+            snprintf(entry -> major, sizeof(entry -> major), "%07o", major(st -> st_rdev));
+            snprintf(entry -> minor, sizeof(entry -> minor), "%07o", minor(st -> st_rdev));
+            break;
+        case S_IFDIR:
+            memset(entry -> size, '0', 11);
+            entry -> type = DIRECTORY;
+            break;
+        case S_IFIFO:
+            entry -> type = FIFO;
+            break;
+        case S_IFSOCK:
+            entry -> type = -1;
+            ERROR("Error: Cannot tar socket");
+        default:
+            entry -> type = -1;
+            ERROR("Error: Unknown filetype");
+    }
+
+    const struct tar_options * options = &current() -> options;
+    if (options -> reproducible){
+        // owners are stored by number only
+        memset(entry -> owner, 0, sizeof(entry -> owner));
+        memset(entry -> group, 0, sizeof(entry -> group));
+
+        // only whether a file is executable is kept
+        const unsigned int mode = (entry -> type == SYMLINK)?0777:
+                                  ((entry -> type == DIRECTORY) || (st -> st_mode & 0111))?0755:0644;
+        snprintf(entry -> mode, sizeof(entry -> mode), "%07o", mode);
+    }
+    else{
+        // get username
+        if (id_name(0, st -> st_uid, entry -> owner, sizeof(entry -> owner)) < 0){
+            const int err = errno;
+            V_PRINT(stderr, "Warning: Unable to get username of uid %u for entry '%s': %s", st -> st_uid, filename, strerror(err));
+        }
+
+        // get group name
+        id_name(1, st -> st_gid, entry -> group, sizeof(entry -> group));
+    }
+
+    if (options -> owner >= 0){
+        snprintf(entry -> uid, sizeof(entry -> uid), "%07o", (unsigned int) options -> owner);
+    }
+    if (options -> group >= 0){
+        snprintf(entry -> gid, sizeof(entry -> gid), "%07o", (unsigned int) options -> group);
+    }
+    if ((options -> clamp_mtime >= 0) && (st -> st_mtime > options -> clamp_mtime)){
+        snprintf(entry -> mtime, sizeof(entry -> mtime), "%011o", (int) options -> clamp_mtime);
+    }
+
+    // get the checksum
+    calculate_checksum(entry);
+
+    return 0;
+}
+
+int format_tar_source(struct tar_t * entry, const struct tar_source * source, const char verbosity){
+    if (!entry || !source){
+        ERROR("Bad destination entry");
+    }
+
+    if (!source -> name || !source -> name[0] || (strlen(source -> name) > 99)){
+        ERROR("Source name must be between 1 and 99 characters");
+    }
+
+    const char type = source -> type?source -> type:NORMAL;
+    if ((source -> size) && (type != REGULAR) && (type != NORMAL) && (type != CONTIGUOUS)){
+        ERROR("Only regular files can have data");
+    }
+
+    if ((unsigned long long) source -> size > 077777777777ULL){
+        ERROR("Source %s is too large for a header", source -> name);
+    }
+
+    if (((type == HARDLINK) || (type == SYMLINK)) && (!source -> link_name || (strlen(source -> link_name) > 99))){
+        ERROR("Links need a link name of at most 99 characters");
+    }
+
+    memset(entry, 0, sizeof(struct tar_t));
+    memcpy(entry -> name, source -> name, strlen(source -> name));
+    snprintf(entry -> mode,  sizeof(entry -> mode),  "%07o", source -> mode & 0777);
+    snprintf(entry -> uid,   sizeof(entry -> uid),   "%07o", source -> uid);
+    snprintf(entry -> gid,   sizeof(entry -> gid),   "%07o", source -> gid);
+    snprintf(entry -> size,  sizeof(entry -> size),  "%011llo", (unsigned long long) source -> size);
+    snprintf(entry -> mtime, sizeof(entry -> mtime), "%011o", (int) source -> mtime);
+    entry -> type = type;
+    if (source -> link_name){
+        memcpy(entry -> link_name, source -> link_name, strnlen(source -> link_name, sizeof(entry -> link_name)));
+    }
+    memcpy(entry -> ustar, "ustar  \x00", 8);
+    strncpy(entry -> owner, source -> owner?source -> owner:"", sizeof(entry -> owner) - 1);
+    strncpy(entry -> group, source -> group?source -> group:"None", sizeof(entry -> group) - 1);
+
+    calculate_checksum(entry);
+    return 0;
+}
+
+unsigned int calculate_checksum(struct tar_t * entry){
+    // use spaces for the checksum bytes while calculating the checksum
+    memset(entry -> check, ' ', 8);
+
+    // sum of entire metadata
+    unsigned int check = 0;
+    for(int i = 0; i < 512; i++){
+        check += (unsigned char) entry -> block[i];
+    }
+
+    snprintf(entry -> check, sizeof(entry -> check), "%06o0", check);
+
+    entry -> check[6] = '\0';
+    entry -> check[7] = ' ';
+    return check;
+}
+
+int valid_header(const char * block){
+    if (iszeroed((char *) block, 512)){
+        return 0;
+    }
+
+    struct tar_t entry;
+    memcpy(entry.block, block, 512);
+    const unsigned int stored = oct2uint(entry.check, 6);
+    return entry.name[0] && (calculate_checksum(&entry) == stored);
+}
+
+// window of an archive read while walking headers
+struct window {
+    int fd;
+    char * buf;
+    off_t start;                    // archive offset of buf[0]
+    off_t len;
+};
+
+// get block at pos, reading it if needed
+// headers close behind the window are read with the COPYSIZE octets after them, ones past large members alone
+// returns NULL at the end of the file
+static const char * window_block(struct window * window, const off_t pos){
+    if ((pos < window -> start) || (pos + BLOCKSIZE > window -> start + window -> len)){
+        const size_t want = (pos < window -> start + window -> len + COPYSIZE)?COPYSIZE:BLOCKSIZE;
+        const ssize_t got = pread(window -> fd, window -> buf, want, pos);
+        window -> start = pos;
+        window -> len = (got > 0)?got:0;
+        if (window -> len < BLOCKSIZE){
+            return NULL;
+        }
+    }
+    return window -> buf + (pos - window -> start);
+}
+
+int find_end(const int fd, off_t * end, const char verbosity){
+    if ((fd < 0) || !end){
+        ERROR("Bad arguments");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)){
+        RC_ERROR("Unable to stat archive: %s", strerror(rc));
+    }
+
+    struct window window = { fd, malloc(COPYSIZE), 0, 0 };
+    if (!window.buf){
+        ERROR("Unable to allocate scan buffer");
+    }
+
+    // zero blocks can be member data (a nested archive ends with them), so the
+    // end is only known after following the headers from the first one
+    off_t offset = 0;
+    const char * block;
+    while ((block = window_block(&window, offset)) && !iszeroed((char *) block, 512)){
+        if (!valid_header(block)){
+            free(window.buf);
+            ERROR("Bad header at offset %lld", (long long) offset);
+        }
+
+        struct tar_t entry;
+        memcpy(entry.block, block, 512);
+        offset += entry_span(&entry);
+        if (offset > st.st_size){
+            free(window.buf);
+            ERROR("Archive is truncated");
+        }
+    }
+    free(window.buf);
+
+    *end = offset;
+    return 0;
+}
+
+int ls_entry(FILE * f, struct tar_t * entry, const struct tar_filter * filter, const char verbosity){
+    if (!verbosity || (entry -> type == EXTENDED)){
+        return 0;
+    }
+
+    // if no filter was given, print everything
+    if (!filter || tar_filter_match(filter, entry -> name)){
+        char buf[1024];
+        struct lister list;
+        memset(&list, 0, sizeof(list));
+        list.f = f;
+        list.buf = buf;
+        list.size = sizeof(buf);
+        list.minute = -1;
+
+        list_entry(&list, entry, TAR_LIST_TEXT, verbosity);
+        list_flush(&list);
+        if (list.error){
+            ERROR("Unable to write listing");
+        }
+    }
+
+    return 0;
+}
+
+void list_flush(struct lister * list){
+    if (list -> len && (fwrite(list -> buf, 1, list -> len, list -> f) != list -> len)){
+        list -> error = 1;
+    }
+    list -> len = 0;
+}
+
+void list_bytes(struct lister * list, const char * data, const size_t size){
+    if (list -> len + size > list -> size){
+        list_flush(list);
+        if (size > list -> size){
+            if (fwrite(data, 1, size, list -> f) != size){
+                list -> error = 1;
+            }
+            return;
+        }
+    }
+
+    memcpy(list -> buf + list -> len, data, size);
+    list -> len += size;
+}
+
+void list_uint(struct lister * list, unsigned long long value){
+    char digits[20];
+    size_t i = sizeof(digits);
+    do {
+        digits[--i] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    list_bytes(list, digits + i, sizeof(digits) - i);
+}
+
+void list_quoted(struct lister * list, const char * str, const size_t max, const int format){
+    static const char hex[] = "0123456789abcdef";
+
+    list_bytes(list, "\"", 1);
+    const size_t len = strnlen(str, max);
+    size_t start = 0;
+    for(size_t i = 0; i < len; i++){
+        const unsigned char c = str[i];
+        if (format == TAR_LIST_CSV){
+            // quotes are doubled; everything else is taken as is
+            if (c == '"'){
+                list_bytes(list, str + start, i + 1 - start);
+                start = i;
+            }
+            continue;
+        }
+
+        if ((c == '"') || (c == '\\') || (c < 0x20)){
+            list_bytes(list, str + start, i - start);
+            start = i + 1;
+
+            char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+            if ((c == '"') || (c == '\\')){
+                escape[1] = c;
+                list_bytes(list, escape, 2);
+            }
+            else{
+                list_bytes(list, escape, 6);
+            }
+        }
+    }
+    list_bytes(list, str + start, len - start);
+    list_bytes(list, "\"", 1);
+}
+
+void list_entry(struct lister * list, struct tar_t * entry, const int format, const char verbosity){
+    const unsigned int mode = oct2uint(entry -> mode, 7);
+    const unsigned int size = oct2uint(entry -> size, 11);
+    const long long mtime = oct2uint(entry -> mtime, 11);
+    const char type = entry -> type?entry -> type:NORMAL;
+
+    if (format == TAR_LIST_BINARY){
+        struct tar_list_record record;
+        memset(&record, 0, sizeof(record));
+        record.offset = entry -> begin;
+        record.size = size;
+        record.mtime = mtime;
+        record.mode = mode;
+        record.uid = oct2uint(entry -> uid, 7);
+        record.gid = oct2uint(entry -> gid, 7);
+        record.crc32c = entry -> crc32c;
+        record.name_len = strnlen(entry -> name, sizeof(entry -> name));
+        record.link_len = strnlen(entry -> link_name, sizeof(entry -> link_name));
+        record.type = type;
+        record.has_crc32c = entry -> has_crc32c;
+        list_bytes(list, (const char *) &record, sizeof(record));
+        list_bytes(list, entry -> name, record.name_len);
+        list_bytes(list, entry -> link_name, record.link_len);
+        return;
+    }
+
+    if ((format == TAR_LIST_NDJSON) || (format == TAR_LIST_CSV)){
+        const int json = (format == TAR_LIST_NDJSON);
+        const char * sep = json?",\"":",";
+
+        #define LIST_KEY(key) list_bytes(list, sep, strlen(sep)); if (json){ list_bytes(list, key "\":", strlen(key) + 2); }
+
+        if (json){
+            list_bytes(list, "{\"name\":", 8);
+        }
+        list_quoted(list, entry -> name, sizeof(entry -> name), format);
+        LIST_KEY("type");
+        list_bytes(list, "\"", 1);
+        list_bytes(list, &type, 1);
+        list_bytes(list, "\"", 1);
+        LIST_KEY("mode");
+        list_uint(list, mode);
+        LIST_KEY("uid");
+        list_uint(list, oct2uint(entry -> uid, 7));
+        LIST_KEY("gid");
+        list_uint(list, oct2uint(entry -> gid, 7));
+        LIST_KEY("owner");
+        list_quoted(list, entry -> owner, sizeof(entry -> owner), format);
+        LIST_KEY("group");
+        list_quoted(list, entry -> group, sizeof(entry -> group), format);
+        LIST_KEY("size");
+        list_uint(list, size);
+        LIST_KEY("mtime");
+        list_uint(list, mtime);
+        LIST_KEY("offset");
+        list_uint(list, entry -> begin);
+        if (!json || entry -> link_name[0]){
+            LIST_KEY("link");
+            list_quoted(list, entry -> link_name, sizeof(entry -> link_name), format);
+        }
+        if (!json || entry -> has_crc32c){
+            LIST_KEY("crc32c");
+            if (entry -> has_crc32c){
+                char crc[10];
+                snprintf(crc, sizeof(crc), "\"%08x", entry -> crc32c);
+                list_bytes(list, crc, 9);
+                list_bytes(list, "\"", 1);
+            }
+        }
+
+        #undef LIST_KEY
+
+        list_bytes(list, json?"}\n":"\n", json?2:1);
+        return;
+    }
+
+    if (verbosity > 1){
+        const char mode_str[11] = { "-hlcbdp-"[entry -> type?entry -> type - '0':0],
+                                    mode & S_IRUSR?'r':'-',
+                                    mode & S_IWUSR?'w':'-',
+                                    mode & S_IXUSR?'x':'-',
+                                    mode & S_IRGRP?'r':'-',
+                                    mode & S_IWGRP?'w':'-',
+                                    mode & S_IXGRP?'x':'-',
+                                    mode & S_IROTH?'r':'-',
+                                    mode & S_IWOTH?'w':'-',
+                                    mode & S_IXOTH?'x':'-',
+                                    ' '};
+        list_bytes(list, mode_str, sizeof(mode_str));
+
+        // members stored without owner names show their ids
+        if (entry -> owner[0]){
+            list_bytes(list, entry -> owner, strnlen(entry -> owner, sizeof(entry -> owner)));
+        }
+        else{
+            list_uint(list, oct2uint(entry -> uid, 7));
+        }
+        list_bytes(list, "/", 1);
+        if (entry -> group[0]){
+            list_bytes(list, entry -> group, strnlen(entry -> group, sizeof(entry -> group)));
+        }
+        else{
+            list_uint(list, oct2uint(entry -> gid, 7));
+        }
+        list_bytes(list, " ", 1);
+
+        if ((entry -> type == CHAR) || (entry -> type == BLOCK)){
+            list_uint(list, oct2uint(entry -> major, 7));
+            list_bytes(list, ",", 1);
+            list_uint(list, oct2uint(entry -> minor, 7));
+        }
+        else{
+            list_uint(list, size);
+        }
+
+        // neighbouring entries usually share the minute they were modified in
+        if ((mtime - mtime % 60) != list -> minute){
+            const time_t t = mtime;
+            struct tm time;
+            localtime_r(&t, &time);
+            list -> stamplen = snprintf(list -> stamp, sizeof(list -> stamp), " %d-%02d-%02d %02d:%02d ", time.tm_year + 1900, time.tm_mon + 1, time.tm_mday, time.tm_hour, time.tm_min);
+            list -> minute = mtime - mtime % 60;
+        }
+        list_bytes(list, list -> stamp, list -> stamplen);
+    }
+
+    list_bytes(list, entry -> name, strnlen(entry -> name, sizeof(entry -> name)));
+
+    if (verbosity > 1){
+        if (entry -> type == HARDLINK){
+            list_bytes(list, " link to ", 9);
+            list_bytes(list, entry -> link_name, strnlen(entry -> link_name, sizeof(entry -> link_name)));
+        }
+        else if (entry -> type == SYMLINK){
+            list_bytes(list, " -> ", 4);
+            list_bytes(list, entry -> link_name, strnlen(entry -> link_name, sizeof(entry -> link_name)));
+        }
+    }
+
+    list_bytes(list, "\n", 1);
+}
+
+int extract_entry(const int fd, struct tar_t * entry, const char verbosity){
+    struct restore restore;
+    memset(&restore, 0, sizeof(restore));
+    restore.owner = !geteuid();
+
+    int ret = extract_queued(fd, entry, &restore, verbosity);
+    if (restore_apply(&restore) < 0){
+        ret = -1;
+    }
+    return ret;
+}
+
+int extract_queued(const int fd, struct tar_t * entry, struct restore * restore, const char verbosity){
+    if (entry -> type == EXTENDED){
+        return 0;
+    }
+
+    V_PRINT(stdout, "%s", entry -> name);
+
+    if ((entry -> type == REGULAR) || (entry -> type == NORMAL) || (entry -> type == CONTIGUOUS)){
+        // create intermediate directories
+        size_t len = strlen(entry -> name);
+        if (!len)
+        {
+            ERROR("Attempted to extract entry with empty name");
+        }
+
+        if (current() -> options.skip && unchanged(fd, entry)){
+            V_PRINT(stdout, "Skipping unchanged %s", entry -> name);
+            return 0;
+        }
+
+        char * path = calloc(len + 1, sizeof(char));
+        strncpy(path, entry -> name, len);
+
+        // remove file from path
+        while (--len && (path[len] != '/'));
+        path[len] = '\0';   // if nothing was found, path is terminated
+
+        if (recursive_mkdir(path, DEFAULT_DIR_MODE, verbosity) < 0){
+            report("Could not make directory %s", path);
+            free(path);
+            return -1;
+        }
+        free(path);
+
+        // create file
+        const unsigned int size = oct2uint(entry -> size, 11);
+        int direct = 1;
+        int f = open_data(entry -> name, O_WRONLY | O_CREAT | O_TRUNC, oct2uint(entry -> mode, 7) & 0777, &direct);
+        if (f < 0){
+            RC_ERROR("Unable to open file %s: %s", entry -> name, strerror(rc));
+        }
+
+        char * buf = alloc_data(COPYSIZE);
+        if (!buf){
+            close(f);
+            ERROR("Unable to allocate copy buffer");
+        }
+
+        // copy data to file
+        off_t mark = 0;
+        uint32_t crc = 0;
+        unsigned int got = 0;
+        while (got < size){
+            const int want = MIN(size - got, COPYSIZE);
+            const int r = pread_size(fd, buf, want, (off_t) entry -> begin + 512 + got);
+            if (r != want){
+                free(buf);
+                close(f);
+                ERROR("Unable to read %s from archive", entry -> name);
+            }
+
+            if (entry -> has_crc32c){
+                crc = crc32c(crc, buf, r);
+            }
+
+            // direct writes must cover whole aligned blocks; the file is truncated to size afterwards
+            int len = r;
+            if (direct && (len % DIRECT_ALIGN)){
+                memset(buf + len, 0, DIRECT_ALIGN - len % DIRECT_ALIGN);
+                len += DIRECT_ALIGN - len % DIRECT_ALIGN;
+            }
+
+            throttle(len);
+            if (write_size(f, buf, len) != len){
+                const int rc = errno;
+                free(buf);
+                close(f);
+                ERROR("Unable to write to %s: %s", entry -> name, strerror(rc));
+            }
+            progress_add(r, 0, NULL);
+
+            got += r;
+            drop_behind(f, &mark, got, 1);
+        }
+
+        free(buf);
+
+        if (direct && (ftruncate(f, size) < 0)){
+            const int rc = errno;
+            close(f);
+            ERROR("Unable to truncate %s: %s", entry -> name, strerror(rc));
+        }
+
+        drop_cache(f, mark, size, 1);
+
+        if (entry -> has_crc32c && (crc != entry -> crc32c)){
+            close(f);
+            ERROR("Checksum of %s does not match: %08x != %08x", entry -> name, crc, entry -> crc32c);
+        }
+
+        if (restore_fd(f, entry, restore) < 0){
+            close(f);
+            return -1;
+        }
+
+        // keep the archived modification time so later extractions can tell the file is current
+        const struct timespec times[2] = {{0, UTIME_OMIT}, {oct2uint(entry -> mtime, 11), 0}};
+        if (futimens(f, times) < 0){
+            const int rc = errno;
+            close(f);
+            ERROR("Unable to set modification time of %s: %s", entry -> name, strerror(rc));
+        }
+        close(f);
+
+        // all of the file's metadata was set through its descriptor
+        return 0;
+    }
+    else if ((entry -> type == CHAR) || (entry -> type == BLOCK)){
+        if (mknod(entry -> name, oct2uint(entry -> mode, 7), (oct2uint(entry -> major, 7) << 20) | oct2uint(entry -> minor, 7)) < 0){
+            EXIST_ERROR("Unable to make device %s: %s", entry -> name, strerror(rc));
+        }
+    }
+    else if (entry -> type == HARDLINK){
+        if (link(entry -> link_name, entry -> name) < 0){
+            EXIST_ERROR("Unable to create hardlink %s: %s", entry -> name, strerror(rc));
+        }
+    }
+    else if (entry -> type == SYMLINK){
+        if (symlink(entry -> link_name, entry -> name) < 0){
+            EXIST_ERROR("Unable to make symlink %s: %s", entry -> name, strerror(rc));
+        }
+    }
+    else if (entry -> type == CHAR){
+        if (mknod(entry -> name, S_IFCHR | (oct2uint(entry -> mode, 7) & 0777), (oct2uint(entry -> major, 7) << 20) | oct2uint(entry -> minor, 7)) < 0){
+            EXIST_ERROR("Unable to create directory %s: %s", entry -> name, strerror(rc));
+        }
+    }
+    else if (entry -> type == BLOCK){
+        if (mknod(entry -> name, S_IFBLK | (oct2uint(entry -> mode, 7) & 0777), (oct2uint(entry -> major, 7) << 20) | oct2uint(entry -> minor, 7)) < 0){
+            EXIST_ERROR("Unable to create directory %s: %s", entry -> name, strerror(rc));
+        }
+    }
+    else if (entry -> type == DIRECTORY){
+        // the owner can write into the directory until its metadata is restored
+        if (recursive_mkdir(entry -> name, (oct2uint(entry -> mode, 7) & 0777) | S_IRWXU, verbosity) < 0){
+            EXIST_ERROR("Unable to create directory %s: %s", entry -> name, strerror(rc));
+        }
+        return restore_add(restore, entry);
+    }
+    else if (entry -> type == FIFO){
+        if (mkfifo(entry -> name, oct2uint(entry -> mode, 7) & 0777) < 0){
+            EXIST_ERROR("Unable to make pipe %s: %s", entry -> name, strerror(rc));
+        }
+    }
+
+    if (entry -> type != HARDLINK){
+        return restore_path(entry, restore);
+    }
+    return 0;
+}
+
+int restore_fd(const int f, struct tar_t * entry, struct restore * restore){
+    if (!restore -> owner){
+        return 0;
+    }
+
+    // changing the owner can clear set-user-ID and set-group-ID, so the mode goes last
+    if (fchown(f, oct2uint(entry -> uid, 7), oct2uint(entry -> gid, 7)) < 0){
+        RC_ERROR("Unable to set owner of %s: %s", entry -> name, strerror(rc));
+    }
+
+    if (fchmod(f, oct2uint(entry -> mode, 7) & 07777) < 0){
+        RC_ERROR("Unable to set mode of %s: %s", entry -> name, strerror(rc));
+    }
+
+    return 0;
+}
+
+int restore_path(struct tar_t * entry, struct restore * restore){
+    if (restore -> owner &&
+        (fchownat(AT_FDCWD, entry -> name, oct2uint(entry -> uid, 7), oct2uint(entry -> gid, 7), AT_SYMLINK_NOFOLLOW) < 0)){
+        RC_ERROR("Unable to set owner of %s: %s", entry -> name, strerror(rc));
+    }
+
+    const struct timespec times[2] = {{0, UTIME_OMIT}, {oct2uint(entry -> mtime, 11), 0}};
+    if (utimensat(AT_FDCWD, entry -> name, times, AT_SYMLINK_NOFOLLOW) < 0){
+        RC_ERROR("Unable to set modification time of %s: %s", entry -> name, strerror(rc));
+    }
+
+    return 0;
+}
+
+int restore_add(struct restore * restore, struct tar_t * entry){
+    if (restore -> count == restore -> size){
+        const size_t size = restore -> size?(restore -> size * 2):64;
+        struct restore_entry * entries = realloc(restore -> entries, size * sizeof(struct restore_entry));
+        if (!entries){
+            ERROR("Unable to allocate memory");
+        }
+        restore -> entries = entries;
+        restore -> size = size;
+    }
+
+    struct restore_entry * queued = &restore -> entries[restore -> count];
+    memset(queued, 0, sizeof(*queued));
+    strncpy(queued -> name, entry -> name, sizeof(queued -> name) - 1);
+    queued -> uid = oct2uint(entry -> uid, 7);
+    queued -> gid = oct2uint(entry -> gid, 7);
+    queued -> mtime = oct2uint(entry -> mtime, 11);
+    queued -> mode = oct2uint(entry -> mode, 7) & 07777;
+
+    // without ownership, modes are limited by the umask the directory was created with (group and other bits)
+    if (!restore -> owner){
+        struct stat st;
+        if (stat(queued -> name, &st) < 0){
+            RC_ERROR("Unable to stat %s: %s", queued -> name, strerror(rc));
+        }
+        queued -> mode &= (st.st_mode & 0777) | S_IRWXU;
+    }
+
+    size_t len = strlen(queued -> name);
+    while (len && (queued -> name[len - 1] == '/')){
+        len--;
+    }
+    for(size_t i = 0; i < len; i++){
+        queued -> depth += queued -> name[i] == '/';
+    }
+
+    restore -> count++;
+    return 0;
+}
+
+// deepest directories first, so a parent is closed off after its children
+static int compare_depth(const void * lhs, const void * rhs){
+    const struct restore_entry * l = lhs;
+    const struct restore_entry * r = rhs;
+    if (l -> depth != r -> depth){
+        return (l -> depth > r -> depth)?-1:1;
+    }
+    return strcmp(l -> name, r -> name);
+}
+
+int restore_apply(struct restore * restore){
+    qsort(restore -> entries, restore -> count, sizeof(struct restore_entry), compare_depth);
+
+    int ret = 0;
+    for(size_t i = 0; i < restore -> count; i++){
+        struct restore_entry * queued = &restore -> entries[i];
+        const int dir = open(queued -> name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (dir < 0){
+            const int rc = errno;
+            report("Unable to open directory %s: %s", queued -> name, strerror(rc));
+            ret = -1;
+            continue;
+        }
+
+        const struct timespec times[2] = {{0, UTIME_OMIT}, {queued -> mtime, 0}};
+        if ((restore -> owner && (fchown(dir, queued -> uid, queued -> gid) < 0)) ||
+            (fchmod(dir, queued -> mode) < 0) ||
+            (futimens(dir, times) < 0)){
+            const int rc = errno;
+            report("Unable to restore metadata of %s: %s", queued -> name, strerror(rc));
+            ret = -1;
+        }
+        close(dir);
+    }
+
+    free(restore -> entries);
+    restore -> entries = NULL;
+    restore -> count = restore -> size = 0;
+    return ret;
+}
+
+int write_entries(struct tar_sink * sink, struct tar_t ** archive, struct tar_t ** head, const size_t filecount, const char * files[], int * offset, const char verbosity){
+    if (!sink || !sink -> write){
+        ERROR("Bad sink");
+    }
+
+    if (!archive || *archive){
+        ERROR("Bad archive");
+    }
+
+    if (filecount && !files){
+        ERROR("Non-zero file count provided, but file list is NULL");
+    }
+
+    // build all headers first so that offsets and hard links are known
+    const int start = *offset;
+    if (collect_entries(archive, head, filecount, files, offset, verbosity) < 0){
+        return -1;
+    }
+
+    if (current() -> options.dedup){
+        *offset = start;
+        if (dedup_entries(archive, offset, verbosity) < 0){
+            WRITE_ERROR("Failed to find duplicate files");
+        }
+    }
+
+    // then write headers and data
+    unsigned long long entries = 0;
+    for(struct tar_t * entry = *archive; entry; entry = entry -> next){
+        entries += entry -> type != EXTENDED;
+    }
+    progress_begin(*offset - start, entries);
+
+    int ret = 0;
+    if (current() -> options.readers){
+        ret = write_entries_pipelined(sink, *archive, verbosity);
+    }
+    else{
+        off_t mark = (*archive)?(*archive) -> begin:0;
+        struct tar_t * prev = NULL;
+        for(struct tar_t * entry = *archive; entry; prev = entry, entry = entry -> next){
+            if (write_cancelled(sink, entry, prev)){
+                ret = -1;
+                break;
+            }
+
+            progress_add(0, 0, entry -> name);
+            if (write_entry(sink, entry, verbosity) < 0){
+                report("Failed to write %s", entry -> original_name);
+                ret = -1;
+                break;
+            }
+            progress_add(0, entry -> type != EXTENDED, NULL);
+
+            if (sink -> fd >= 0){
+                drop_behind(sink -> fd, &mark, entry -> begin + entry_span(entry), 1);
+            }
+        }
+    }
+
+    progress_end();
+
+    // a cancel keeps its own message
+    if ((ret < 0) && !progress_cancelled()){
+        WRITE_ERROR("Failed to write entries");
+    }
+
+    return ret;
+}
+
+static int compare_dedup(const void * a, const void * b){
+    const struct dedup * x = a;
+    const struct dedup * y = b;
+    if (x -> size != y -> size){
+        return (x -> size < y -> size)?-1:1;
+    }
+    return (x -> index < y -> index)?-1:(x -> index > y -> index);
+}
+
+static int compare_hashed(const void * a, const void * b){
+    const struct dedup * x = a;
+    const struct dedup * y = b;
+    if (x -> state != y -> state){
+        return (x -> state < y -> state)?-1:1;
+    }
+    if (x -> crc != y -> crc){
+        return (x -> crc < y -> crc)?-1:1;
+    }
+    return (x -> index < y -> index)?-1:(x -> index > y -> index);
+}
+
+int dedup_entries(struct tar_t ** archive, int * offset, const char verbosity){
+    size_t count = 0;
+    for(struct tar_t * entry = *archive; entry; entry = entry -> next){
+        count += has_data(entry) && entry -> original_name[0] && oct2uint(entry -> size, 11);
+    }
+
+    struct dedup * files = calloc(count + 1, sizeof(struct dedup));
+    if (!files){
+        ERROR("Unable to allocate memory");
+    }
+
+    count = 0;
+    size_t index = 0;
+    for(struct tar_t * entry = *archive; entry; entry = entry -> next, index++){
+        const unsigned int size = oct2uint(entry -> size, 11);
+        if (has_data(entry) && entry -> original_name[0] && size){
+            files[count].entry = entry;
+            files[count].size = size;
+            files[count].index = index;
+            count++;
+        }
+    }
+
+    // only files of the same size can match; those are hashed, and matching hashes are confirmed by comparing data
+    qsort(files, count, sizeof(struct dedup), compare_dedup);
+    for(size_t i = 0; i < count;){
+        size_t end = i + 1;
+        while ((end < count) && (files[end].size == files[i].size)){
+            end++;
+        }
+
+        if (end - i > 1){
+            for(size_t j = i; j < end; j++){
+                files[j].state = (file_crc32c(files[j].entry -> original_name, files[j].size, &files[j].crc) < 0)?-1:1;
+            }
+            qsort(files + i, end - i, sizeof(struct dedup), compare_hashed);
+
+            for(size_t j = i + 1; j < end; j++){
+                for(size_t k = j; (k-- > i) && (files[k].state == files[j].state) && (files[k].crc == files[j].crc);){
+                    if ((files[j].state > 0) && !files[k].same && same_metadata(files[k].entry, files[j].entry) &&
+                        (same_data(files[k].entry -> original_name, files[j].entry -> original_name, files[j].size) == 1)){
+                        files[j].same = files[k].entry;
+                        break;
+                    }
+                }
+            }
+        }
+
+        i = end;
+    }
+
+    for(size_t i = 0; i < count; i++){
+        struct tar_t * entry = files[i].entry;
+        if (!files[i].same){
+            continue;
+        }
+
+        V_PRINT(stdout, "%s has the same data as %s", entry -> name, files[i].same -> name);
+        entry -> type = HARDLINK;
+        strncpy(entry -> link_name, files[i].same -> name, sizeof(entry -> link_name));
+        memset(entry -> size, '0', sizeof(entry -> size) - 1);
+        entry -> has_crc32c = 0;
+        calculate_checksum(entry);
+    }
+    free(files);
+
+    // drop checksum headers of entries that lost their data and move everything after them
+    struct tar_t ** tar = archive;
+    while (*tar){
+        struct tar_t * entry = *tar;
+        if ((entry -> type == EXTENDED) && entry -> next && (entry -> next -> type == HARDLINK)){
+            *tar = entry -> next;
+            free(entry);
+            continue;
+        }
+
+        entry -> begin = *offset;
+        *offset += entry_span(entry);
+        tar = &entry -> next;
+    }
+
+    return 0;
+}
+
+int same_metadata(struct tar_t * a, struct tar_t * b){
+    return !memcmp(a -> mode, b -> mode, sizeof(a -> mode)) &&
+           !memcmp(a -> uid, b -> uid, sizeof(a -> uid)) &&
+           !memcmp(a -> gid, b -> gid, sizeof(a -> gid)) &&
+           !memcmp(a -> mtime, b -> mtime, sizeof(a -> mtime));
+}
+
+int same_data(const char * a, const char * b, const unsigned int size){
+    int ret = -1;
+    char * x = malloc(COPYSIZE);
+    char * y = malloc(COPYSIZE);
+    const int fa = open(a, O_RDONLY);
+    const int fb = open(b, O_RDONLY);
+    if (x && y && (fa >= 0) && (fb >= 0)){
+        ret = 1;
+        for(unsigned int got = 0; (got < size) && (ret == 1); got += COPYSIZE){
+            const int want = MIN(size - got, COPYSIZE);
+            throttle(2 * want);
+            if ((read_size(fa, x, want) != want) || (read_size(fb, y, want) != want) || memcmp(x, y, want)){
+                ret = 0;
+            }
+        }
+    }
+
+    free(x);
+    free(y);
+    if (fa >= 0){
+        close(fa);
+    }
+    if (fb >= 0){
+        close(fb);
+    }
+    return ret;
+}
+
+int write_end_data(struct tar_sink * sink, int size, const char verbosity){
+    static const char zeros[RECORDSIZE] = {0};
+
+    if (!sink || !sink -> write){
+        return -1;
+    }
+
+    // complete current record
+    const int pad = RECORDSIZE - (size % RECORDSIZE);
+    if (sink_write(sink, zeros, pad) != pad){
+        report("Unable to close tar file");
+        return -1;
+    }
+
+    // if the current record does not have 2 blocks of zeros, add a whole other record
+    if (pad < (2 * BLOCKSIZE)){
+        if (sink_write(sink, zeros, RECORDSIZE) != RECORDSIZE){
+            report("Unable to close tar file");
+            return -1;
+        }
+        return pad + RECORDSIZE;
+    }
+
+    return pad;
+}
+
+int check_match(struct tar_t * entry, const struct tar_filter * filter){
+    if (!entry){
+        return -1;
+    }
+
+    if (!filter){
+        return 0;
+    }
+
+    return tar_filter_match(filter, entry -> name);
+}
+
+int filter_add(struct filter_node * root, const char * pattern, const size_t index){
+    struct filter_pattern * entry = calloc(1, sizeof(struct filter_pattern));
+    if (!entry){
+        return -1;
+    }
+
+    // only the part before the first wildcard goes into the tree
+    const size_t prefix = strcspn(pattern, "*?[\\");
+    entry -> glob = pattern[prefix]?pattern:NULL;
+    entry -> index = index;
+
+    struct filter_node * node = root;
+    for(size_t i = 0; i < prefix; i++){
+        struct filter_node ** child = &node -> child;
+        while (*child && ((*child) -> c != pattern[i])){
+            child = &(*child) -> sibling;
+        }
+
+        if (!*child){
+            if (!(*child = calloc(1, sizeof(struct filter_node)))){
+                free(entry);
+                return -1;
+            }
+            (*child) -> c = pattern[i];
+        }
+        node = *child;
+    }
+
+    // keep patterns in the order they were given
+    struct filter_pattern ** last = &node -> patterns;
+    while (*last){
+        last = &(*last) -> next;
+    }
+    *last = entry;
+
+    return 0;
+}
+
+size_t filter_match(const struct filter_node * root, const char * name, char * seen){
+    size_t found = 0;
+    const struct filter_node * node = root;
+    for(size_t i = 0; node; i++){
+        for(const struct filter_pattern * pattern = node -> patterns; pattern; pattern = pattern -> next){
+            // a literal matches the name itself or a directory above it
+            const int match = pattern -> glob?!fnmatch(pattern -> glob, name, FNM_LEADING_DIR):(!name[i] || (name[i] == '/'));
+            if (match){
+                if (!seen){
+                    return pattern -> index + 1;
+                }
+
+                seen[pattern -> index] = 1;
+                if (!found){
+                    found = pattern -> index + 1;
+                }
+            }
+        }
+
+        if (!name[i]){
+            break;
+        }
+
+        for(node = node -> child; node && (node -> c != name[i]); node = node -> sibling);
+    }
+
+    return found;
+}
+
+void filter_free(struct filter_node * node){
+    while (node){
+        while (node -> patterns){
+            struct filter_pattern * next = node -> patterns -> next;
+            free(node -> patterns);
+            node -> patterns = next;
+        }
+
+        filter_free(node -> child);
+
+        struct filter_node * sibling = node -> sibling;
+        free(node);
+        node = sibling;
+    }
+}
+
+int unchanged(const int fd, struct tar_t * entry){
+    struct stat st;
+    if ((lstat(entry -> name, &st) < 0) || !S_ISREG(st.st_mode)){
+        return 0;
+    }
+
+    const unsigned int size = oct2uint(entry -> size, 11);
+    if (st.st_size != size){
+        return 0;
+    }
+
+    if ((current() -> options.skip & TAR_SKIP_STAT) && (st.st_mtime != oct2uint(entry -> mtime, 11))){
+        return 0;
+    }
+
+    if (!(current() -> options.skip & TAR_SKIP_CONTENT)){
+        return 1;
+    }
+
+    uint32_t have = 0;
+    if (file_crc32c(entry -> name, size, &have) < 0){
+        return 0;
+    }
+
+    if (entry -> has_crc32c){
+        return have == entry -> crc32c;
+    }
+
+    // no stored checksum, so hash the archived data as well
+    char * buf = malloc(COPYSIZE);
+    if (!buf){
+        return 0;
+    }
+
+    uint32_t want = 0;
+    unsigned int got = 0;
+    while (got < size){
+        const int len = MIN(size - got, COPYSIZE);
+        if (pread(fd, buf, len, entry -> begin + 512 + got) != len){
+            break;
+        }
+        want = crc32c(want, buf, len);
+        got += len;
+    }
+    free(buf);
+
+    return (got == size) && (have == want);
+}
+
+const char * scan_block(struct scanner * scan){
+    if ((scan -> len - scan -> pos) < BLOCKSIZE){
+        // keep the partial block, then read up to the next aligned offset past the read-ahead
+        const size_t left = scan -> len - scan -> pos;
+        memmove(scan -> buf, scan -> buf + scan -> pos, left);
+        scan -> len = left;
+        scan -> pos = 0;
+
+        const size_t want = scan -> chunk - (scan -> at % SCAN_ALIGN);
+        const int got = scan -> pipe?read_size(scan -> fd, scan -> buf + scan -> len, want):pread_size(scan -> fd, scan -> buf + scan -> len, want, scan -> at);
+        if (got > 0){
+            scan -> len += got;
+            scan -> at += got;
+        }
+        else if (got < 0){
+            scan -> error = errno;
+        }
+
+        // headers keep coming, so read further ahead next time
+        scan -> chunk = MIN(scan -> chunk * 2, SCAN_MAX);
+
+        if (scan -> len < BLOCKSIZE){
+            return NULL;
+        }
+    }
+
+    const char * block = scan -> buf + scan -> pos;
+    scan -> pos += BLOCKSIZE;
+    return block;
+}
+
+int scan_read(struct scanner * scan, char * buf, const size_t size){
+    size_t got = 0;
+    while (got < size){
+        const char * block = scan_block(scan);
+        if (!block){
+            return -1;
+        }
+
+        const size_t len = MIN(size - got, BLOCKSIZE);
+        memcpy(buf + got, block, len);
+        got += len;
+    }
+
+    return 0;
+}
+
+int scan_skip(struct scanner * scan, const size_t size){
+    if (size <= (scan -> len - scan -> pos)){
+        scan -> pos += size;
+        return 0;
+    }
+
+    // data is bigger than what was read ahead, so jump past it and start over with less read-ahead
+    size_t left = size - (scan -> len - scan -> pos);
+    scan -> len = 0;
+    scan -> pos = 0;
+    scan -> chunk = SCAN_MIN;
+    if (!scan -> pipe){
+        scan -> at += left;
+        return 0;
+    }
+
+    // pipes can only be read through
+    while (left){
+        const int got = read_size(scan -> fd, scan -> buf, MIN(left, SCAN_MAX));
+        if (got <= 0){
+            return -1;
+        }
+        scan -> at += got;
+        left -= got;
+    }
+    return 0;
+}
+
+const char * member_name(const char * filename){
+    if (!strncmp(filename, "/", 1)){
+        return filename + 1;
+    }
+    else if (!strncmp(filename, "./", 2)){
+        return filename + 2;
+    }
+    else if (!strncmp(filename, "../", 3)){
+        return filename + 3;
+    }
+    return filename;
+}
+
+struct tar_t * latest(struct tar_t * archive, const char * name){
+    const size_t len = strlen(name);
+    struct tar_t * found = NULL;
+    for(; archive; archive = archive -> next){
+        if ((archive -> type != EXTENDED) &&
+            !strncmp(archive -> name, name, len) &&
+            (!archive -> name[len] || ((archive -> name[len] == '/') && !archive -> name[len + 1]))){
+            found = archive;
+        }
+    }
+    return found;
+}
+
+int replace_entry(const int fd, struct tar_t * entry, const char * filename, const char verbosity){
+    if (!has_data(entry)){
+        return 0;
+    }
+
+    struct tar_t fresh;
+    if (format_tar_data(&fresh, filename, verbosity) < 0){
+        return -1;
+    }
+
+    // the last member can grow into the end of the archive;
+    // any other member must leave room that can be covered by a filler header
+    const unsigned int have = entry_span(entry);
+    const unsigned int need = entry_span(&fresh);
+    const int last = !entry -> next;
+    if (!has_data(&fresh) || (!last && (need > have))){
+        return 0;
+    }
+
+    // the checksum record in front of the entry is rewritten too
+    fresh.begin = entry -> begin;
+    fresh.has_crc32c = entry -> has_crc32c;
+
+    V_PRINT(stdout, "Replacing %s in place", entry -> name);
+
+    struct position pos;
+    struct tar_sink sink;
+    position_sink(&sink, &pos, fd, entry -> begin);
+    if (write_entry(&sink, &fresh, verbosity) < 0){
+        ERROR("Could not replace %s", entry -> name);
+    }
+
+    if (last){
+        const off_t end = pos.offset;
+        if ((write_end_data(&sink, end, verbosity) < 0) || (ftruncate(fd, pos.offset) < 0)){
+            ERROR("Could not close file");
+        }
+    }
+    else if ((need < have) && (write_filler(&sink, (have - need) / BLOCKSIZE) < 0)){
+        ERROR("Could not fill space left by %s", entry -> name);
+    }
+
+    memcpy(entry -> block, fresh.block, sizeof(entry -> block));
+    entry -> crc32c = fresh.crc32c;
+    return 1;
+}
+
+int write_filler(struct tar_sink * sink, const unsigned int blocks){
+    struct tar_t filler;
+    memset(&filler, 0, sizeof(filler));
+
+    // one comment record covers the data blocks
+    const unsigned int size = (blocks - 1) * BLOCKSIZE;
+    strncpy(filler.name, FILLER_NAME, sizeof(filler.name) - 1);
+    snprintf(filler.mode,  sizeof(filler.mode),  "%07o", 0644);
+    snprintf(filler.uid,   sizeof(filler.uid),   "%07o", 0);
+    snprintf(filler.gid,   sizeof(filler.gid),   "%07o", 0);
+    snprintf(filler.size,  sizeof(filler.size),  "%011o", size);
+    snprintf(filler.mtime, sizeof(filler.mtime), "%011o", 0);
+    filler.type = EXTENDED;
+    memcpy(filler.ustar, "ustar\x00" "00", 8);
+    calculate_checksum(&filler);
+
+    if (sink_write(sink, filler.block, 512) != 512){
+        return -1;
+    }
+
+    char block[512];
+    for(unsigned int i = 0; i < size; i += BLOCKSIZE){
+        memset(block, ' ', sizeof(block));
+        if (!i){
+            const int len = snprintf(block, sizeof(block), "%u comment=", size);
+            block[len] = ' ';
+        }
+        if (i + BLOCKSIZE == size){
+            block[BLOCKSIZE - 1] = '\n';
+        }
+
+        if (sink_write(sink, block, 512) != 512){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int move_data(const int fd, const off_t from, const off_t to, const size_t size){
+    size_t moved = 0;
+
+    // copies in the kernel cannot overlap, so each one is at most as long as the distance moved
+    #ifdef __linux__
+    const size_t step = MIN((size_t) (from - to), (size_t) 1 << 30);
+    while ((moved < size) && (step >= COPYSIZE)){
+        loff_t in = from + moved;
+        loff_t out = to + moved;
+        const ssize_t rc = copy_file_range(fd, &in, fd, &out, MIN(size - moved, step), 0);
+        if (rc <= 0){
+            break;
+        }
+        moved += rc;
+    }
+    #endif
+
+    if (moved == size){
+        return 0;
+    }
+
+    char * buf = malloc(COPYSIZE);
+    if (!buf){
+        return -1;
+    }
+
+    // reading each chunk before writing it keeps forward copies correct even when they overlap
+    while (moved < size){
+        const int len = MIN(size - moved, COPYSIZE);
+        if ((pread_size(fd, buf, len, from + moved) != len) ||
+            (pwrite_size(fd, buf, len, to + moved) != len)){
+            free(buf);
+            return -1;
+        }
+        moved += len;
+    }
+
+    free(buf);
+    return 0;
+}
+
+int journal_open(struct journal * journal, const char op, const int sync){
+    const struct tar_options * options = &current() -> options;
+
+    memset(journal, 0, sizeof(*journal));
+    journal -> op = op;
+    journal -> sync = sync;
+
+    if ((journal -> fd = open(options -> journal, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0){
+        RC_ERROR("Unable to open journal %s: %s", options -> journal, strerror(rc));
+    }
+
+    // a journal left behind is either continued or thrown away
+    if (!options -> resume){
+        if (ftruncate(journal -> fd, 0) < 0){
+            const int rc = errno;
+            journal_close(journal, 0);
+            ERROR("Unable to clear journal %s: %s", options -> journal, strerror(rc));
+        }
+        return 0;
+    }
+
+    char record[256];
+    const int len = pread(journal -> fd, record, sizeof(record) - 1, 0);
+    if (len <= 0){
+        return 0;
+    }
+    record[len] = '\0';
+
+    // crc op offset count name
+    unsigned int crc = 0;
+    char recorded = 0;
+    long long offset = 0;
+    int name = 0;
+    if ((sscanf(record, "%8x %c %lld %zu %n", &crc, &recorded, &offset, &journal -> count, &name) != 4) ||
+        (record[len - 1] != '\n') || (crc != crc32c(0, record + 9, len - 9))){
+        journal_close(journal, 0);
+        ERROR("Journal %s is damaged", options -> journal);
+    }
+
+    if (recorded != op){
+        journal_close(journal, 0);
+        ERROR("Journal %s belongs to a different operation", options -> journal);
+    }
+
+    journal -> offset = journal -> last = offset;
+    strncpy(journal -> name, record + name, MIN(len - 1 - name, (int) sizeof(journal -> name)));
+    return 0;
+}
+
+int journal_matches(struct journal * journal, struct tar_t * last){
+    if (!last || strncmp(last -> name, journal -> name, sizeof(journal -> name)) ||
+        ((off_t) (last -> begin + entry_span(last)) != journal -> offset)){
+        ERROR("Archive does not match journal %s", current() -> options.journal);
+    }
+
+    return 0;
+}
+
+int journal_checkpoint(struct journal * journal, struct tar_t * entry, const int force){
+    journal -> count++;
+    journal -> offset = entry -> begin + entry_span(entry);
+    memcpy(journal -> name, entry -> name, sizeof(journal -> name));
+
+    if (!force && ((size_t) (journal -> offset - journal -> last) < current() -> options.checkpoint)){
+        return 0;
+    }
+
+    // work has to be on disk before the record saying it is
+    int rc = 0;
+    if (journal -> op == 'c'){
+        rc = fdatasync(journal -> sync);
+    }
+    else{
+        #ifdef __linux__
+        rc = syncfs(journal -> sync);
+        #else
+        sync();
+        #endif
+    }
+
+    if (rc < 0){
+        RC_ERROR("Unable to flush data before checkpoint: %s", strerror(rc));
+    }
+
+    char record[256];
+    const int len = snprintf(record, sizeof(record), "%08x %c %lld %zu %.*s\n", 0, journal -> op, (long long) journal -> offset, journal -> count, (int) sizeof(journal -> name), journal -> name);
+    char crc[9];
+    snprintf(crc, sizeof(crc), "%08x", crc32c(0, record + 9, len - 9));
+    memcpy(record, crc, 8);
+
+    if ((pwrite_size(journal -> fd, record, len, 0) != len) ||
+        (ftruncate(journal -> fd, len) < 0) ||
+        (fdatasync(journal -> fd) < 0)){
+        RC_ERROR("Unable to write journal %s: %s", current() -> options.journal, strerror(rc));
+    }
+
+    journal -> last = journal -> offset;
+    return 0;
+}
+
+void journal_close(struct journal * journal, const int done){
+    if (journal -> fd < 0){
+        return;
+    }
+
+    close(journal -> fd);
+    journal -> fd = -1;
+    if (journal -> op == 'x'){
+        close(journal -> sync);
+    }
+
+    if (done){
+        unlink(current() -> options.journal);
+    }
+}
+
+int write_checkpointed(struct tar_sink * sink, struct tar_t * entry, const char verbosity){
+    if ((sink -> fd < 0) || !sink -> seek){
+        ERROR("Checkpoints need a sink that is a file");
+    }
+
+    struct journal journal;
+    if (journal_open(&journal, 'c', sink -> fd) < 0){
+        return -1;
+    }
+
+    // skip members the journal says were written, dropping whatever came after them
+    if (journal.count){
+        struct tar_t * last = NULL;
+        for(size_t i = 0; entry && (i < journal.count); i++){
+            last = entry;
+            entry = entry -> next;
+        }
+
+        char block[512];
+        if ((journal_matches(&journal, last) < 0) ||
+            (pread_size(sink -> fd, block, 512, last -> begin) != 512) ||
+            strncmp(block, last -> name, sizeof(last -> name))){
+            journal_close(&journal, 0);
+            ERROR("Archive does not match journal %s", current() -> options.journal);
+        }
+
+        if ((ftruncate(sink -> fd, journal.offset) < 0) ||
+            (sink -> seek(sink -> data, journal.offset) != journal.offset)){
+            const int rc = errno;
+            journal_close(&journal, 0);
+            ERROR("Unable to resume at %lld: %s", (long long) journal.offset, strerror(rc));
+        }
+
+        V_PRINT(stdout, "Resuming after %s", journal.name);
+    }
+
+    unsigned long long entries = 0, bytes = 0;
+    for(struct tar_t * e = entry; e; e = e -> next){
+        entries += e -> type != EXTENDED;
+        bytes += entry_span(e);
+    }
+    progress_begin(bytes, entries);
+
+    off_t mark = entry?entry -> begin:0;
+    struct tar_t * last = NULL;
+    for(; entry; entry = entry -> next){
+        // the journal keeps what was written, so a cancelled archive can still be resumed
+        if (write_cancelled(sink, entry, last)){
+            progress_end();
+            journal_close(&journal, 0);
+            return -1;
+        }
+
+        progress_add(0, 0, entry -> name);
+        if ((write_entry(sink, entry, verbosity) < 0) ||
+            (journal_checkpoint(&journal, entry, 0) < 0)){
+            progress_end();
+            journal_close(&journal, 0);
+            ERROR("Failed to write %s", entry -> original_name);
+        }
+        progress_add(0, entry -> type != EXTENDED, NULL);
+        drop_behind(sink -> fd, &mark, entry -> begin + entry_span(entry), 1);
+        last = entry;
+    }
+    progress_end();
+
+    // the end data is all that is left
+    if (last && (journal.last != journal.offset)){
+        journal.count--;
+        if (journal_checkpoint(&journal, last, 1) < 0){
+            journal_close(&journal, 0);
+            return -1;
+        }
+    }
+
+    journal_close(&journal, 0);
+    return 0;
+}
+
+int copy_range(const int fd, const off_t from, struct tar_sink * sink, const off_t to, const size_t size){
+    size_t copied = 0;
+
+    // offsets are given explicitly, so the sink is moved past the copy afterwards
+    #ifdef __linux__
+    if ((sink -> fd >= 0) && sink -> seek){
+        while (copied < size){
+            loff_t in = from + copied;
+            loff_t out = to + copied;
+            const size_t want = MIN(size - copied, THROTTLE_CHUNK);
+            throttle(want);
+            const ssize_t rc = copy_file_range(fd, &in, sink -> fd, &out, want, 0);
+            if (rc <= 0){
+                break;
+            }
+            copied += rc;
+        }
+
+        if (copied && (sink -> seek(sink -> data, to + copied) != (off_t) (to + copied))){
+            return -1;
+        }
+    }
+    #endif
+
+    if (copied == size){
+        return 0;
+    }
+
+    char * buf = malloc(COPYSIZE);
+    if (!buf){
+        return -1;
+    }
+
+    while (copied < size){
+        const int len = MIN(size - copied, COPYSIZE);
+        if ((pread_size(fd, buf, len, from + copied) != len) ||
+            (sink_write(sink, buf, len) != len)){
+            free(buf);
+            return -1;
+        }
+        copied += len;
+    }
+
+    free(buf);
+    return 0;
+}
+
+int read_size(int fd, char * buf, int size){
+    int got = 0, rc;
+    while ((got < size) && ((rc = read(fd, buf + got, size - got)) > 0)){
+        got += rc;
+    }
+    return got;
+}
+
+int write_size(int fd, char * buf, int size){
+    int wrote = 0, rc;
+    while ((wrote < size) && ((rc = write(fd, buf + wrote, size - wrote)) > 0)){
+        wrote += rc;
+    }
+    return wrote;
+}
+
+int pread_size(int fd, char * buf, int size, off_t offset){
+    int got = 0, rc;
+    while ((got < size) && ((rc = pread(fd, buf + got, size - got, offset + got)) > 0)){
+        got += rc;
+    }
+    return got;
+}
+
+int pwrite_size(int fd, const char * buf, int size, off_t offset){
+    int wrote = 0, rc;
+    while ((wrote < size) && ((rc = pwrite(fd, buf + wrote, size - wrote, offset + wrote)) > 0)){
+        wrote += rc;
+    }
+    return wrote;
+}
+
+unsigned int oct2uint(char * oct, unsigned int size){
+    unsigned int out = 0;
+    int i = 0;
+    while ((i < size) && oct[i]){
+        out = (out << 3) | (unsigned int) (oct[i++] - '0');
+    }
+    return out;
+}
+
+int iszeroed(char * buf, size_t size){
+    for(size_t i = 0; i < size; buf++, i++){
+        if (* (char *) buf){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int recursive_mkdir(const char * dir, const unsigned int mode, const char verbosity){
+    int rc = 0;
+    const size_t len = strlen(dir);
+
+    if (!len){
+        return 0;
+    }
+
+    char * path = calloc(len + 1, sizeof(char));
+    memcpy(path, dir, len);
+
+    // remove last '/'
+    if (path[len - 1] ==  '/'){
+       path[len - 1] = 0;
+    }
+
+    // all subsequent directories do not exist
+    for(char * p = path + 1; *p; p++){
+        if (*p == '/'){
+            *p = '\0';
+
+            if ((rc = mkdir(path, mode?mode:DEFAULT_DIR_MODE))){
+                EXIST_ERROR("Could not create directory %s: %s", path, strerror(rc));
+            }
+
+            *p = '/';
+        }
+    }
+
+    if (mkdir(path, mode?mode:DEFAULT_DIR_MODE) < 0){
+        EXIST_ERROR("Could not create directory %s: %s", path, strerror(rc));
+    }
+
+    free(path);
+    return 0;
+}
+
+int has_data(struct tar_t * entry){
+    return (entry -> type == REGULAR) || (entry -> type == NORMAL) || (entry -> type == CONTIGUOUS);
+}
+
+unsigned int entry_span(struct tar_t * entry){
+    const unsigned int size = oct2uint(entry -> size, 11);
+    return 512 + size + (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE;
+}
+
+int begin_append(struct tar_sink * sink, struct tar_t ** archive, struct tar_t *** tail, int * offset, const char verbosity){
+    if (!sink || !sink -> write){
+        ERROR("Bad sink");
+    }
+
+    if (!archive){
+        ERROR("Bad archive");
+    }
+
+    // where sink offset is
+    *offset = 0;
+
+    if (sink -> fd >= 0){
+        advise_sequential(sink -> fd);
+    }
+
+    // if there is old data
+    struct tar_t ** tar = archive;
+    if (*tar){
+        if (!sink -> seek){
+            ERROR("Cannot append to an archive through a sink that cannot seek");
+        }
+
+        // skip to last entry
+        while (*tar && (*tar) -> next){
+            tar = &((*tar) -> next);
+        }
+
+        // move past final entry
+        *offset = (*tar) -> begin + entry_span(*tar);
+        if (sink -> seek(sink -> data, *offset) == (off_t) (-1)){
+            RC_ERROR("Unable to seek file: %s", strerror(rc));
+        }
+        tar = &((*tar) -> next);
+    }
+
+    *tail = tar;
+    return 0;
+}
+
+int end_append(struct tar_sink * sink, struct tar_t ** archive, const int offset, const char verbosity){
+    // write ending data
+    const int end = write_end_data(sink, offset, verbosity);
+    if (end < 0){
+        ERROR("Failed to write end data");
+    }
+
+    if (sink -> fd >= 0){
+        drop_cache(sink -> fd, 0, offset + end, 1);
+    }
+
+    // clear original names from data
+    for(struct tar_t * tar = *archive; tar; tar = tar -> next){
+        memset(tar -> original_name, 0, 100);
+    }
+
+    return offset;
+}
+
+int write_source(struct tar_sink * sink, struct tar_t * entry, const struct tar_source * source, const char verbosity){
+    if (write_header(sink, entry, verbosity) < 0){
+        return -1;
+    }
+
+    if (!has_data(entry)){
+        return 0;
+    }
+
+    uint32_t crc = 0;
+    size_t got = 0;
+    if (source -> producer){
+        char * buf = malloc(COPYSIZE);
+        if (!buf){
+            ERROR("Unable to allocate copy buffer");
+        }
+
+        while (got < source -> size){
+            const ssize_t r = source -> producer(source -> data, buf, MIN(source -> size - got, COPYSIZE));
+            if (r <= 0){
+                free(buf);
+                ERROR("Producer of %s stopped after %zu of %zu octets", entry -> name, got, source -> size);
+            }
+
+            if (sink_write(sink, buf, r) != r){
+                const int rc = errno;
+                free(buf);
+                ERROR("Could not write to archive: %s", strerror(rc));
+            }
+            got += r;
+
+            if (entry -> has_crc32c){
+                crc = crc32c(crc, buf, r);
+            }
+        }
+
+        free(buf);
+    }
+    else if (source -> iov){
+        for(int i = 0; (i < source -> iovcnt) && (got < source -> size); i++){
+            const size_t len = MIN(source -> iov[i].iov_len, source -> size - got);
+            if (sink_write(sink, source -> iov[i].iov_base, len) != len){
+                RC_ERROR("Could not write to archive: %s", strerror(rc));
+            }
+            got += len;
+        }
+    }
+    else if (source -> size){
+        if (!source -> buf){
+            ERROR("No data given for %s", entry -> name);
+        }
+
+        if (sink_write(sink, source -> buf, source -> size) != source -> size){
+            RC_ERROR("Could not write to archive: %s", strerror(rc));
+        }
+        got = source -> size;
+    }
+
+    if (got != source -> size){
+        ERROR("Only %zu of %zu octets given for %s", got, source -> size, entry -> name);
+    }
+
+    // pad data to fill block
+    if (write_padding(sink, source -> size) < 0){
+        ERROR("Could not write padding data");
+    }
+
+    // checksums of data already in memory were written up front
+    return source -> producer?finish_checksum(sink, entry, crc, verbosity):0;
+}
+
+int sink_write(struct tar_sink * sink, const char * buf, const int size){
+    throttle(size);
+
+    int wrote = 0, rc;
+    while ((wrote < size) && ((rc = sink -> write(sink -> data, buf + wrote, size - wrote)) > 0)){
+        wrote += rc;
+    }
+
+    progress_add(wrote, 0, NULL);
+    return wrote;
+}
+
+int write_padding(struct tar_sink * sink, const unsigned int size){
+    static const char zeros[512] = {0};
+    const unsigned int pad = (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE;
+    if (sink_write(sink, zeros, pad) != pad){
+        return -1;
+    }
+    return pad;
+}
+
+int collect_entries(struct tar_t ** archive, struct tar_t ** head, const size_t filecount, const char * files[], int * offset, const char verbosity){
+    struct tar_t ** tar = archive;  // current entry
+    for(unsigned int i = 0; i < filecount; i++){
+        *tar = calloc(1, sizeof(struct tar_t));
+
+        // stat file
+        if (format_tar_data(*tar, files[i], verbosity) < 0){
+            WRITE_ERROR("Failed to stat %s", files[i]);
+        }
+
+        (*tar) -> begin = *offset;
+        *offset += 512;
+
+        // directories need special handling
+        if ((*tar) -> type == DIRECTORY){
+            // save directory path without trailing '/' to build child paths
+            size_t len = strlen(files[i]);
+            while ((len > 1) && (files[i][len - 1] == '/')){
+                len--;
+            }
+            char * parent = calloc(len + 1, sizeof(char));
+            strncpy(parent, files[i], len);
+
+            // add a '/' character to the end
+            const size_t namelen = strlen((*tar) -> name);
+            if (namelen && (namelen < 99) && ((*tar) -> name[namelen - 1] != '/')){
+                (*tar) -> name[namelen] = '/';
+                (*tar) -> name[namelen + 1] = '\0';
+                calculate_checksum(*tar);
+            }
+
+            // go through directory
+            DIR * d = opendir(parent);
+            if (!d){
+                free(parent);
+                WRITE_ERROR("Cannot open directory %s", files[i]);
+            }
+
+            struct child * children = NULL;
+            size_t count = 0;
+            size_t capacity = 0;
+            int rc = 0;
+            struct dirent * dir;
+            while ((dir = readdir(d))){
+                // if not special directories . and ..
+                const size_t sublen = strlen(dir -> d_name);
+                if (strncmp(dir -> d_name, ".", sublen) && strncmp(dir -> d_name, "..", sublen)){
+                    if (count == capacity){
+                        capacity = capacity?(capacity * 2):16;
+                        struct child * grown = realloc(children, capacity * sizeof(struct child));
+                        if (!grown){
+                            rc = -1;
+                            break;
+                        }
+                        children = grown;
+                    }
+
+                    struct child * child = &children[count++];
+                    child -> path = calloc(len + sublen + 2, sizeof(char));
+                    sprintf(child -> path, "%s/%s", parent, dir -> d_name);
+                    child -> ino = dir -> d_ino;
+                    child -> key = 0;
+                }
+            }
+            closedir(d);
+            free(parent);
+
+            // visit files in the order they are laid out on disk (or by name)
+            if (member_order()){
+                for(size_t j = 0; j < count; j++){
+                    locality_key(&children[j]);
+                }
+                qsort(children, count, sizeof(struct child), compare_children);
+            }
+
+            for(size_t j = 0; j < count; j++){
+                // recursively add each subdirectory
+                if (!rc){
+                    rc = collect_entries(&((*tar) -> next), head, 1, (const char **) &children[j].path, offset, verbosity);
+                }
+                free(children[j].path);
+
+                // go to end of new data
+                while ((*tar) -> next){
+                    tar = &((*tar) -> next);
+                }
+            }
+            free(children);
+
+            if (rc < 0){
+                WRITE_ERROR("Recurse error");
+            }
+        }
+        else{
+            if (has_data(*tar) || ((*tar) -> type == SYMLINK)){
+                // if file has already been included, turn this entry into a hard link to it
+                if (exists(*head, files[i], 1) != (*tar)){
+                    (*tar) -> type = HARDLINK;
+
+                    // link name is the same as the name of the tarred file
+                    strncpy((*tar) -> link_name, (*tar) -> name, 100);
+
+                    // change size to 0
+                    memset((*tar) -> size, '0', sizeof((*tar) -> size) - 1);
+
+                    // recalculate checksum
+                    calculate_checksum(*tar);
+                }
+            }
+
+            // data and unfilled block
+            const unsigned int size = oct2uint((*tar) -> size, 11);
+            *offset += size + (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE;
+
+            // put an extended header for the checksum of the data in front of the entry
+            if (current() -> options.checksums && has_data(*tar) && size){
+                struct tar_t * ext = calloc(1, sizeof(struct tar_t));
+                if (!ext){
+                    ERROR("Unable to allocate extended header");
+                }
+
+                format_extended(ext, *tar);
+                ext -> begin = (*tar) -> begin;
+                (*tar) -> begin += entry_span(ext);
+                *offset += entry_span(ext);
+
+                ext -> next = *tar;
+                *tar = ext;
+                tar = &ext -> next;
+            }
+        }
+
+        tar = &((*tar) -> next);
+    }
+
+    return 0;
+}
+
+int write_entry(struct tar_sink * sink, struct tar_t * entry, const char verbosity){
+    // write metadata
+    if (write_header(sink, entry, verbosity) < 0){
+        return -1;
+    }
+
+    if (!has_data(entry)){
+        return 0;
+    }
+
+    // copy exactly as much data as the header says
+    const unsigned int size = oct2uint(entry -> size, 11);
+    int direct = 1;
+    int f = open_data(entry -> original_name, O_RDONLY, 0, &direct);
+    if (f < 0){
+        RC_ERROR("Could not open %s: %s", entry -> original_name, strerror(rc));
+    }
+
+    char * buf = alloc_data(COPYSIZE);
+    if (!buf){
+        close(f);
+        ERROR("Unable to allocate copy buffer");
+    }
+
+    uint32_t crc = 0;
+    unsigned int got = 0;
+    while (got < size){
+        const int want = MIN(size - got, COPYSIZE);
+
+        // direct reads must ask for whole aligned blocks
+        throttle(want);
+        int r = read_size(f, buf, direct?COPYSIZE:want);
+        if (r < want){
+            const int rc = errno;
+            free(buf);
+            close(f);
+
+            // file shrank after it was stat-ed
+            if (r >= 0){
+                ERROR("%s changed size while being archived", entry -> original_name);
+            }
+            ERROR("Could not read %s: %s", entry -> original_name, strerror(rc));
+        }
+        r = want;
+
+        if (entry -> has_crc32c){
+            crc = crc32c(crc, buf, r);
+        }
+
+        if (sink_write(sink, buf, r) != r){
+            const int rc = errno;
+            free(buf);
+            close(f);
+            ERROR("Could not write to archive: %s", strerror(rc));
+        }
+
+        got += r;
+    }
+
+    free(buf);
+    drop_cache(f, 0, size, 0);
+    close(f);
+
+    // pad data to fill block
+    if (write_padding(sink, size) < 0){
+        ERROR("Could not write padding data");
+    }
+
+    return finish_checksum(sink, entry, crc, verbosity);
+}
+
+// one buffer of the prefetch ring
+struct ring_slot {
+    char * buf;
+    size_t len;
+    size_t seq;                     // sequence number of chunk held + 1 (0 = empty)
+    int error;                      // errno of a failed read (-1 = file shrank)
+};
+
+// state shared between reader threads and the writer
+struct ring {
+    struct tar_t ** jobs;           // entries with data, in archive order
+    size_t * first;                 // sequence number of the first chunk of each job
+    size_t count;                   // number of jobs
+    size_t next;                    // next job to hand out
+
+    struct ring_slot * slots;
+    size_t slot_count;
+    size_t slot_size;
+    size_t consumed;                // number of chunks written so far
+
+    int abort;
+    char verbosity;
+    struct tar_ctx * ctx;           // context of the calling thread
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t freed;
+};
+
+// reader thread: claim files in order and read them into the ring
+static void * ring_reader(void * arg){
+    struct ring * ring = arg;
+    tar_ctx_use(ring -> ctx);
+
+    for(;;){
+        pthread_mutex_lock(&ring -> lock);
+        const size_t job = ring -> next++;
+        const int abort = ring -> abort;
+        pthread_mutex_unlock(&ring -> lock);
+
+        if (abort || (job >= ring -> count)){
+            break;
+        }
+
+        struct tar_t * entry = ring -> jobs[job];
+        const unsigned int size = oct2uint(entry -> size, 11);
+        int direct = !(ring -> slot_size % DIRECT_ALIGN);
+        const int f = open_data(entry -> original_name, O_RDONLY, 0, &direct);
+        const int open_error = (f < 0)?errno:0;
+
+        size_t seq = ring -> first[job];
+        for(unsigned int got = 0; got < size; seq++){
+            struct ring_slot * slot = &ring -> slots[seq % ring -> slot_count];
+
+            // wait for the writer to drain the chunk that used this slot last
+            pthread_mutex_lock(&ring -> lock);
+            while (!ring -> abort && (ring -> consumed + ring -> slot_count <= seq)){
+                pthread_cond_wait(&ring -> freed, &ring -> lock);
+            }
+            const int abort = ring -> abort;
+            pthread_mutex_unlock(&ring -> lock);
+
+            if (abort){
+                break;
+            }
+
+            const size_t want = MIN(size - got, ring -> slot_size);
+            int error = open_error;
+            if (!error){
+                // direct reads must ask for whole aligned blocks
+                throttle(want);
+                const int r = read_size(f, slot -> buf, direct?ring -> slot_size:want);
+                if (r < (int) want){
+                    // file shrank after it was stat-ed
+                    error = (r < 0)?errno:-1;
+                }
+            }
+
+            pthread_mutex_lock(&ring -> lock);
+            slot -> len = want;
+            slot -> error = error;
+            slot -> seq = seq + 1;
+            pthread_cond_broadcast(&ring -> filled);
+            pthread_mutex_unlock(&ring -> lock);
+
+            got += want;
+        }
+
+        if (f >= 0){
+            drop_cache(f, 0, size, 0);
+            close(f);
+        }
+    }
+
+    return NULL;
+}
+
+int write_entries_pipelined(struct tar_sink * sink, struct tar_t * archive, const char verbosity){
+    struct ring ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.slot_count = current() -> options.buffers;
+    ring.slot_size = current() -> options.buffer_size;
+    ring.verbosity = verbosity;
+    ring.ctx = current();
+
+    // number every chunk of data in archive order
+    for(struct tar_t * entry = archive; entry; entry = entry -> next){
+        ring.count += has_data(entry);
+    }
+
+    ring.jobs = calloc(ring.count + 1, sizeof(struct tar_t *));
+    ring.first = calloc(ring.count + 1, sizeof(size_t));
+    ring.slots = calloc(ring.slot_count, sizeof(struct ring_slot));
+    if (!ring.jobs || !ring.first || !ring.slots){
+        free(ring.jobs);
+        free(ring.first);
+        free(ring.slots);
+        ERROR("Unable to allocate prefetch ring");
+    }
+
+    size_t seq = 0;
+    size_t job = 0;
+    for(struct tar_t * entry = archive; entry; entry = entry -> next){
+        if (has_data(entry)){
+            const unsigned int size = oct2uint(entry -> size, 11);
+            ring.jobs[job] = entry;
+            ring.first[job++] = seq;
+            seq += (size + ring.slot_size - 1) / ring.slot_size;
         }
+    }
 
-        // move archive pointer to data location
-        if (lseek(fd, 512 + entry -> begin, SEEK_SET) == (off_t) (-1)){
-            RC_ERROR("Bad index: %s", strerror(rc));
+    int ret = 0;
+    size_t started = 0;
+    pthread_t * threads = calloc(current() -> options.readers, sizeof(pthread_t));
+    for(size_t i = 0; i < ring.slot_count; i++){
+        if (!(ring.slots[i].buf = alloc_data(ring.slot_size))){
+            ret = -1;
         }
+    }
 
-        // copy data to file
-        char buf[512];
-        int got = 0;
-        while (got < size){
-            int r;
-            if ((r = read_size(fd, buf, MIN(size - got, 512))) < 0){
-                EXIST_ERROR("Unable to read from archive: %s", strerror(rc));
-            }
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.filled, NULL);
+    pthread_cond_init(&ring.freed, NULL);
 
-            if (write(f, buf, r) != r){
-                EXIST_ERROR("Unable to write to %s: %s", entry -> name, strerror(rc));
+    if (!threads || (ret < 0)){
+        report("Unable to allocate prefetch ring");
+        ret = -1;
+    }
+    else{
+        for(started = 0; started < current() -> options.readers; started++){
+            if (pthread_create(&threads[started], NULL, ring_reader, &ring)){
+                break;
             }
-
-            got += r;
         }
 
-        close(f);
-    }
-    else if ((entry -> type == CHAR) || (entry -> type == BLOCK)){
-        if (mknod(entry -> name, oct2uint(entry -> mode, 7), (oct2uint(entry -> major, 7) << 20) | oct2uint(entry -> minor, 7)) < 0){
-            EXIST_ERROR("Unable to make device %s: %s", entry -> name, strerror(rc));
+        if (!started){
+            report("Unable to start reader threads");
+            ret = -1;
         }
     }
-    else if (entry -> type == HARDLINK){
-        if (link(entry -> link_name, entry -> name) < 0){
-            EXIST_ERROR("Unable to create hardlink %s: %s", entry -> name, strerror(rc));
+
+    // drain the ring in order, interleaving headers and padding
+    off_t mark = archive?archive -> begin:0;
+    seq = 0;
+    struct tar_t * prev = NULL;
+    for(struct tar_t * entry = archive; entry && (ret == 0); prev = entry, entry = entry -> next){
+        if (write_cancelled(sink, entry, prev)){
+            ret = -1;
+            break;
         }
-    }
-    else if (entry -> type == SYMLINK){
-        if (symlink(entry -> link_name, entry -> name) < 0){
-            EXIST_ERROR("Unable to make symlink %s: %s", entry -> name, strerror(rc));
+
+        progress_add(0, entry -> type != EXTENDED, entry -> name);
+        if (write_header(sink, entry, verbosity) < 0){
+            ret = -1;
+            break;
         }
-    }
-    else if (entry -> type == CHAR){
-        if (mknod(entry -> name, S_IFCHR | (oct2uint(entry -> mode, 7) & 0777), (oct2uint(entry -> major, 7) << 20) | oct2uint(entry -> minor, 7)) < 0){
-            EXIST_ERROR("Unable to create directory %s: %s", entry -> name, strerror(rc));
+
+        if (!has_data(entry)){
+            continue;
         }
-    }
-    else if (entry -> type == BLOCK){
-        if (mknod(entry -> name, S_IFBLK | (oct2uint(entry -> mode, 7) & 0777), (oct2uint(entry -> major, 7) << 20) | oct2uint(entry -> minor, 7)) < 0){
-            EXIST_ERROR("Unable to create directory %s: %s", entry -> name, strerror(rc));
+
+        uint32_t crc = 0;
+        const unsigned int size = oct2uint(entry -> size, 11);
+        for(unsigned int got = 0; got < size; seq++){
+            struct ring_slot * slot = &ring.slots[seq % ring.slot_count];
+
+            pthread_mutex_lock(&ring.lock);
+            while (slot -> seq != seq + 1){
+                pthread_cond_wait(&ring.filled, &ring.lock);
+            }
+            pthread_mutex_unlock(&ring.lock);
+
+            if (slot -> error < 0){
+                report("%s changed size while being archived", entry -> original_name);
+                ret = -1;
+                break;
+            }
+            else if (slot -> error){
+                report("Could not read %s: %s", entry -> original_name, strerror(slot -> error));
+                ret = -1;
+                break;
+            }
+
+            if (sink_write(sink, slot -> buf, slot -> len) != slot -> len){
+                report("Could not write to archive: %s", strerror(errno));
+                ret = -1;
+                break;
+            }
+            got += slot -> len;
+
+            if (entry -> has_crc32c){
+                crc = crc32c(crc, slot -> buf, slot -> len);
+            }
+
+            pthread_mutex_lock(&ring.lock);
+            ring.consumed = seq + 1;
+            pthread_cond_broadcast(&ring.freed);
+            pthread_mutex_unlock(&ring.lock);
         }
-    }
-    else if (entry -> type == DIRECTORY){
-        if (recursive_mkdir(entry -> name, oct2uint(entry -> mode, 7) & 0777, verbosity) < 0){
-            EXIST_ERROR("Unable to create directory %s: %s", entry -> name, strerror(rc));
+
+        if ((ret == 0) && (write_padding(sink, size) < 0)){
+            report("Could not write padding data");
+            ret = -1;
         }
-    }
-    else if (entry -> type == FIFO){
-        if (mkfifo(entry -> name, oct2uint(entry -> mode, 7) & 0777) < 0){
-            EXIST_ERROR("Unable to make pipe %s: %s", entry -> name, strerror(rc));
+
+        if ((ret == 0) && (finish_checksum(sink, entry, crc, verbosity) < 0)){
+            ret = -1;
         }
-    }
-    return 0;
-}
 
-int write_entries(const int fd, struct tar_t ** archive, struct tar_t ** head, const size_t filecount, const char * files[], int * offset, const char verbosity){
-    if (fd < 0){
-        ERROR("Bad file descriptor");
+        if (sink -> fd >= 0){
+            drop_behind(sink -> fd, &mark, entry -> begin + entry_span(entry), 1);
+        }
     }
 
-    if (!archive || *archive){
-        ERROR("Bad archive");
-    }
+    // stop readers
+    pthread_mutex_lock(&ring.lock);
+    ring.abort = 1;
+    pthread_cond_broadcast(&ring.freed);
+    pthread_mutex_unlock(&ring.lock);
 
-    if (filecount && !files){
-        ERROR("Non-zero file count provided, but file list is NULL");
+    for(size_t i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
     }
 
-    // add new data
-    struct tar_t ** tar = archive;  // current entry
-    for(unsigned int i = 0; i < filecount; i++){
-        *tar = malloc(sizeof(struct tar_t));
+    pthread_cond_destroy(&ring.freed);
+    pthread_cond_destroy(&ring.filled);
+    pthread_mutex_destroy(&ring.lock);
 
-        // stat file
-        if (format_tar_data(*tar, files[i], verbosity) < 0){
-            WRITE_ERROR("Failed to stat %s", files[i]);
-        }
+    for(size_t i = 0; i < ring.slot_count; i++){
+        free(ring.slots[i].buf);
+    }
+    free(ring.slots);
+    free(ring.first);
+    free(ring.jobs);
+    free(threads);
 
-        (*tar) -> begin = *offset;
+    return ret;
+}
 
-        // directories need special handling
-        if ((*tar) -> type == DIRECTORY){
-            // save parent directory name (source will change)
-            const size_t len = strlen((*tar) -> name);
-            char * parent = calloc(len + 1, sizeof(char));
-            strncpy(parent, (*tar) -> name, len);
+int open_data(const char * path, const int flags, const mode_t mode, int * direct){
+    int fd = -1;
 
-            // add a '/' character to the end
-            if ((len < 99) && ((*tar) -> name[len - 1] != '/')){
-                (*tar) -> name[len] = '/';
-                (*tar) -> name[len + 1] = '\0';
-                calculate_checksum(*tar);
-            }
+    #ifdef O_DIRECT
+    if (*direct && (current() -> options.io & TAR_IO_DIRECT)){
+        if ((fd = open(path, flags | O_DIRECT, mode)) >= 0){
+            advise_sequential(fd);
+            return fd;
+        }
+        // file system might not support direct I/O, so try again normally
+    }
+    #endif
 
-            V_PRINT(stdout, "Writing %s", (*tar) -> name);
+    *direct = 0;
+    if ((fd = open(path, flags, mode)) >= 0){
+        advise_sequential(fd);
+    }
+    return fd;
+}
 
-            // write metadata to (*tar) file
-            if (write_size(fd, (*tar) -> block, 512) != 512){
-                WRITE_ERROR("Failed to write metadata to archive");
-            }
+char * alloc_data(const size_t size){
+    void * buf = NULL;
+    const size_t aligned = (size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    if (posix_memalign(&buf, DIRECT_ALIGN, aligned)){
+        return NULL;
+    }
+    return buf;
+}
 
-            // go through directory
-            DIR * d = opendir(parent);
-            if (!d){
-                WRITE_ERROR("Cannot open directory %s", parent);
-            }
+void advise_sequential(const int fd){
+    #ifdef POSIX_FADV_SEQUENTIAL
+    if (current() -> options.io & TAR_IO_FADVISE){
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    #endif
+}
 
-            struct dirent * dir;
-            while ((dir = readdir(d))){
-                // if not special directories . and ..
-                const size_t sublen = strlen(dir -> d_name);
-                if (strncmp(dir -> d_name, ".", sublen) && strncmp(dir -> d_name, "..", sublen)){
-                    char * path = calloc(len + sublen + 2, sizeof(char));
-                    sprintf(path, "%s/%s", parent, dir -> d_name);
+void drop_cache(const int fd, const off_t from, const off_t to, const int dirty){
+    if (!(current() -> options.io & TAR_IO_FADVISE) || (to <= from)){
+        return;
+    }
 
-                    // recursively write each subdirectory
-                    if (write_entries(fd, &((*tar) -> next), head, 1, (const char **) &path, offset, verbosity) < 0){
-                        WRITE_ERROR("Recurse error");
-                    }
+    // dirty pages can only be dropped once they have been written back
+    if (dirty){
+        #ifdef __linux__
+        sync_file_range(fd, from, to - from, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        #else
+        fsync(fd);
+        #endif
+    }
 
-                    // go to end of new data
-                    while ((*tar) -> next){
-                        tar = &((*tar) -> next);
-                    }
+    #ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, from, to - from, POSIX_FADV_DONTNEED);
+    #endif
+}
 
-                    free(path);
-                }
-            }
-            closedir(d);
+void drop_behind(const int fd, off_t * mark, const off_t pos, const int dirty){
+    if ((current() -> options.io & TAR_IO_FADVISE) && (pos - *mark >= DROP_WINDOW)){
+        drop_cache(fd, *mark, pos, dirty);
+        *mark = pos;
+    }
+}
 
-            free(parent);
+int member_order(void){
+    return current() -> options.reproducible?TAR_ORDER_NAME:current() -> options.order;
+}
 
-            tar = &((*tar) -> next);
-        }
-        else{ // if (((*tar) -> type == REGULAR) || ((*tar) -> type == NORMAL) || ((*tar) -> type == CONTIGUOUS) || ((*tar) -> type == SYMLINK) || ((*tar) -> type == CHAR) || ((*tar) -> type == BLOCK) || ((*tar) -> type == FIFO)){
-            V_PRINT(stdout, "Writing %s", (*tar) -> name);
+void locality_key(struct child * child){
+    const int order = member_order();
+    child -> key = (order == TAR_ORDER_INODE)?child -> ino:0;
 
-            char tarred = 0;   // whether or not the file has already been put into the archive
-            if (((*tar) -> type == REGULAR) || ((*tar) -> type == NORMAL) || ((*tar) -> type == CONTIGUOUS) || ((*tar) -> type == SYMLINK)){
-                struct tar_t * found = exists(*head, files[i], 1);
-                tarred = (found != (*tar));
+    // names alone decide
+    if (order == TAR_ORDER_NAME){
+        child -> ino = 0;
+        return;
+    }
 
-                // if file has already been included, modify the header
-                if (tarred){
-                    // change type to hard link
-                    (*tar) -> type = HARDLINK;
+    // files without extents (empty, inline, or not regular files) go first, by inode
+    #ifdef FS_IOC_FIEMAP
+    struct stat st;
+    if ((order != TAR_ORDER_EXTENT) || (lstat(child -> path, &st) < 0) || !S_ISREG(st.st_mode)){
+        return;
+    }
 
-                    // change link name to (*tar)red file name (both are the same)
-                    strncpy((*tar) -> link_name, (*tar) -> name, 100);
+    const int fd = open(child -> path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0){
+        return;
+    }
 
-                    // change size to 0
-                    memset((*tar) -> size, '0', sizeof((*tar) -> size) - 1);
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    if (!ioctl(fd, FS_IOC_FIEMAP, &request.map) && request.map.fm_mapped_extents){
+        child -> key = request.map.fm_extents[0].fe_physical;
+    }
+    close(fd);
+    #endif
+}
 
-                    // recalculate checksum
-                    calculate_checksum(*tar);
-                }
-            }
+int compare_children(const void * a, const void * b){
+    const struct child * x = a;
+    const struct child * y = b;
+    if (x -> key != y -> key){
+        return (x -> key < y -> key)?-1:1;
+    }
+    if (x -> ino != y -> ino){
+        return (x -> ino < y -> ino)?-1:1;
+    }
+    return strcmp(x -> path, y -> path);
+}
 
-            // write metadata to (*tar) file
-            if (write_size(fd, (*tar) -> block, 512) != 512){
-                WRITE_ERROR("Failed to write metadata to archive");
-            }
+void advise_willneed(const int fd, const off_t from, const off_t to){
+    #ifdef POSIX_FADV_WILLNEED
+    if (to > from){
+        posix_fadvise(fd, from, to - from, POSIX_FADV_WILLNEED);
+    }
+    #endif
+}
 
-            if (((*tar) -> type == REGULAR) || ((*tar) -> type == NORMAL) || ((*tar) -> type == CONTIGUOUS)){
-                // if the file isn't already in the tar file, copy the contents in
-                if (!tarred){
-                    int f = open((*tar) -> name, O_RDONLY);
-                    if (f < 0){
-                        WRITE_ERROR("Could not open %s", files[i]);
-                    }
+int write_header(struct tar_sink * sink, struct tar_t * entry, const char verbosity){
+    if (entry -> type != EXTENDED){
+        V_PRINT(stdout, "Writing %s", entry -> name);
+    }
 
-                    int r = 0;
-                    char buf[512];
-                    while ((r = read_size(f, buf, 512)) > 0){
-                        if (write_size(fd, buf, r) != r){
-                            RC_ERROR("Could not write to archive: %s", strerror(rc));
-                        }
-                    }
+    if (sink_write(sink, entry -> block, 512) != 512){
+        ERROR("Failed to write metadata to archive");
+    }
 
-                    close(f);
-                }
-            }
+    if (entry -> type != EXTENDED){
+        return 0;
+    }
 
-            // pad data to fill block
-            const unsigned int size = oct2uint((*tar) -> size, 11);
-            const unsigned int pad = 512 - size % 512;
-            if (pad != 512){
-                for(unsigned int j = 0; j < pad; j++){
-                    if (write_size(fd, "\0", 1) != 1){
-                        WRITE_ERROR("Could not write padding data");
-                    }
-                }
-                *offset += pad;
-            }
-            *offset += size;
-            tar = &((*tar) -> next);
+    // without seeking, the checksum has to be known before the data is written
+    struct tar_t * next = entry -> next;
+    if (!sink -> seek && next -> original_name[0]){
+        if (file_crc32c(next -> original_name, oct2uint(next -> size, 11), &next -> crc32c) < 0){
+            ERROR("Could not checksum %s", next -> original_name);
         }
+    }
 
-        // add metadata size
-        *offset += 512;
+    char record[512] = {0};
+    const int len = format_crc_record(record, next -> crc32c);
+    if ((sink_write(sink, record, 512) != 512) || (len < 0)){
+        ERROR("Failed to write extended header to archive");
     }
 
     return 0;
 }
 
-int write_end_data(const int fd, int size, const char verbosity){
-    if (fd < 0){
-        return -1;
+int finish_checksum(struct tar_sink * sink, struct tar_t * entry, const uint32_t crc, const char verbosity){
+    if (!entry -> has_crc32c){
+        return 0;
     }
 
-    // complete current record
-    const int pad = RECORDSIZE - (size % RECORDSIZE);
-    for(int i = 0; i < pad; i++){
-        if (write(fd, "\0", 1) != 1){
-            V_PRINT(stderr, "Error: Unable to close tar file");
-            return -1;
+    // already written up front
+    if (!sink -> seek){
+        if (crc != entry -> crc32c){
+            ERROR("%s changed while being archived", entry -> name);
         }
+        return 0;
     }
 
-    // if the current record does not have 2 blocks of zeros, add a whole other record
-    if (pad < (2 * BLOCKSIZE)){
-        for(int i = 0; i < RECORDSIZE; i++){
-            if (write(fd, "\0", 1) != 1){
-                V_PRINT(stderr, "Error: Unable to close tar file");
-                return -1;
-            }
+    entry -> crc32c = crc;
+
+    char record[512] = {0};
+    format_crc_record(record, crc);
+
+    // record is the block in front of the entry's metadata
+    const off_t at = (off_t) entry -> begin - BLOCKSIZE;
+    const off_t resume = entry -> begin + entry_span(entry);
+    if (sink -> fd >= 0){
+        if (pwrite(sink -> fd, record, 512, at) != 512){
+            RC_ERROR("Could not write checksum of %s: %s", entry -> name, strerror(rc));
         }
-        return pad + RECORDSIZE;
+    }
+    else if ((sink -> seek(sink -> data, at) != at) ||
+             (sink_write(sink, record, 512) != 512) ||
+             (sink -> seek(sink -> data, resume) != resume)){
+        RC_ERROR("Could not write checksum of %s: %s", entry -> name, strerror(rc));
     }
 
-    return pad;
+    return 0;
 }
 
-int check_match(struct tar_t * entry, const size_t filecount, const char * files[]){
-    if (!entry){
+int file_crc32c(const char * path, const unsigned int size, uint32_t * crc){
+    const int f = open(path, O_RDONLY);
+    if (f < 0){
         return -1;
     }
 
-    if (!filecount){
-        return 0;
-    }
-
-    if (filecount && !files){
+    char * buf = malloc(COPYSIZE);
+    if (!buf){
+        close(f);
         return -1;
     }
 
-    for(size_t i = 0; i < filecount; i++){
-        if (!strncmp(entry -> name, files[i], MAX(strlen(entry -> name), strlen(files[i])) + 1)){
-            return i + 1;
+    *crc = 0;
+    unsigned int got = 0;
+    while (got < size){
+        const int want = MIN(size - got, COPYSIZE);
+        throttle(want);
+        const int r = read_size(f, buf, want);
+        if (r < want){
+            // the same zeros write_entry pads a shrunken file with
+            memset(buf + r, 0, want - r);
         }
+        *crc = crc32c(*crc, buf, want);
+        got += want;
     }
 
+    free(buf);
+    close(f);
     return 0;
 }
 
-int read_size(int fd, char * buf, int size){
-    int got = 0, rc;
-    while ((got < size) && ((rc = read(fd, buf + got, size - got)) > 0)){
-        got += rc;
-    }
-    return got;
+int format_crc_record(char * record, const uint32_t crc){
+    // "<length> <keyword>=<value>\n" where length includes itself
+    return snprintf(record, 512, "%d %s=%08x\n", CRC_RECORD_LEN, CRC_KEYWORD, crc);
 }
 
-int write_size(int fd, char * buf, int size){
-    int wrote = 0, rc;
-    while ((wrote < size) && ((rc = write(fd, buf + wrote, size - wrote)) > 0)){
-        wrote += rc;
-    }
-    return wrote;
+int format_extended(struct tar_t * ext, struct tar_t * entry){
+    memset(ext -> block, 0, 512);
+    snprintf(ext -> name, sizeof(ext -> name), "PaxHeaders/%.88s", entry -> name);
+    snprintf(ext -> mode,  sizeof(ext -> mode),  "%07o", 0644);
+    memcpy(ext -> uid, entry -> uid, sizeof(ext -> uid));
+    memcpy(ext -> gid, entry -> gid, sizeof(ext -> gid));
+    snprintf(ext -> size,  sizeof(ext -> size),  "%011o", CRC_RECORD_LEN);
+    memcpy(ext -> mtime, entry -> mtime, sizeof(ext -> mtime));
+    ext -> type = EXTENDED;
+    memcpy(ext -> ustar, "ustar\x00" "00", 8);
+    calculate_checksum(ext);
+
+    entry -> has_crc32c = 1;
+    entry -> crc32c = 0;
+    return 0;
 }
 
-unsigned int oct2uint(char * oct, unsigned int size){
-    unsigned int out = 0;
-    int i = 0;
-    while ((i < size) && oct[i]){
-        out = (out << 3) | (unsigned int) (oct[i++] - '0');
+int parse_extended(const char * records, const size_t size, struct tar_t * entry){
+    const size_t keylen = strlen(CRC_KEYWORD);
+    size_t i = 0;
+    while (i < size){
+        // length of record (including the length itself)
+        size_t len = 0;
+        size_t j = i;
+        while ((j < size) && (records[j] >= '0') && (records[j] <= '9')){
+            len = len * 10 + (records[j++] - '0');
+        }
+
+        if (!len || (i + len > size) || (j >= size) || (records[j] != ' ') || (records[i + len - 1] != '\n')){
+            return -1;
+        }
+        j++;
+
+        if ((i + len - j > keylen + 1) && !strncmp(records + j, CRC_KEYWORD, keylen) && (records[j + keylen] == '=')){
+            entry -> crc32c = strtoul(records + j + keylen + 1, NULL, 16);
+            entry -> has_crc32c = 1;
+        }
+
+        i += len;
     }
-    return out;
+
+    return 0;
 }
 
-int iszeroed(char * buf, size_t size){
-    for(size_t i = 0; i < size; buf++, i++){
-        if (* (char *) buf){
-            return 0;
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void){
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t crc = i;
+        for(int j = 0; j < 8; j++){
+            crc = (crc >> 1) ^ ((crc & 1)?CRC32C_POLY:0);
+        }
+        crc32c_table[0][i] = crc;
+    }
+
+    for(uint32_t i = 0; i < 256; i++){
+        for(int j = 1; j < 8; j++){
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
         }
     }
-    return 1;
 }
 
-int recursive_mkdir(const char * dir, const unsigned int mode, const char verbosity){
-    int rc = 0;
-    const size_t len = strlen(dir);
+// slicing-by-8
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char * buf, size_t size){
+    pthread_once(&crc32c_once, crc32c_init);
 
-    if (!len){
-        return 0;
+    while (size && ((uintptr_t) buf & 7)){
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+        size--;
     }
 
-    char * path = calloc(len + 1, sizeof(char));
-    strncpy(path, dir, len);
+    while (size >= 8){
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+        #endif
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff]         ^ crc32c_table[6][(word >> 8) & 0xff]  ^
+              crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+        buf += 8;
+        size -= 8;
+    }
 
-    // remove last '/'
-    if (path[len - 1] ==  '/'){
-       path[len - 1] = 0;
+    while (size--){
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
     }
 
-    // all subsequent directories do not exist
-    for(char * p = path + 1; *p; p++){
-        if (*p == '/'){
-            *p = '\0';
+    return crc;
+}
 
-            if ((rc = mkdir(path, mode?mode:DEFAULT_DIR_MODE))){
-                EXIST_ERROR("Could not create directory %s: %s", path, strerror(rc));
-            }
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
 
-            *p = '/';
-        }
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char * buf, size_t size){
+    uint64_t crc64 = crc;
+
+    while (size && ((uintptr_t) buf & 7)){
+        crc64 = _mm_crc32_u8(crc64, *buf++);
+        size--;
     }
 
-    if (mkdir(path, mode?mode:DEFAULT_DIR_MODE) < 0){
-        EXIST_ERROR("Could not create directory %s: %s", path, strerror(rc));
+    while (size >= 8){
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        size -= 8;
     }
 
-    free(path);
-    return 0;
+    while (size--){
+        crc64 = _mm_crc32_u8(crc64, *buf++);
+    }
+
+    return crc64;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const char * buf, const size_t size){
+    crc = ~crc;
+
+    #if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    if (__builtin_cpu_supports("sse4.2")){
+        return ~crc32c_hw(crc, (const unsigned char *) buf, size);
+    }
+    #endif
+
+    return ~crc32c_sw(crc, (const unsigned char *) buf, size);
 }
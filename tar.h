@@ -31,7 +31,9 @@ THE SOFTWARE
 #endif
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +41,7 @@ THE SOFTWARE
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <grp.h>
 #include <pwd.h>
 #if !defined(__APPLE__)
@@ -48,6 +51,7 @@ THE SOFTWARE
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define DEFAULT_DIR_MODE S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH // 0755
@@ -66,6 +70,28 @@ THE SOFTWARE
 #define DIRECTORY       '5'
 #define FIFO            '6'
 #define CONTIGUOUS      '7'
+#define EXTENDED        'x'             // POSIX.1-2001 extended header for the next entry
+#define GNU_LONGNAME    'L'             // GNU header holding the name of the next entry
+#define GNU_LONGLINK    'K'             // GNU header holding the link name of the next entry
+
+// I/O modes (may be combined)
+#define TAR_IO_FADVISE   1                  // tell the kernel about sequential access and drop pages once they are used
+#define TAR_IO_DIRECT    2                  // bypass the page cache for file data (O_DIRECT) where the file system allows it
+
+// tar_options.order values
+#define TAR_ORDER_INODE  1                  // archive directory contents by inode number
+#define TAR_ORDER_EXTENT 2                  // archive directory contents by the physical location of their first extent (FIEMAP)
+#define TAR_ORDER_NAME   3                  // archive directory contents sorted by name (byte order)
+
+// tar_options.skip flags
+#define TAR_SKIP_STAT    1                  // leave existing files with the same size and modification time untouched
+#define TAR_SKIP_CONTENT 2                  // leave existing files with the same size and data untouched
+
+// tar_ls_format formats
+#define TAR_LIST_TEXT    0                  // same as tar_ls
+#define TAR_LIST_NDJSON  1                  // one JSON object per line
+#define TAR_LIST_CSV     2                  // header row, then one row per entry
+#define TAR_LIST_BINARY  3                  // struct tar_list_record followed by name and link name
 
 // tar entry metadata structure (singly-linked list)
 struct tar_t {
@@ -103,20 +129,186 @@ struct tar_t {
         char block[512];                    // raw memory (500 octets of actual data, padded to 1 block)
     };
 
+    uint32_t crc32c;                        // checksum of data from the extended header in front of this entry
+    char has_crc32c;                        // whether or not crc32c is known
+
     struct tar_t * next;
 };
 
+// destination of archive data
+struct tar_sink {
+    ssize_t (*write)(void * data, const char * buf, const size_t size);    // returns number of octets written or -1
+    off_t (*seek)(void * data, const off_t offset);                         // optional; move to absolute offset, returns offset or -1
+    void * data;                                                            // passed to callbacks
+    int fd;                                                                 // file descriptor behind the sink (-1 if none)
+};
+
+// growable memory buffer used by tar_sink_memory
+struct tar_memory {
+    char * buf;                             // free when done
+    size_t size;                            // octets of archive data
+    size_t capacity;
+    size_t pos;                             // current write position
+};
+
+// fills buf with up to size octets of member data
+// returns the number of octets produced (0 when there is no more data) or -1
+typedef ssize_t (*tar_producer)(void * data, char * buf, const size_t size);
+
+// member whose metadata and data come from the caller instead of the filesystem
+struct tar_source {
+    const char * name;                      // name in archive (at most 99 characters)
+    char type;                              // file type value (0 = NORMAL)
+    mode_t mode;                            // permissions
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    const char * owner;                     // optional user name
+    const char * group;                     // optional group name
+    const char * link_name;                 // target of links
+
+    size_t size;                            // octets of data (less than 8 GiB)
+    const char * buf;                       // data in one buffer,
+    const struct iovec * iov;               // or in a scatter-gather list,
+    int iovcnt;
+    tar_producer producer;                  // or from a callback
+    void * data;                            // passed to producer
+};
+
+// binary listing record (host byte order)
+struct tar_list_record {
+    uint64_t offset;                        // location of the entry in the archive
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t crc32c;                        // valid if has_crc32c is set
+    uint16_t name_len;                      // octets of name following the record
+    uint16_t link_len;                      // octets of link name following the name
+    char type;
+    char has_crc32c;
+    char reserved[2];
+};
+
+// progress of a long running call
+struct tar_progress {
+    unsigned long long bytes;               // octets of archive written, data extracted or archive passed by tar_remove
+    unsigned long long total_bytes;         // 0 if not known in advance
+    unsigned long long entries;             // members done
+    unsigned long long total_entries;       // 0 if not known in advance
+    const char * name;                      // member being worked on
+    double elapsed;                         // seconds since the call started
+};
+
+// called at most once per progress_interval and once at the end of tar_write, tar_extract and tar_remove
+// may be called from the library's worker threads, but never from two at once
+// returning nonzero cancels the call at the next member boundary (the archive is left valid)
+typedef int (*tar_progress_fn)(const struct tar_progress * progress, void * data);
+
+// library settings
+struct tar_options {
+    size_t readers;                         // number of threads prefetching file data while creating an archive (0 = read inline)
+    size_t buffers;                         // number of buffers in the prefetch ring
+    size_t buffer_size;                     // size of each prefetch buffer (multiple of BLOCKSIZE)
+    int io;                                 // TAR_IO_* flags used by tar_read, tar_write and tar_extract
+    int checksums;                          // store a CRC32C of each file's data in an extended header when writing
+    int skip;                               // TAR_SKIP_* checks tar_extract uses to leave matching files alone
+    int order;                              // TAR_ORDER_* order of directory contents when writing (0 = readdir order)
+    int quiet;                              // keep error messages in the context (tar_error) instead of also printing them
+    const char * journal;                   // file recording the progress of tar_write and tar_extract (NULL = none)
+    size_t checkpoint;                      // octets of archive between journal records (0 = after every member)
+    int resume;                             // continue from the record in the journal instead of starting over
+    size_t rate_bytes;                      // octets per second of file and archive I/O (0 = unlimited)
+    size_t rate_ops;                        // I/O requests per second (0 = unlimited)
+    int idle;                               // run reads and writes in the idle I/O scheduling class (Linux)
+    int dedup;                              // store files with the same data as an earlier file as hard links to it
+    tar_progress_fn progress;               // progress callback (NULL = none)
+    void * progress_data;                   // passed to progress
+    unsigned int progress_interval;         // milliseconds between progress calls
+    int reproducible;                       // headers depend only on names and contents: name order, no owner names, modes 0644/0755
+    long long clamp_mtime;                  // modification times later than this are stored as this (-1 = none, e.g. SOURCE_DATE_EPOCH)
+    long long owner;                        // uid stored for every member (-1 = the file's)
+    long long group;                        // gid stored for every member (-1 = the file's)
+};
+
 // core functions //////////////////////////////////////////////////////////////
 // read a tar file
 // archive should be address to null pointer
+// headers are read from the start of the file without using the file descriptor offset
 int tar_read(const int fd, struct tar_t ** archive, const char verbosity);
 
 // write to a tar file
 // if archive contains data, the new data will be appended to the back of the file (terminating blocks will be rewritten)
 int tar_write(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity);
 
+// write to a sink
+// appending to an archive requires a sink that can seek
+// with a journal, the sink has to be a file, and resuming requires the same call on the partly written file, opened for reading and writing
+int tar_write_sink(struct tar_sink * sink, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity);
+
+// write members from memory to a sink
+// data is taken from producer if set, else from iov if set, else from buf
+// a member that cannot be written is left out of archive, and the archive ends where it would have started if the sink can seek
+int tar_write_sources(struct tar_sink * sink, struct tar_t ** archive, const size_t count, const struct tar_source sources[], const char verbosity);
+
+// create an archive with one writer thread per shard
+// files are split into shards of about the same number of octets, keeping their order
+// with one file descriptor, every shard is written at its final offset so the result is a single archive
+// with one file descriptor per shard, each shard is written as a standalone archive (begin is relative to its shard)
+int tar_write_sharded(const int fds[], const size_t fdcount, const size_t shards, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity);
+
+// write files to a sink without keeping their headers, so memory does not grow with the number of files
+// only files with more than one name are remembered, until all of their names were seen, so they can be stored as hard links
+// when that takes more than memory octets (0 = 8 MiB), the rest is kept in sorted runs in a temporary file
+int tar_write_stream(struct tar_sink * sink, const size_t filecount, const char * files[], const size_t memory, const char verbosity);
+
+// append files to an existing archive without reading its catalog
+// the end of the archive is found by following the headers, without keeping them
+int tar_append(const int fd, const size_t filecount, const char * files[], const char verbosity);
+
 // recursive freeing of entries
 void tar_free(struct tar_t * archive);
+
+// sink writing to a seekable file descriptor
+void tar_sink_fd(struct tar_sink * sink, const int fd);
+
+// sink writing to a pipe, socket or other file descriptor that cannot seek
+void tar_sink_pipe(struct tar_sink * sink, const int fd);
+
+// sink writing into memory
+// memory should be zeroed before first use
+void tar_sink_memory(struct tar_sink * sink, struct tar_memory * memory);
+
+// get current settings
+void tar_get_options(struct tar_options * options);
+
+// change settings used by subsequent calls
+int tar_set_options(const struct tar_options * options);
+// /////////////////////////////////////////////////////////////////////////////
+
+// contexts ////////////////////////////////////////////////////////////////////
+// a context holds settings, the last error and user/group name lookups
+// each thread uses the context bound to it; threads without one share a process wide default context
+// archives can be processed on many threads at once if each thread binds its own context
+struct tar_ctx;
+
+// create a context with the default settings
+struct tar_ctx * tar_ctx_new(void);
+
+// free a context; it must not be bound to any thread
+void tar_ctx_free(struct tar_ctx * ctx);
+
+// bind a context to the calling thread (NULL = default context)
+// returns the context bound before (NULL = default context)
+struct tar_ctx * tar_ctx_use(struct tar_ctx * ctx);
+
+// last error recorded in the calling thread's context ("" if none)
+const char * tar_error(void);
+
+// change the I/O rate limits of a context, including while another thread is using it (NULL = calling thread's context)
+// limits are shared by all threads using the context; 0 removes a limit
+int tar_throttle(struct tar_ctx * ctx, const size_t rate_bytes, const size_t rate_ops);
 // /////////////////////////////////////////////////////////////////////////////
 
 // utilities ///////////////////////////////////////////////////////////////////
@@ -125,16 +317,164 @@ void tar_free(struct tar_t * archive);
 int tar_ls(FILE * f, struct tar_t * archive, const size_t filecount, const char * files[], const char verbosity);
 
 // extracts files from an archive
+// with a journal, resuming requires the same archive and file list
 int tar_extract(const int fd, struct tar_t * archive, const size_t filecount, const char * files[], const char verbosity);
 
 // update files in tar with provided list
+// members whose new data fits into their old space are overwritten in place; others are appended
 int tar_update(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity);
 
+// drop members shadowed by later members with the same name, moving the rest down in one pass
+// returns the number of members dropped
+int tar_compact(const int fd, struct tar_t ** archive, const char verbosity);
+
 // remove entries from tar
 int tar_remove(const int fd, struct tar_t ** archive, const size_t filecount, const char * files[], const char verbosity);
 
 // show files that are missing from the current directory
 int tar_diff(FILE * f, struct tar_t * archive, const char verbosity);
+
+// check data of entries against the checksums stored in their extended headers
+// returns the number of entries that were checked, or -1 if any of them did not match
+int tar_verify(const int fd, struct tar_t * archive, const char verbosity);
+// /////////////////////////////////////////////////////////////////////////////
+
+// member selection ////////////////////////////////////////////////////////////
+// a pattern matches a member with that exact name, any member inside a directory with that name,
+// or, if it contains wildcards (*, ?, [...]), any member whose name or leading directory it matches
+// a member is selected if it matches an include pattern (or there are none) and no exclude pattern
+struct tar_filter;
+
+// compile pattern lists into prefix trees, so checking a name costs about its length
+struct tar_filter * tar_filter_compile(const size_t count, const char * patterns[], const size_t excludecount, const char * excludes[]);
+
+// returns index + 1 of an include pattern selecting name (1 if there are no include patterns), or 0
+int tar_filter_match(const struct tar_filter * filter, const char * name);
+
+// free a filter
+void tar_filter_free(struct tar_filter * filter);
+
+// same as tar_ls, tar_extract and tar_remove, but with compiled patterns
+// a NULL filter selects every member, except for tar_remove, which then removes nothing
+int tar_ls_filter(FILE * f, struct tar_t * archive, const struct tar_filter * filter, const char verbosity);
+int tar_extract_filter(const int fd, struct tar_t * archive, const struct tar_filter * filter, const char verbosity);
+int tar_remove_filter(const int fd, struct tar_t ** archive, const struct tar_filter * filter, const char verbosity);
+
+// print contents of archive as text, NDJSON, CSV or binary records (TAR_LIST_*)
+// output is formatted into a large buffer and written in few calls
+// filter may be NULL; verbosity only changes TAR_LIST_TEXT output
+int tar_ls_format(FILE * f, struct tar_t * archive, const struct tar_filter * filter, const int format, const char verbosity);
+// /////////////////////////////////////////////////////////////////////////////
+
+// archive transformation //////////////////////////////////////////////////////
+// called with a copy of each selected member's header before the member is copied
+// the name and metadata may be changed, but not the size
+// returns 0 to copy the member, 1 to leave it out, or -1 to stop
+typedef int (*tar_rewrite)(struct tar_t * entry, void * data);
+
+// archive read by tar_read
+struct tar_input {
+    int fd;
+    struct tar_t * archive;
+};
+
+// copy members of one or more archives to a sink without extracting them
+// headers are rewritten in memory and data is copied from the inputs, in the kernel when the sink is a file
+// extended and GNU long name headers stay with their members, which are selected by their full name
+// a name or link name changed by rewrite replaces the one such a header gave; filter and rewrite may be NULL
+// the sink must not write to any of the inputs
+int tar_transform(struct tar_sink * sink, struct tar_t ** archive, const size_t count, const struct tar_input inputs[], const struct tar_filter * filter, tar_rewrite rewrite, void * data, const char verbosity);
+// /////////////////////////////////////////////////////////////////////////////
+
+// concurrent member access ////////////////////////////////////////////////////
+// a reader can be shared by any number of threads; it never moves the file descriptor offset
+struct tar_reader;
+
+// a single member of an archive opened through a reader
+struct tar_member;
+
+// block cache counters
+struct tar_reader_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+};
+
+// index an archive for concurrent access
+// up to cache_size octets of archive data are kept in an LRU cache (0 disables caching)
+// fails on a header with a bad checksum or an archive that ends inside a member
+struct tar_reader * tar_reader_open(const int fd, const size_t cache_size, const char verbosity);
+
+// free a reader; all of its members must be closed first
+void tar_reader_close(struct tar_reader * reader);
+
+// get block cache counters
+void tar_reader_stats(struct tar_reader * reader, struct tar_reader_stats * stats);
+
+// open the latest member with the given name
+struct tar_member * tar_member_open(struct tar_reader * reader, const char * name);
+
+// metadata of an opened member
+const struct tar_t * tar_member_entry(struct tar_member * member);
+
+// read member data starting at offset (relative to the start of the member's data)
+// returns the number of octets read (0 at end of member) or -1
+ssize_t tar_member_pread(struct tar_member * member, void * buf, const size_t size, const off_t offset);
+
+// free a member
+void tar_member_close(struct tar_member * member);
+// /////////////////////////////////////////////////////////////////////////////
+
+// non-blocking state machines /////////////////////////////////////////////////
+// nothing can be done until there is more input, more members or more room on a file descriptor
+#define TAR_AGAIN        (-2)
+
+// tar_decoder_feed events
+#define TAR_EVENT_HEADER 1                  // entry holds the header of the next member
+#define TAR_EVENT_DATA   2                  // data and size hold the next piece of the member's data
+#define TAR_EVENT_END    3                  // end of archive
+
+struct tar_event {
+    int type;                               // TAR_EVENT_*
+    const struct tar_t * entry;             // valid until the next header
+    const char * data;                      // points into the fed buffer
+    size_t size;
+};
+
+// produces an archive piece by piece
+struct tar_encoder;
+
+// parses an archive fed to it piece by piece
+struct tar_decoder;
+
+struct tar_encoder * tar_encoder_new(void);
+void tar_encoder_free(struct tar_encoder * encoder);
+
+// queue a file (directories are added without their contents) or a member from memory (buf or iov data must stay valid)
+int tar_encoder_add_file(struct tar_encoder * encoder, const char * path, const char verbosity);
+int tar_encoder_add_source(struct tar_encoder * encoder, const struct tar_source * source, const char verbosity);
+
+// no more members will be queued; the end of the archive follows the last one
+int tar_encoder_finish(struct tar_encoder * encoder);
+
+// produce up to size octets of archive
+// returns the number of octets produced, 0 once the archive is complete, TAR_AGAIN if no members are queued, or -1
+ssize_t tar_encoder_read(struct tar_encoder * encoder, char * buf, const size_t size);
+
+// write as much of the archive as a (non-blocking) file descriptor takes
+// returns 0 once the archive is complete, TAR_AGAIN if fd would block or no members are queued, or -1
+int tar_encoder_send(struct tar_encoder * encoder, const int fd);
+
+struct tar_decoder * tar_decoder_new(void);
+void tar_decoder_free(struct tar_decoder * decoder);
+
+// parse up to size octets of archive; used is set to the number of octets taken
+// returns 1 with an event, TAR_AGAIN once all input was taken without one, 0 after the end of the archive, or -1
+// data whose checksum was stored in an extended header is checked as it passes
+int tar_decoder_feed(struct tar_decoder * decoder, const char * buf, const size_t size, size_t * used, struct tar_event * event);
+
+// same as tar_decoder_feed, reading from a (non-blocking) file descriptor into an internal buffer
+// returns TAR_AGAIN if fd would block; event data is valid until the next call
+int tar_decoder_recv(struct tar_decoder * decoder, const int fd, struct tar_event * event);
 // /////////////////////////////////////////////////////////////////////////////
 
 // internal functions; generally don't call from outside ///////////////////////
@@ -150,26 +490,49 @@ struct tar_t * exists(struct tar_t * archive, const char * filename, const char
 // read file and construct metadata
 int format_tar_data(struct tar_t * entry, const char * filename, const char verbosity);
 
+// construct metadata from the results of lstat
+int format_tar_stat(struct tar_t * entry, const char * filename, const struct stat * st, const char verbosity);
+
+// construct metadata from caller supplied values
+int format_tar_source(struct tar_t * entry, const struct tar_source * source, const char verbosity);
+
 // calculate checksum (6 ASCII octet digits + NULL + space)
 unsigned int calculate_checksum(struct tar_t * entry);
 
+// check whether a block is a header with a correct checksum
+int valid_header(const char * block);
+
+// continue a CRC32C (Castagnoli) over size octets (start with crc = 0)
+// uses SSE4.2 when the processor has it
+uint32_t crc32c(uint32_t crc, const char * buf, const size_t size);
+
+// build an extended header holding the checksum of the entry that follows it
+int format_extended(struct tar_t * ext, struct tar_t * entry);
+
+// read records of an extended header into the entry that follows it
+int parse_extended(const char * records, const size_t size, struct tar_t * entry);
+
+// find where the next entry of an archive would go
+// only the headers are read; member data is skipped
+int find_end(const int fd, off_t * end, const char verbosity);
+
 // print single entry
 // verbosity should be greater than 0
-int ls_entry(FILE * f, struct tar_t * archive, const size_t filecount, const char * files[], const char verbosity);
+int ls_entry(FILE * f, struct tar_t * archive, const struct tar_filter * filter, const char verbosity);
 
 // extracts a single entry
-// expects file descriptor offset to already be set to correct location
+// data is read at the entry's offset; the file descriptor offset is not used
 int extract_entry(const int fd, struct tar_t * entry, const char verbosity);
 
 // write entries to a tar file
-int write_entries(const int fd, struct tar_t ** archive, struct tar_t ** head, const size_t filecount, const char * files[], int * offset, const char verbosity);
+int write_entries(struct tar_sink * sink, struct tar_t ** archive, struct tar_t ** head, const size_t filecount, const char * files[], int * offset, const char verbosity);
 
 // add ending data
-int write_end_data(const int fd, int size, const char verbosity);
+int write_end_data(struct tar_sink * sink, int size, const char verbosity);
 
-// check if entry is a match for any of the given file names
-// returns index + 1 if match is found
-int check_match(struct tar_t * entry, const size_t filecount, const char * files[]);
+// check if entry is selected by the filter
+// returns index + 1 of the matching pattern if match is found
+int check_match(struct tar_t * entry, const struct tar_filter * filter);
 // /////////////////////////////////////////////////////////////////////////////
 
 #endif